@@ -25,6 +25,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "libdmk.h"
 
@@ -56,6 +58,11 @@ int main (int argc, char *argv[])
 
   uint8_t buf [1024];
 
+  int track_class;
+  uint8_t fill;
+  long track_bytes = 0;   /* raw size of the last formatted track */
+  int pending_holes = 0;  /* unformatted tracks seen before any formatted one */
+
   int i;
 
   if (argc != 3)
@@ -90,6 +97,20 @@ int main (int argc, char *argv[])
 	    exit (2);
 	  }
 
+	/* leave a hole the size of a formatted track for unformatted ones */
+	track_class = dmk_track_class (h, & fill);
+	if (track_class == DMK_TRACK_UNFORMATTED)
+	  {
+	    if (! track_bytes)
+	      pending_holes++;
+	    else if (0 != fseek (outf, track_bytes, SEEK_CUR))
+	      {
+		fprintf (stderr, "error writing raw file\n");
+		exit (2);
+	      }
+	    continue;
+	  }
+
 	if (! dmk_read_id (h, & sector_info [0]))
 	  {
 	    fprintf (stderr, "error reading sector info on cylinder %d head %d\n", cylinder, head);
@@ -121,6 +142,32 @@ int main (int argc, char *argv[])
 	    exit (2);
 	  }
 
+	track_bytes = 0;
+	for (i = 0; i < sector_count; i++)
+	  track_bytes += 128 << sector_info [i].size_code;
+	if (pending_holes)
+	  {
+	    if (0 != fseek (outf, pending_holes * track_bytes, SEEK_CUR))
+	      {
+		fprintf (stderr, "error writing raw file\n");
+		exit (2);
+	      }
+	    pending_holes = 0;
+	  }
+
+	if (track_class == DMK_TRACK_BLANK)
+	  {
+	    /* every sector is known to hold only the fill byte */
+	    memset (buf, fill, sizeof (buf));
+	    for (sector = min_sector; sector <= max_sector; sector++)
+	      if (1 != fwrite (buf, 128 << sector_info [sector_index [sector]].size_code, 1, outf))
+		{
+		  fprintf (stderr, "error writing raw file\n");
+		  exit (2);
+		}
+	    continue;
+	  }
+
 	for (sector = min_sector; sector <= max_sector; sector++)
 	  {
 	    if (dmk_read_sector (h,
@@ -152,6 +199,12 @@ int main (int argc, char *argv[])
 
   dmk_close_image (h);
 
+  /* make the file long enough to include any trailing hole */
+  if ((0 != fflush (outf)) || (0 != ftruncate (fileno (outf), ftell (outf))))
+    {
+      fprintf (stderr, "error writing raw file\n");
+      exit (2);
+    }
   fclose (outf);
 
   exit (0);
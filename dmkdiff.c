@@ -0,0 +1,389 @@
+/*
+ * dmkdiff - compare two DMK images sector by sector
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libdmk.h"
+#include "dmksimd.h"
+
+
+#define MAX_THREADS 64
+
+
+char *progname;
+
+
+void usage (void)
+{
+  fprintf (stderr, "usage:\n"
+	   "%s [options] <image-a.dmk> <image-b.dmk>\n"
+	   "    -j <threads>  number of threads (default one per CPU)\n"
+	   "    -q            only report whether the images differ\n",
+	   progname);
+  exit (1);
+}
+
+
+typedef struct
+{
+  char *fn [2];
+  int ds;
+  int cylinders;
+  int quiet;  /* boolean */
+
+  int next_track;       /* shared by all workers */
+  int error;            /* boolean */
+  int differences;
+  char **report;        /* per-track text, printed in order at the end */
+  size_t *report_size;
+} diff_t;
+
+
+static char *status_name (int status)
+{
+  switch (status)
+    {
+    case 1:  return ("good");
+    case -1: return ("bad");
+    default: return ("missing");
+    }
+}
+
+
+static void print_id (FILE *f, sector_info_t *id)
+{
+  fprintf (f, "cyl %d head %d sector %d", id->cylinder, id->head, id->sector);
+}
+
+
+/*
+ * Find the sector in b that matches the i'th sector of a: the same
+ * logical cylinder, head and sector, counting duplicates in order.
+ */
+static int match_sector (dmk_sector_t *a, int i, dmk_sector_t *b, int b_count,
+			 int *used)
+{
+  int j;
+
+  for (j = 0; j < b_count; j++)
+    if ((! used [j]) &&
+	(b [j].id.cylinder == a [i].id.cylinder) &&
+	(b [j].id.head     == a [i].id.head) &&
+	(b [j].id.sector   == a [i].id.sector))
+      return (j);
+  return (-1);
+}
+
+
+/*
+ * Copy a sector's data out of its track in image file format, by the
+ * offset dmk_track_sectors found for it.  Reading it by ID instead
+ * would find the first of several sectors with the same ID.
+ */
+static int sector_data (uint8_t *raw, int raw_length, dmk_sector_t *s,
+			uint8_t *buf)
+{
+  int size = dmk_sector_size (& s->id);
+  int step, i;
+
+  if ((size > 4096) || (s->data_length < size) || (s->data_length % size) ||
+      (2 * DMK_MAX_SECTOR + s->data_offset + s->data_length > raw_length))
+    return (0);
+  step = s->data_length / size;
+  for (i = 0; i < size; i++)
+    buf [i] = raw [2 * DMK_MAX_SECTOR + s->data_offset + i * step];
+  return (1);
+}
+
+
+/* raw holds each image's current track, read on first use */
+static int compare_sectors (FILE *f, dmk_handle *h, uint8_t **raw,
+			    dmk_sector_t *a, dmk_sector_t *b)
+{
+  int differences = 0;
+  uint8_t buf [2][4096];
+  int len, first, count;
+  int k;
+
+#define REPORT(...) do { differences++; if (f) { print_id (f, & a->id); \
+			 fprintf (f, __VA_ARGS__); } } while (0)
+
+  if (a->id.size_code != b->id.size_code)
+    REPORT (": size code %d, %d\n", a->id.size_code, b->id.size_code);
+  if (a->id.mode != b->id.mode)
+    REPORT (": mode %d, %d\n", a->id.mode, b->id.mode);
+  if (a->id_status != b->id_status)
+    REPORT (": ID CRC %s, %s\n", status_name (a->id_status),
+	    status_name (b->id_status));
+  if (a->data_mark != b->data_mark)
+    REPORT (": data mark %02x, %02x\n", a->data_mark, b->data_mark);
+  if (a->data_status != b->data_status)
+    REPORT (": data CRC %s, %s\n", status_name (a->data_status),
+	    status_name (b->data_status));
+
+  if ((! a->data_status) || (! b->data_status) ||
+      (a->id.size_code != b->id.size_code) || (a->hash == b->hash))
+    return (differences);
+
+  /* hashes differ, so look at the bytes to say where */
+  for (k = 0; k < 2; k++)
+    if (! raw [k])
+      {
+	raw [k] = malloc (dmk_raw_track_length (h [k]));
+	if (raw [k] && ! dmk_read_track_raw (h [k], raw [k]))
+	  {
+	    free (raw [k]);
+	    raw [k] = NULL;
+	  }
+      }
+  if ((! raw [0]) || (! raw [1]) ||
+      (! sector_data (raw [0], dmk_raw_track_length (h [0]), a, buf [0])) ||
+      (! sector_data (raw [1], dmk_raw_track_length (h [1]), b, buf [1])))
+    {
+      REPORT (": can't read sector data\n");
+      return (differences);
+    }
+  len = dmk_sector_size (& a->id);
+  first = simd_mismatch (buf [0], buf [1], len);
+  if (first < len)
+    {
+      count = simd_count_diff (buf [0] + first, buf [1] + first, len - first);
+      REPORT (": data differs in %d byte%s, first at offset %d\n",
+	      count, (count == 1) ? "" : "s", first);
+    }
+
+#undef REPORT
+
+  return (differences);
+}
+
+
+static int compare_track (diff_t *diff, FILE *f, dmk_handle *h,
+			  int cylinder, int head)
+{
+  dmk_sector_t sectors [2][DMK_MAX_SECTOR];
+  int count [2];
+  int used [DMK_MAX_SECTOR];
+  uint8_t *raw [2] = { NULL, NULL };
+  int differences = 0;
+  int i, j, k;
+
+  for (k = 0; k < 2; k++)
+    {
+      if (! dmk_seek (h [k], cylinder, head))
+	return (-1);
+      count [k] = dmk_track_sectors (h [k], sectors [k]);
+      if (count [k] < 0)
+	return (-1);
+    }
+
+  memset (used, 0, sizeof (used));
+  for (i = 0; i < count [0]; i++)
+    {
+      j = match_sector (sectors [0], i, sectors [1], count [1], used);
+      if (j < 0)
+	{
+	  differences++;
+	  if (f)
+	    {
+	      print_id (f, & sectors [0][i].id);
+	      fprintf (f, ": only in %s\n", diff->fn [0]);
+	    }
+	  continue;
+	}
+      used [j] = 1;
+      differences += compare_sectors (f, h, raw, & sectors [0][i],
+				      & sectors [1][j]);
+    }
+
+  for (j = 0; j < count [1]; j++)
+    if (! used [j])
+      {
+	differences++;
+	if (f)
+	  {
+	    print_id (f, & sectors [1][j].id);
+	    fprintf (f, ": only in %s\n", diff->fn [1]);
+	  }
+      }
+
+  free (raw [0]);
+  free (raw [1]);
+  return (differences);
+}
+
+
+void *diff_worker (void *arg)
+{
+  diff_t *diff = arg;
+  dmk_handle h [2];
+  int ds, dd, cylinders;
+  int track, k;
+  int differences;
+  FILE *f;
+
+  /* handles aren't shared between threads, so each worker opens its own */
+  for (k = 0; k < 2; k++)
+    {
+      h [k] = dmk_open_image (diff->fn [k], 0, & ds, & cylinders, & dd);
+      if (! h [k])
+	{
+	  diff->error = 1;
+	  if (k)
+	    dmk_close_image (h [0]);
+	  return (NULL);
+	}
+    }
+
+  while ((track = __atomic_fetch_add (& diff->next_track, 1, __ATOMIC_RELAXED)) <
+	 diff->cylinders * (diff->ds + 1))
+    {
+      f = NULL;
+      if (! diff->quiet)
+	f = open_memstream (& diff->report [track], & diff->report_size [track]);
+      differences = compare_track (diff, f, h,
+				   track / (diff->ds + 1), track % (diff->ds + 1));
+      if (f)
+	fclose (f);
+      if (differences < 0)
+	{
+	  fprintf (stderr, "error reading cylinder %d head %d\n",
+		   track / (diff->ds + 1), track % (diff->ds + 1));
+	  diff->error = 1;
+	  continue;
+	}
+      __atomic_fetch_add (& diff->differences, differences, __ATOMIC_RELAXED);
+    }
+
+  dmk_close_image (h [0]);
+  dmk_close_image (h [1]);
+  return (NULL);
+}
+
+
+int main (int argc, char *argv[])
+{
+  diff_t diff;
+  pthread_t thread [MAX_THREADS];
+  int thread_count = sysconf (_SC_NPROCESSORS_ONLN);
+  dmk_handle h;
+  int ds [2], dd [2], cylinders [2];
+  int i, k;
+
+  progname = argv [0];
+  memset (& diff, 0, sizeof (diff));
+
+  while (argc > 1)
+    {
+      if (strcmp (argv [1], "-j") == 0)
+	{
+	  if (argc < 3)
+	    usage ();
+	  thread_count = atoi (argv [2]);
+	  argc--;
+	  argv++;
+	}
+      else if (strcmp (argv [1], "-q") == 0)
+	diff.quiet = 1;
+      else if (argv [1][0] == '-')
+	{
+	  fprintf (stderr, "unrecognized option '%s'\n", argv [1]);
+	  usage ();
+	}
+      else if (! diff.fn [0])
+	diff.fn [0] = argv [1];
+      else if (! diff.fn [1])
+	diff.fn [1] = argv [1];
+      else
+	usage ();
+      argc--;
+      argv++;
+    }
+  if (! diff.fn [1])
+    usage ();
+  if (thread_count < 1)
+    thread_count = 1;
+  if (thread_count > MAX_THREADS)
+    thread_count = MAX_THREADS;
+
+  for (k = 0; k < 2; k++)
+    {
+      h = dmk_open_image (diff.fn [k], 0, & ds [k], & cylinders [k], & dd [k]);
+      if (! h)
+	{
+	  fprintf (stderr, "error opening %s\n", diff.fn [k]);
+	  exit (2);
+	}
+      dmk_close_image (h);
+    }
+
+  if (ds [0] != ds [1])
+    {
+      diff.differences++;
+      if (! diff.quiet)
+	printf ("images are %s and %s sided, comparing head 0 only\n",
+		ds [0] ? "double" : "single", ds [1] ? "double" : "single");
+    }
+  if (cylinders [0] != cylinders [1])
+    {
+      diff.differences++;
+      if (! diff.quiet)
+	printf ("images have %d and %d cylinders\n", cylinders [0], cylinders [1]);
+    }
+  if ((dd [0] != dd [1]) && ! diff.quiet)
+    printf ("images are %s and %s density\n",
+	    dd [0] ? "double" : "single", dd [1] ? "double" : "single");
+
+  diff.ds = ds [0] && ds [1];
+  diff.cylinders = (cylinders [0] < cylinders [1]) ? cylinders [0] : cylinders [1];
+  diff.report = calloc (diff.cylinders * (diff.ds + 1), sizeof (char *));
+  diff.report_size = calloc (diff.cylinders * (diff.ds + 1), sizeof (size_t));
+  if ((! diff.report) || (! diff.report_size))
+    exit (2);
+
+  for (i = 0; i < thread_count; i++)
+    if (pthread_create (& thread [i], NULL, diff_worker, & diff))
+      {
+	fprintf (stderr, "can't create thread\n");
+	exit (2);
+      }
+  for (i = 0; i < thread_count; i++)
+    pthread_join (thread [i], NULL);
+
+  for (i = 0; i < diff.cylinders * (diff.ds + 1); i++)
+    if (diff.report [i])
+      {
+	fputs (diff.report [i], stdout);
+	free (diff.report [i]);
+      }
+
+  if (diff.error)
+    exit (2);
+  if (diff.quiet && diff.differences)
+    printf ("%s and %s differ\n", diff.fn [0], diff.fn [1]);
+  exit (diff.differences ? 1 : 0);
+}
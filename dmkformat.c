@@ -71,6 +71,7 @@ int main (int argc, char *argv[])
 	  sector_info [i].mode       = DMK_FM;
 	  sector_info [i].write_data = 1;
 	  sector_info [i].data_value = 0xe5;  /* not used */
+	  sector_info [i].data_mark  = 0xfb;
 	}
 
       if (! dmk_format_track (h, DMK_FM, 26, sector_info))
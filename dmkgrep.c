@@ -0,0 +1,256 @@
+/*
+ * dmkgrep - search the sector data of DMK images
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libdmk.h"
+
+
+#define MAX_THREADS 64
+#define MAX_PATTERN 4096
+
+
+char *progname;
+
+
+void usage (void)
+{
+  fprintf (stderr, "usage:\n"
+	   "%s [options] <pattern> <image.dmk>...\n"
+	   "    -i            ignore ASCII case\n"
+	   "    -x            pattern is hex bytes, e.g. \"c3 00 40\"\n"
+	   "    -l            only list the names of matching images\n"
+	   "    -j <threads>  number of threads (default one per CPU)\n",
+	   progname);
+  exit (2);
+}
+
+
+typedef struct
+{
+  uint8_t pattern [MAX_PATTERN];
+  int pattern_len;
+  int flags;
+  int list;  /* boolean */
+
+  char **image_fn;
+  int image_count;
+  int next;            /* next image to search, shared by all workers */
+  int matches;
+  int error;           /* boolean */
+  pthread_mutex_t output_mutex;
+} grep_t;
+
+
+typedef struct
+{
+  grep_t *grep;
+  char *fn;
+  FILE *f;
+} image_search_t;
+
+
+static int report_match (void *arg, int cylinder, int head,
+			 sector_info_t *sector_info, int offset)
+{
+  image_search_t *search = arg;
+
+  if (search->grep->list)
+    return (0);  /* one match is enough */
+  fprintf (search->f, "%s: cyl %d head %d sector %d offset %d\n",
+	   search->fn, cylinder, head, sector_info->sector, offset);
+  return (1);
+}
+
+
+void *grep_worker (void *arg)
+{
+  grep_t *grep = arg;
+  image_search_t search;
+  dmk_handle h;
+  int ds, dd, cylinders;
+  char *output;
+  size_t output_size;
+  int i, count;
+
+  search.grep = grep;
+  while ((i = __atomic_fetch_add (& grep->next, 1, __ATOMIC_RELAXED)) <
+	 grep->image_count)
+    {
+      search.fn = grep->image_fn [i];
+      h = dmk_open_image (search.fn, 0, & ds, & cylinders, & dd);
+      if (! h)
+	{
+	  fprintf (stderr, "error opening %s\n", search.fn);
+	  grep->error = 1;
+	  continue;
+	}
+
+      /* buffer each image's matches so lines from different images
+	 don't interleave */
+      output = NULL;
+      search.f = open_memstream (& output, & output_size);
+      if (! search.f)
+	{
+	  grep->error = 1;
+	  dmk_close_image (h);
+	  continue;
+	}
+      count = dmk_search (h, grep->pattern, grep->pattern_len, grep->flags,
+			  report_match, & search);
+      fclose (search.f);
+      dmk_close_image (h);
+
+      if (count < 0)
+	{
+	  fprintf (stderr, "error searching %s\n", search.fn);
+	  grep->error = 1;
+	}
+      else if (count)
+	{
+	  __atomic_fetch_add (& grep->matches, count, __ATOMIC_RELAXED);
+	  pthread_mutex_lock (& grep->output_mutex);
+	  if (grep->list)
+	    printf ("%s\n", search.fn);
+	  else
+	    fputs (output, stdout);
+	  pthread_mutex_unlock (& grep->output_mutex);
+	}
+      free (output);
+    }
+  return (NULL);
+}
+
+
+static int parse_hex (char *s, uint8_t *pattern)
+{
+  int len = 0;
+  int digits = 0;
+  int v;
+
+  for (; *s; s++)
+    {
+      if (isspace ((unsigned char) *s))
+	continue;
+      if (! isxdigit ((unsigned char) *s))
+	return (-1);
+      if (isdigit ((unsigned char) *s))
+	v = *s - '0';
+      else
+	v = tolower ((unsigned char) *s) - 'a' + 10;
+      if (len >= MAX_PATTERN)
+	return (-1);
+      if (digits++ & 1)
+	pattern [len++] |= v;
+      else
+	pattern [len] = v << 4;
+    }
+  if (digits & 1)
+    return (-1);
+  return (len);
+}
+
+
+int main (int argc, char *argv[])
+{
+  grep_t grep;
+  pthread_t thread [MAX_THREADS];
+  int thread_count = sysconf (_SC_NPROCESSORS_ONLN);
+  int hex = 0;
+  char *pattern;
+  int i;
+
+  progname = argv [0];
+  memset (& grep, 0, sizeof (grep));
+  pthread_mutex_init (& grep.output_mutex, NULL);
+
+  while ((argc > 1) && (argv [1][0] == '-'))
+    {
+      if (strcmp (argv [1], "-i") == 0)
+	grep.flags |= DMK_SEARCH_NOCASE;
+      else if (strcmp (argv [1], "-x") == 0)
+	hex = 1;
+      else if (strcmp (argv [1], "-l") == 0)
+	grep.list = 1;
+      else if (strcmp (argv [1], "-j") == 0)
+	{
+	  if (argc < 3)
+	    usage ();
+	  thread_count = atoi (argv [2]);
+	  argc--;
+	  argv++;
+	}
+      else
+	{
+	  fprintf (stderr, "unrecognized option '%s'\n", argv [1]);
+	  usage ();
+	}
+      argc--;
+      argv++;
+    }
+  if (argc < 3)
+    usage ();
+  pattern = argv [1];
+  grep.image_fn = & argv [2];
+  grep.image_count = argc - 2;
+  if (thread_count < 1)
+    thread_count = 1;
+  if (thread_count > MAX_THREADS)
+    thread_count = MAX_THREADS;
+  if (thread_count > grep.image_count)
+    thread_count = grep.image_count;
+
+  if (hex)
+    grep.pattern_len = parse_hex (pattern, grep.pattern);
+  else
+    {
+      grep.pattern_len = strlen (pattern);
+      if (grep.pattern_len > MAX_PATTERN)
+	grep.pattern_len = -1;
+      else
+	memcpy (grep.pattern, pattern, grep.pattern_len);
+    }
+  if (grep.pattern_len <= 0)
+    {
+      fprintf (stderr, "invalid pattern\n");
+      exit (2);
+    }
+
+  for (i = 0; i < thread_count; i++)
+    if (pthread_create (& thread [i], NULL, grep_worker, & grep))
+      {
+	fprintf (stderr, "can't create thread\n");
+	exit (2);
+      }
+  for (i = 0; i < thread_count; i++)
+    pthread_join (thread [i], NULL);
+
+  if (grep.error)
+    exit (2);
+  exit (grep.matches ? 0 : 1);
+}
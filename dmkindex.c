@@ -0,0 +1,62 @@
+/*
+ * dmkindex - build sidecar index files for DMK images
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "libdmk.h"
+
+
+int main (int argc, char *argv[])
+{
+  dmk_handle h;
+  int ds, dd;
+  int cylinders;
+  int i;
+  int status = 0;
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s image.dmk...\n", argv [0]);
+      exit (1);
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      h = dmk_open_image (argv [i], 0, & ds, & cylinders, & dd);
+      if (! h)
+	{
+	  fprintf (stderr, "error opening DMK file %s\n", argv [i]);
+	  status = 2;
+	  continue;
+	}
+      if (! dmk_write_index (h))
+	{
+	  fprintf (stderr, "error indexing DMK file %s\n", argv [i]);
+	  status = 2;
+	}
+      dmk_close_image (h);
+    }
+
+  exit (status);
+}
@@ -0,0 +1,171 @@
+/*
+ * dmkoverlay - manage delta files of overlay DMK images
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dmk.h"
+#include "libdmk.h"
+
+
+char *progname;
+
+
+void usage (void)
+{
+  fprintf (stderr, "usage:\n"
+	   "%s list <base.dmk> <delta>\n"
+	   "%s commit <base.dmk> <delta> <image.dmk>\n"
+	   "%s discard <delta>\n",
+	   progname, progname, progname);
+  exit (1);
+}
+
+
+dmk_handle open_overlay (char *base_fn, char *delta_fn,
+			 int *ds, int *cylinders, int *dd)
+{
+  dmk_handle h;
+
+  /* don't create a delta file just to look at it */
+  if (access (delta_fn, F_OK) != 0)
+    {
+      fprintf (stderr, "no delta file %s\n", delta_fn);
+      exit (2);
+    }
+  h = dmk_open_overlay (base_fn, delta_fn, ds, cylinders, dd);
+  if (! h)
+    {
+      fprintf (stderr, "error opening overlay\n");
+      exit (2);
+    }
+  return (h);
+}
+
+
+int list_tracks (char *base_fn, char *delta_fn)
+{
+  dmk_handle h;
+  int ds, dd, cylinders;
+  int cylinder, head;
+  int count = 0;
+
+  h = open_overlay (base_fn, delta_fn, & ds, & cylinders, & dd);
+  for (cylinder = 0; cylinder < cylinders; cylinder++)
+    for (head = 0; head <= ds; head++)
+      if (dmk_overlay_modified (h, cylinder, head))
+	{
+	  printf ("cylinder %d head %d\n", cylinder, head);
+	  count++;
+	}
+  printf ("%d of %d tracks modified\n", count, cylinders * (ds + 1));
+  dmk_close_image (h);
+  return (0);
+}
+
+
+int commit_delta (char *base_fn, char *delta_fn, char *image_fn)
+{
+  dmk_handle h;
+  FILE *f;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  uint8_t *raw;
+  int ds, dd, cylinders;
+  int cylinder, head;
+
+  h = open_overlay (base_fn, delta_fn, & ds, & cylinders, & dd);
+
+  f = fopen (base_fn, "rb");
+  if ((! f) || (1 != fread (dmk_header, DMK_HEADER_LENGTH, 1, f)))
+    {
+      fprintf (stderr, "error reading base image header\n");
+      exit (2);
+    }
+  fclose (f);
+
+  f = fopen (image_fn, "wb");
+  if (! f)
+    {
+      fprintf (stderr, "error opening output file\n");
+      exit (2);
+    }
+  raw = malloc (dmk_raw_track_length (h));
+  if (! raw)
+    exit (2);
+
+  if (1 != fwrite (dmk_header, DMK_HEADER_LENGTH, 1, f))
+    {
+      fprintf (stderr, "error writing output file\n");
+      exit (2);
+    }
+  for (cylinder = 0; cylinder < cylinders; cylinder++)
+    for (head = 0; head <= ds; head++)
+      {
+	if ((! dmk_seek (h, cylinder, head)) ||
+	    (! dmk_read_track_raw (h, raw)))
+	  {
+	    fprintf (stderr, "error reading cylinder %d head %d\n",
+		     cylinder, head);
+	    exit (2);
+	  }
+	if (1 != fwrite (raw, dmk_raw_track_length (h), 1, f))
+	  {
+	    fprintf (stderr, "error writing output file\n");
+	    exit (2);
+	  }
+      }
+
+  free (raw);
+  if (0 != fclose (f))
+    {
+      fprintf (stderr, "error writing output file\n");
+      exit (2);
+    }
+  dmk_close_image (h);
+  return (0);
+}
+
+
+int main (int argc, char *argv[])
+{
+  progname = argv [0];
+
+  if ((argc == 4) && (strcmp (argv [1], "list") == 0))
+    exit (list_tracks (argv [2], argv [3]));
+  else if ((argc == 5) && (strcmp (argv [1], "commit") == 0))
+    exit (commit_delta (argv [2], argv [3], argv [4]));
+  else if ((argc == 3) && (strcmp (argv [1], "discard") == 0))
+    {
+      if (unlink (argv [2]) != 0)
+	{
+	  perror (argv [2]);
+	  exit (2);
+	}
+      exit (0);
+    }
+
+  usage ();
+  exit (1);
+}
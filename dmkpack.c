@@ -0,0 +1,304 @@
+/*
+ * dmkpack - maintain deduplicating archives of DMK images
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dmk.h"
+#include "libdmk.h"
+#include "libdmkpack.h"
+
+
+#define MAX_THREADS 64
+
+
+char *progname;
+
+
+void usage (void)
+{
+  fprintf (stderr, "usage:\n"
+	   "%s add [-j <threads>] <pack> <image.dmk>...\n"
+	   "%s list <pack>\n"
+	   "%s extract <pack> <member> <image.dmk>\n"
+	   "%s sector <pack> <member> <cylinder> <head> <sector>\n",
+	   progname, progname, progname, progname);
+  exit (1);
+}
+
+
+typedef struct
+{
+  dmkpack_handle pack;
+  char **image_fn;
+  int image_count;
+  int next;      /* next image to ingest, shared by all workers */
+  int failures;
+} ingest_t;
+
+
+void *ingest_worker (void *arg)
+{
+  ingest_t *ingest = arg;
+  int i;
+
+  while ((i = __atomic_fetch_add (& ingest->next, 1, __ATOMIC_RELAXED)) <
+	 ingest->image_count)
+    {
+      if (! dmkpack_add_image (ingest->pack, ingest->image_fn [i],
+			       ingest->image_fn [i]))
+	{
+	  fprintf (stderr, "error adding %s\n", ingest->image_fn [i]);
+	  __atomic_fetch_add (& ingest->failures, 1, __ATOMIC_RELAXED);
+	}
+    }
+  return (NULL);
+}
+
+
+int add_images (char *pack_fn, int thread_count, char **image_fn,
+		int image_count)
+{
+  ingest_t ingest;
+  pthread_t thread [MAX_THREADS];
+  long chunks, stored, logical;
+  int i;
+
+  ingest.pack = dmkpack_open (pack_fn, 1);
+  if (! ingest.pack)
+    {
+      fprintf (stderr, "error opening pack file\n");
+      exit (2);
+    }
+  ingest.image_fn = image_fn;
+  ingest.image_count = image_count;
+  ingest.next = 0;
+  ingest.failures = 0;
+
+  if (thread_count > image_count)
+    thread_count = image_count;
+  for (i = 0; i < thread_count; i++)
+    if (pthread_create (& thread [i], NULL, ingest_worker, & ingest))
+      {
+	fprintf (stderr, "can't create thread\n");
+	exit (2);
+      }
+  for (i = 0; i < thread_count; i++)
+    pthread_join (thread [i], NULL);
+
+  dmkpack_stats (ingest.pack, & chunks, & stored, & logical);
+  printf ("%d members, %ld chunks, %ld bytes stored for %ld bytes of images\n",
+	  dmkpack_member_count (ingest.pack), chunks, stored, logical);
+
+  if (! dmkpack_close (ingest.pack))
+    {
+      fprintf (stderr, "error closing pack file\n");
+      exit (2);
+    }
+  return (ingest.failures ? 2 : 0);
+}
+
+
+int list_members (char *pack_fn)
+{
+  dmkpack_handle p;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  char *name;
+  int i;
+
+  p = dmkpack_open (pack_fn, 0);
+  if (! p)
+    {
+      fprintf (stderr, "error opening pack file\n");
+      exit (2);
+    }
+  for (i = 0; i < dmkpack_member_count (p); i++)
+    {
+      name = dmkpack_member_name (p, i);
+      dmkpack_read_header (p, name, dmk_header);
+      printf ("%s: %d cylinders, %s sided, %s density\n", name,
+	      dmk_header [1],
+	      (dmk_header [4] & DMK_FLAG_SS_MASK) ? "single" : "double",
+	      (dmk_header [4] & DMK_FLAG_SD_MASK) ? "single" : "double");
+    }
+  dmkpack_close (p);
+  return (0);
+}
+
+
+int extract_member (char *pack_fn, char *name, char *image_fn)
+{
+  dmkpack_handle p;
+  dmk_handle h;
+  FILE *f;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  uint8_t *raw;
+  int ds, dd, cylinders;
+  int cylinder, head;
+
+  p = dmkpack_open (pack_fn, 0);
+  if (! p)
+    {
+      fprintf (stderr, "error opening pack file\n");
+      exit (2);
+    }
+  h = dmkpack_open_image (p, name, & ds, & cylinders, & dd);
+  if ((! h) || ! dmkpack_read_header (p, name, dmk_header))
+    {
+      fprintf (stderr, "no member %s in pack\n", name);
+      exit (2);
+    }
+
+  f = fopen (image_fn, "wb");
+  if (! f)
+    {
+      fprintf (stderr, "error opening output file\n");
+      exit (2);
+    }
+  raw = malloc (dmk_raw_track_length (h));
+  if (! raw)
+    exit (2);
+
+  if (1 != fwrite (dmk_header, DMK_HEADER_LENGTH, 1, f))
+    {
+      fprintf (stderr, "error writing output file\n");
+      exit (2);
+    }
+  for (cylinder = 0; cylinder < cylinders; cylinder++)
+    for (head = 0; head <= ds; head++)
+      {
+	if ((! dmk_seek (h, cylinder, head)) ||
+	    (! dmk_read_track_raw (h, raw)))
+	  {
+	    fprintf (stderr, "error reading cylinder %d head %d\n",
+		     cylinder, head);
+	    exit (2);
+	  }
+	if (1 != fwrite (raw, dmk_raw_track_length (h), 1, f))
+	  {
+	    fprintf (stderr, "error writing output file\n");
+	    exit (2);
+	  }
+      }
+
+  free (raw);
+  fclose (f);
+  dmk_close_image (h);
+  dmkpack_close (p);
+  return (0);
+}
+
+
+int cat_sector (char *pack_fn, char *name, int cylinder, int head,
+		int sector)
+{
+  dmkpack_handle p;
+  dmk_handle h;
+  int ds, dd, cylinders;
+  int found;
+  sector_info_t sector_info;
+  uint8_t buf [4096];
+
+  p = dmkpack_open (pack_fn, 0);
+  if (! p)
+    {
+      fprintf (stderr, "error opening pack file\n");
+      exit (2);
+    }
+  h = dmkpack_open_image (p, name, & ds, & cylinders, & dd);
+  if (! h)
+    {
+      fprintf (stderr, "no member %s in pack\n", name);
+      exit (2);
+    }
+  if (! dmk_seek (h, cylinder, head))
+    {
+      fprintf (stderr, "error seeking to cylinder %d head %d\n",
+	       cylinder, head);
+      exit (2);
+    }
+
+  /* find the sector's ID to learn its mode and size */
+  while ((found = dmk_read_id (h, & sector_info)))
+    if (sector_info.sector == sector)
+      break;
+  if (! found)
+    {
+      fprintf (stderr, "sector %d not found\n", sector);
+      exit (2);
+    }
+  if (! dmk_read_sector (h, & sector_info, buf))
+    {
+      fprintf (stderr, "error reading sector\n");
+      exit (2);
+    }
+  if (1 != fwrite (buf, dmk_sector_size (& sector_info), 1, stdout))
+    exit (2);
+
+  dmk_close_image (h);
+  dmkpack_close (p);
+  return (0);
+}
+
+
+int main (int argc, char *argv[])
+{
+  int thread_count = sysconf (_SC_NPROCESSORS_ONLN);
+
+  progname = argv [0];
+
+  if (argc < 3)
+    usage ();
+
+  if (strcmp (argv [1], "add") == 0)
+    {
+      argc -= 2;
+      argv += 2;
+      if ((argc >= 2) && (strcmp (argv [0], "-j") == 0))
+	{
+	  thread_count = atoi (argv [1]);
+	  argc -= 2;
+	  argv += 2;
+	}
+      if (argc < 2)
+	usage ();
+      if (thread_count < 1)
+	thread_count = 1;
+      if (thread_count > MAX_THREADS)
+	thread_count = MAX_THREADS;
+      exit (add_images (argv [0], thread_count, & argv [1], argc - 1));
+    }
+  else if ((strcmp (argv [1], "list") == 0) && (argc == 3))
+    exit (list_members (argv [2]));
+  else if ((strcmp (argv [1], "extract") == 0) && (argc == 5))
+    exit (extract_member (argv [2], argv [3], argv [4]));
+  else if ((strcmp (argv [1], "sector") == 0) && (argc == 7))
+    exit (cat_sector (argv [2], argv [3], atoi (argv [4]), atoi (argv [5]),
+		      atoi (argv [6])));
+
+  usage ();
+  exit (1);
+}
@@ -0,0 +1,199 @@
+/*
+ * dmksimd - vectorized byte scanning helpers
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+#ifndef DMKLIB_DMKSIMD_H
+#define DMKLIB_DMKSIMD_H
+
+/*
+ * SSE2 is used when the compiler targets it (always the case on
+ * x86-64); otherwise plain C loops give the same results.
+ */
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/* offset of the first byte that differs, or len if none */
+static inline int simd_mismatch (const uint8_t *a, const uint8_t *b, int len)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) (a + i));
+      __m128i y = _mm_loadu_si128 ((const __m128i *) (b + i));
+      int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y)) ^ 0xffff;
+      if (mask)
+	return (i + __builtin_ctz (mask));
+    }
+#endif
+  for (; i < len; i++)
+    if (a [i] != b [i])
+      return (i);
+  return (len);
+}
+
+
+/* number of byte positions that differ */
+static inline int simd_count_diff (const uint8_t *a, const uint8_t *b, int len)
+{
+  int i = 0;
+  int count = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) (a + i));
+      __m128i y = _mm_loadu_si128 ((const __m128i *) (b + i));
+      count += 16 - __builtin_popcount (_mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y)));
+    }
+#endif
+  for (; i < len; i++)
+    count += (a [i] != b [i]);
+  return (count);
+}
+
+
+/* offset of the first byte in the range lo..hi, or len if none */
+static inline int simd_find_range (const uint8_t *buf, int len,
+				   uint8_t lo, uint8_t hi)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  /* shift lo..hi down to the bottom of the signed byte range */
+  __m128i bias = _mm_set1_epi8 ((char) (0x80 - lo));
+  __m128i limit = _mm_set1_epi8 ((char) (0x80 + (hi - lo) + 1));
+
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) (buf + i));
+      int mask = _mm_movemask_epi8 (_mm_cmplt_epi8 (_mm_add_epi8 (x, bias),
+						    limit));
+      if (mask)
+	return (i + __builtin_ctz (mask));
+    }
+#endif
+  for (; i < len; i++)
+    if ((buf [i] >= lo) && (buf [i] <= hi))
+      return (i);
+  return (len);
+}
+
+
+/* true if all len bytes equal value */
+static inline int simd_uniform (const uint8_t *buf, int len, uint8_t value)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128i v = _mm_set1_epi8 ((char) value);
+  __m128i acc = _mm_set1_epi8 (-1);
+
+  /* AND the compare results together, testing once per 256 bytes */
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) (buf + i));
+      acc = _mm_and_si128 (acc, _mm_cmpeq_epi8 (x, v));
+      if (((i & 0xf0) == 0xf0) && (_mm_movemask_epi8 (acc) != 0xffff))
+	return (0);
+    }
+  if (_mm_movemask_epi8 (acc) != 0xffff)
+    return (0);
+#endif
+  for (; i < len; i++)
+    if (buf [i] != value)
+      return (0);
+  return (1);
+}
+
+
+/* copy len bytes from src to dst, mapping ASCII upper case to lower */
+static inline void simd_fold_case (uint8_t *dst, const uint8_t *src, int len)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  /* shift 'A'..'Z' down to the bottom of the signed byte range */
+  __m128i bias = _mm_set1_epi8 ((char) (0x80 - 'A'));
+  __m128i limit = _mm_set1_epi8 ((char) (0x80 + 26));
+  __m128i lower = _mm_set1_epi8 (0x20);
+
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) (src + i));
+      __m128i upper = _mm_cmplt_epi8 (_mm_add_epi8 (x, bias), limit);
+      _mm_storeu_si128 ((__m128i *) (dst + i),
+			_mm_add_epi8 (x, _mm_and_si128 (upper, lower)));
+    }
+#endif
+  for (; i < len; i++)
+    dst [i] = ((src [i] >= 'A') && (src [i] <= 'Z')) ? src [i] + 0x20 : src [i];
+}
+
+
+/*
+ * Offset of the first occurrence of needle in haystack at or after
+ * start, or -1 if none.  Candidate positions are those where both the
+ * first and last bytes of the needle match, which rejects almost all
+ * positions sixteen at a time before any full comparison is made.
+ */
+static inline int simd_search (const uint8_t *haystack, int haystack_len,
+			       const uint8_t *needle, int needle_len,
+			       int start)
+{
+  int i = start;
+
+  if (needle_len <= 0)
+    return ((start <= haystack_len) ? start : -1);
+
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8 ((char) needle [0]);
+  __m128i last = _mm_set1_epi8 ((char) needle [needle_len - 1]);
+
+  for (; i + needle_len - 1 + 16 <= haystack_len; i += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (haystack + i));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (haystack + i
+						      + needle_len - 1));
+      int mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (a, first),
+						   _mm_cmpeq_epi8 (b, last)));
+      while (mask)
+	{
+	  int j = i + __builtin_ctz (mask);
+	  if (memcmp (haystack + j + 1, needle + 1, needle_len - 1) == 0)
+	    return (j);
+	  mask &= mask - 1;
+	}
+    }
+#endif
+  for (; i + needle_len <= haystack_len; i++)
+    if ((haystack [i] == needle [0]) &&
+	(memcmp (haystack + i + 1, needle + 1, needle_len - 1) == 0))
+      return (i);
+  return (-1);
+}
+
+#endif
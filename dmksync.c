@@ -0,0 +1,143 @@
+/*
+ * dmksync - bring a copy of a DMK image up to date with another
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dmk.h"
+#include "libdmk.h"
+
+
+char *progname;
+
+
+void usage (void)
+{
+  fprintf (stderr, "usage:\n"
+	   "%s [options] <source.dmk> <dest.dmk>\n"
+	   "    -n            only list the tracks that differ\n"
+	   "    -v            list the tracks copied\n",
+	   progname);
+  exit (1);
+}
+
+
+int main (int argc, char *argv[])
+{
+  char *fn [2] = { NULL, NULL };
+  int dry_run = 0;
+  int verbose = 0;
+  dmk_handle h [2];
+  int ds [2], dd [2], cylinders [2];
+  int *tracks;
+  uint8_t *raw;
+  int count, i, k;
+
+  progname = argv [0];
+
+  while (argc > 1)
+    {
+      if (strcmp (argv [1], "-n") == 0)
+	dry_run = 1;
+      else if (strcmp (argv [1], "-v") == 0)
+	verbose = 1;
+      else if (argv [1][0] == '-')
+	{
+	  fprintf (stderr, "unrecognized option '%s'\n", argv [1]);
+	  usage ();
+	}
+      else if (! fn [0])
+	fn [0] = argv [1];
+      else if (! fn [1])
+	fn [1] = argv [1];
+      else
+	usage ();
+      argc--;
+      argv++;
+    }
+  if (! fn [1])
+    usage ();
+
+  for (k = 0; k < 2; k++)
+    {
+      h [k] = dmk_open_image (fn [k], k && ! dry_run,
+			      & ds [k], & cylinders [k], & dd [k]);
+      if (! h [k])
+	{
+	  fprintf (stderr, "error opening %s\n", fn [k]);
+	  exit (2);
+	}
+    }
+  if ((ds [0] != ds [1]) || (cylinders [0] != cylinders [1]) ||
+      (dmk_raw_track_length (h [0]) != dmk_raw_track_length (h [1])))
+    {
+      fprintf (stderr, "images have different geometry\n");
+      exit (2);
+    }
+
+  tracks = malloc (cylinders [0] * (ds [0] + 1) * sizeof (int));
+  raw = malloc (dmk_raw_track_length (h [0]));
+  if ((! tracks) || (! raw))
+    exit (2);
+
+  /* only the subtrees whose hashes differ are looked at */
+  count = dmk_merkle_diff (h [0], h [1], tracks);
+  if (count < 0)
+    {
+      fprintf (stderr, "error hashing images\n");
+      exit (2);
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      int cylinder = tracks [i] / (ds [0] + 1);
+      int head = tracks [i] % (ds [0] + 1);
+
+      if (dry_run || verbose)
+	printf ("cylinder %d head %d\n", cylinder, head);
+      if (dry_run)
+	continue;
+      if ((! dmk_seek (h [0], cylinder, head)) ||
+	  (! dmk_read_track_raw (h [0], raw)) ||
+	  (! dmk_seek (h [1], cylinder, head)) ||
+	  (! dmk_write_track_raw (h [1], raw)))
+	{
+	  fprintf (stderr, "error copying cylinder %d head %d\n",
+		   cylinder, head);
+	  exit (2);
+	}
+    }
+
+  if (count && ! dry_run && ! dmk_save_image (h [1]))
+    exit (2);
+  printf ("%d of %d tracks %s\n", count, cylinders [0] * (ds [0] + 1),
+	  dry_run ? "differ" : "copied");
+
+  free (tracks);
+  free (raw);
+  dmk_close_image (h [0]);
+  if (! dmk_close_image (h [1]))
+    exit (2);
+  exit (0);
+}
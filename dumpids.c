@@ -23,115 +23,437 @@
 
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
+#include <string.h>
+#include <math.h>
 
-#include <linux/fd.h>
-#include <linux/fdreg.h>
+#include "floppy.h"
 
 
-typedef int bool;
-typedef unsigned char u8;
+char *progname;
 
 
-int double_step = 0;
-int data_rate;
+/*
+ * A timed capture reads IDs as fast as the drive presents them, each
+ * stamped with the drive's clock (monotonic time on a real drive, the
+ * modeled time on an emulated one) as the command completes.  The loop
+ * does nothing else: records go into a ring allocated beforehand, which
+ * keeps the most recent ones if it's smaller than the read count, and
+ * only after the last read is the ring written out.
+ *
+ * The capture file is a 16 byte header, "DMKIDS\0\1", then the record
+ * count (32 bits), the data rate in kbps (16 bits), fm, and the head,
+ * followed by 12 byte records: the time in nanoseconds since the first
+ * read began (64 bits), then the cylinder, head, sector and size code
+ * of the ID, with a size code of 0xff for a read that failed.  All
+ * values are little endian.
+ */
+
+#define CAPTURE_MAGIC "DMKIDS\0\1"
+#define CAPTURE_HEADER_LENGTH 16
+#define CAPTURE_RECORD_LENGTH 12
 
+#define FAILED_READ 0xff
+
+
+typedef struct
+{
+  uint64_t time;   /* nanoseconds */
+  floppy_id_t id;  /* size_code FAILED_READ if the read failed */
+} id_record_t;
 
-/* rate codes are unfortunately NOT defined in fdreg.h */
-#define FD_RATE_250_KBPS 2
-#define FD_RATE_300_KBPS 1
-#define FD_RATE_500_KBPS 0
 
-bool recalibrate (int dev)
+void usage (void)
 {
-  struct floppy_raw_cmd cmd;
-  int i = 0;
-
-  cmd.data = NULL;
-  cmd.length = 0;
-  cmd.rate = data_rate;
-  cmd.flags = FD_RAW_INTR;
-  cmd.cmd [i++] = FD_RECALIBRATE;
-  cmd.cmd [i++] = 0;
-  cmd.cmd_count = i;
-  return (0 <= ioctl (dev, FDRAWCMD, & cmd));
-  //  return (0 <= ioctl (dev, FDRAWCMD, & cmd));
+  fprintf (stderr, "usage:\n"
+	   "%s [-n <reads> [-r <ring-size>] -o <file>] device cylinder head fm rate\n"
+	   "%s -a <file>\n"
+	   "    -n <reads>      read the given number of IDs, timing each\n"
+	   "    -r <ring-size>  keep only the last ring-size of them (default all)\n"
+	   "    -o <file>       write the timed IDs to a capture file\n"
+	   "    -a <file>       analyze a capture file: rotation speed, and the\n"
+	   "                    spacing and jitter of the IDs\n"
+	   "Without -n, IDs are printed as they are read, until interrupted.\n",
+	   progname, progname);
+  exit (1);
 }
 
 
-bool seek (int dev, int cylinder)
+static void put_le (uint8_t *p, uint64_t value, int length)
 {
-  struct floppy_raw_cmd cmd;
-  int i = 0;
-
-  cmd.data = NULL;
-  cmd.length = 0;
-  cmd.rate = data_rate;
-  cmd.flags = FD_RAW_INTR;
-  cmd.cmd[i++] = FD_SEEK;
-  cmd.cmd[i++] = 0;
-  cmd.cmd[i++] = cylinder << double_step;
-  cmd.cmd_count = i;
-
-  return (0 <= ioctl (dev, FDRAWCMD, & cmd));
+  int i;
+
+  for (i = 0; i < length; i++)
+    p [i] = value >> (8 * i);
 }
 
 
-bool read_id (int dev, int fm, int seek_head, int *cylinder, int *head, int *sector, int *sector_size)
+static uint64_t get_le (uint8_t *p, int length)
 {
-  struct floppy_raw_cmd cmd;
-  u8 mask = 0x5f;
-  int i = 0;
-
-  if (fm)
-    mask &= ~0x40;
-
-  cmd.data = NULL;   /* No data to transfer */
-  cmd.length = 0;
-  cmd.rate = data_rate;
-  cmd.flags = FD_RAW_INTR;
-  cmd.cmd[i++] = FD_READID & mask;
-  cmd.cmd[i++] = seek_head ? 4 : 0;
-  cmd.cmd_count = i;
-
-  if (0 > ioctl (dev, FDRAWCMD, & cmd))
-    return (0);
-  
-  if (cmd.reply [0] & 0x40)
-    return (0);
-
-  *cylinder    = cmd.reply [3];
-  *head        = cmd.reply [4];
-  *sector      = cmd.reply [5];
-  *sector_size = 128 << cmd.reply [6];
-
-  return (1);
+  uint64_t value = 0;
+  int i;
+
+  for (i = length - 1; i >= 0; i--)
+    value = (value << 8) | p [i];
+  return (value);
+}
+
+
+/*
+ * Fill the ring, which is no longer than reads, keeping the last
+ * ring_size IDs read.  Returns the number of records, oldest at
+ * ring [*first].
+ */
+int capture_ids (floppy_t f, int data_rate, int fm, int head,
+		 long reads, id_record_t *ring, int ring_size, int *first)
+{
+  double start;
+  id_record_t *r;
+  long i;
+  int next = 0;
+
+  start = floppy_time (f);
+  for (i = 0; i < reads; i++)
+    {
+      r = & ring [next];
+      if (0 >= floppy_read_id (f, data_rate, fm, head, & r->id))
+	r->id.size_code = FAILED_READ;
+      r->time = (uint64_t) ((floppy_time (f) - start) * 1e9 + 0.5);
+      if (++next == ring_size)
+	next = 0;
+    }
+  *first = next;
+  return (ring_size);
+}
+
+
+bool write_capture (char *fn, id_record_t *ring, int count, int first,
+		    int rate, int fm, int head)
+{
+  uint8_t buf [CAPTURE_HEADER_LENGTH];
+  uint8_t *p;
+  id_record_t *r;
+  FILE *f;
+  int i;
+
+  f = fopen (fn, "wb");
+  if (! f)
+    goto fail;
+  memcpy (buf, CAPTURE_MAGIC, 8);
+  put_le (& buf [8], count, 4);
+  put_le (& buf [12], rate, 2);
+  buf [14] = fm;
+  buf [15] = head;
+  if (fwrite (buf, CAPTURE_HEADER_LENGTH, 1, f) != 1)
+    goto fail;
+  for (i = 0; i < count; i++)
+    {
+      r = & ring [(first + i) % count];
+      p = buf;
+      put_le (p, r->time, 8);
+      p [8]  = r->id.cylinder;
+      p [9]  = r->id.head;
+      p [10] = r->id.sector;
+      p [11] = r->id.size_code;
+      if (fwrite (buf, CAPTURE_RECORD_LENGTH, 1, f) != 1)
+	goto fail;
+    }
+  if (fclose (f) != 0)
+    {
+      f = NULL;
+      goto fail;
+    }
+  return (true);
+
+ fail:
+  perror (fn);
+  if (f)
+    fclose (f);
+  return (false);
 }
 
 
+/* returns the records, or NULL */
+id_record_t *read_capture (char *fn, int *count, int *rate, int *fm,
+			   int *head)
+{
+  uint8_t buf [CAPTURE_HEADER_LENGTH];
+  id_record_t *records = NULL;
+  FILE *f;
+  int i;
+
+  f = fopen (fn, "rb");
+  if (! f)
+    {
+      perror (fn);
+      return (NULL);
+    }
+  if ((fread (buf, CAPTURE_HEADER_LENGTH, 1, f) != 1) ||
+      (memcmp (buf, CAPTURE_MAGIC, 8) != 0))
+    goto bad;
+  *count = get_le (& buf [8], 4);
+  *rate = get_le (& buf [12], 2);
+  *fm = buf [14];
+  *head = buf [15];
+  records = calloc (*count ? *count : 1, sizeof (id_record_t));
+  if (! records)
+    {
+      fprintf (stderr, "out of memory\n");
+      goto fail;
+    }
+  for (i = 0; i < *count; i++)
+    {
+      if (fread (buf, CAPTURE_RECORD_LENGTH, 1, f) != 1)
+	goto bad;
+      records [i].time = get_le (buf, 8);
+      records [i].id.cylinder  = buf [8];
+      records [i].id.head      = buf [9];
+      records [i].id.sector    = buf [10];
+      records [i].id.size_code = buf [11];
+    }
+  fclose (f);
+  return (records);
+
+ bad:
+  fprintf (stderr, "%s isn't an ID capture file\n", fn);
+ fail:
+  free (records);
+  fclose (f);
+  return (NULL);
+}
+
+
+static int compare_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return ((x > y) - (x < y));
+}
+
+
+typedef struct
+{
+  int count;
+  double sum;
+  double sum_squares;
+} stats_t;
+
+
+static void add_sample (stats_t *s, double x)
+{
+  s->count++;
+  s->sum += x;
+  s->sum_squares += x * x;
+}
+
+
+static double mean (stats_t *s)
+{
+  return (s->sum / s->count);
+}
+
+
+static double deviation (stats_t *s)
+{
+  double m = mean (s);
+  double variance = s->sum_squares / s->count - m * m;
+
+  /* rounding can leave the variance of equal samples just below zero */
+  return ((variance > 0.0) ? sqrt (variance) : 0.0);
+}
+
+
+static bool same_id (floppy_id_t *a, floppy_id_t *b)
+{
+  return ((a->cylinder == b->cylinder) && (a->head == b->head) &&
+	  (a->sector == b->sector) && (a->size_code == b->size_code));
+}
+
+
+/*
+ * The revolution time comes from the interval between successive reads
+ * of the same ID: their median is taken as a first estimate, then each
+ * interval is divided by the whole number of revolutions it spans.
+ * Each ID's successor on the track is the one seen soonest after it,
+ * and the spacing of the two, whenever they're read back to back, gives
+ * the gap, the spread of which is its jitter.
+ */
+bool analyze_capture (char *fn)
+{
+  id_record_t *records;
+  int count, rate, fm, head;
+  double *intervals = NULL;
+  int interval_count = 0;
+  double rev, t;
+  stats_t rev_stats = { 0 }, gap_stats [256];
+  double min_gap [256];
+  int successor [256];
+  int failed = 0, revs, from;
+  int i, j;
+
+  records = read_capture (fn, & count, & rate, & fm, & head);
+  if (! records)
+    return (false);
+  memset (gap_stats, 0, sizeof (gap_stats));
+
+  printf ("%d reads at %d kbps %s, head %d, over %.3f s\n", count, rate,
+	  fm ? "FM" : "MFM", head,
+	  count ? (records [count - 1].time - records [0].time) * 1e-9 : 0.0);
+
+  intervals = malloc ((count ? count : 1) * sizeof (double));
+  if (! intervals)
+    {
+      fprintf (stderr, "out of memory\n");
+      goto fail;
+    }
+  for (i = 0; i < count; i++)
+    {
+      if (records [i].id.size_code == FAILED_READ)
+	{
+	  failed++;
+	  continue;
+	}
+      for (j = i + 1; j < count; j++)
+	if (same_id (& records [i].id, & records [j].id))
+	  {
+	    intervals [interval_count++] =
+	      (records [j].time - records [i].time) * 1e-9;
+	    break;
+	  }
+    }
+  printf ("%d reads failed\n", failed);
+  if (! interval_count)
+    {
+      printf ("no ID was read twice, can't time rotation\n");
+      goto done;
+    }
+
+  qsort (intervals, interval_count, sizeof (double), compare_double);
+  rev = intervals [interval_count / 2];
+  for (i = 0; i < interval_count; i++)
+    {
+      revs = (int) (intervals [i] / rev + 0.5);
+      if (revs)
+	add_sample (& rev_stats, intervals [i] / revs);
+    }
+  rev = mean (& rev_stats);
+  printf ("revolution %.3f ms (%.2f rpm), jitter %.1f us over %d intervals\n",
+	  rev * 1e3, 60.0 / rev, deviation (& rev_stats) * 1e6,
+	  rev_stats.count);
+
+  /* the first pass finds each ID's successor, the second times the
+     gaps to it, so that IDs missed in between don't count */
+  for (from = 0; from < 256; from++)
+    {
+      successor [from] = -1;
+      min_gap [from] = rev;
+    }
+  for (i = 0; i + 1 < count; i++)
+    {
+      if ((records [i].id.size_code == FAILED_READ) ||
+	  (records [i + 1].id.size_code == FAILED_READ))
+	continue;
+      t = (records [i + 1].time - records [i].time) * 1e-9;
+      if (t < min_gap [records [i].id.sector])
+	{
+	  min_gap [records [i].id.sector] = t;
+	  successor [records [i].id.sector] = records [i + 1].id.sector;
+	}
+    }
+  for (i = 0; i + 1 < count; i++)
+    if ((records [i].id.size_code != FAILED_READ) &&
+	(records [i + 1].id.size_code != FAILED_READ) &&
+	(records [i + 1].id.sector == successor [records [i].id.sector]) &&
+	((records [i + 1].time - records [i].time) * 1e-9 < rev / 2 +
+	 min_gap [records [i].id.sector]))
+      add_sample (& gap_stats [records [i].id.sector],
+		  (records [i + 1].time - records [i].time) * 1e-9);
+
+  printf ("sector  next  gap us  (degrees)  jitter us  samples\n");
+  for (from = 0; from < 256; from++)
+    {
+      if (! gap_stats [from].count)
+	continue;
+      printf ("%6d  %4d  %6.0f  (%7.2f)  %9.1f  %7d\n", from, successor [from],
+	      mean (& gap_stats [from]) * 1e6,
+	      mean (& gap_stats [from]) / rev * 360.0,
+	      deviation (& gap_stats [from]) * 1e6, gap_stats [from].count);
+    }
+
+ done:
+  free (intervals);
+  free (records);
+  return (true);
+
+ fail:
+  free (intervals);
+  free (records);
+  return (false);
+}
+
 
 int main (int argc, char *argv[])
 {
-  int dev;
-  struct floppy_drive_params fdp;
+  floppy_t f;
+  int cmos, tracks, rpm;
   int seek_cylinder, seek_head;
-  int cylinder, head, sector, sector_size;
-  int fm, rate;
-  int reset_now;
+  floppy_id_t id;
+  int fm, rate, data_rate;
+  long reads = 0;
+  int ring_size = 0;
+  char *capture_fn = NULL;
+  id_record_t *ring;
+  int count, first;
+
+  progname = argv [0];
+
+  while ((argc > 1) && (argv [1][0] == '-'))
+    {
+      if (argc < 3)
+	usage ();
+      if (strcmp (argv [1], "-a") == 0)
+	{
+	  if (argc != 3)
+	    usage ();
+	  exit (analyze_capture (argv [2]) ? 0 : 2);
+	}
+      else if (strcmp (argv [1], "-n") == 0)
+	reads = atol (argv [2]);
+      else if (strcmp (argv [1], "-r") == 0)
+	ring_size = atoi (argv [2]);
+      else if (strcmp (argv [1], "-o") == 0)
+	capture_fn = argv [2];
+      else
+	{
+	  fprintf (stderr, "unrecognized option '%s'\n", argv [1]);
+	  usage ();
+	}
+      argc -= 2;
+      argv += 2;
+    }
+
+  if ((argc != 6) || (reads < 0) || (ring_size < 0) ||
+      ((reads || ring_size || capture_fn) && ! (reads && capture_fn)))
+    usage ();
 
-  if (argc != 6)
+  ring = NULL;
+  if (reads)
     {
-      fprintf (stderr, "usage:\n"
-	       "%s device cylinder head fm rate\n", argv [0]);
-      exit (1);
+      if ((! ring_size) || (ring_size > reads))
+	ring_size = reads;
+      ring = calloc (ring_size, sizeof (id_record_t));
+      if (! ring)
+	{
+	  fprintf (stderr, "out of memory\n");
+	  exit (2);
+	}
     }
 
-  dev = open (argv [1], O_RDONLY | O_NDELAY, 0);
+  f = floppy_open (argv [1]);
 
-  if (0 > dev)
+  if (! f)
     {
       fprintf (stderr, "error opening drive\n");
       exit (2);
@@ -142,21 +464,21 @@ int main (int argc, char *argv[])
   fm = atoi (argv [4]);
   rate = atoi (argv [5]);
 
-  if (0 > ioctl (dev, FDRESET, & reset_now))
+  if (! floppy_reset (f))
     {
       fprintf (stderr, "can't reset drive\n");
       exit (2);
     }
 
-  if (0 > ioctl (dev, FDGETDRVPRM, & fdp))
+  if (! floppy_drive_params (f, & cmos, & tracks, & rpm))
     {
       fprintf (stderr, "can't get drive parameters\n");
       exit (2);
     }
 
-  printf ("cmos: %d\n", fdp.cmos);
-  printf ("tracks: %d\n", fdp.tracks);
-  printf ("rpm: %d\n", fdp.rps * 60);
+  printf ("cmos: %d\n", cmos);
+  printf ("tracks: %d\n", tracks);
+  printf ("rpm: %d\n", rpm);
 
   switch (rate)
     {
@@ -174,24 +496,36 @@ int main (int argc, char *argv[])
       exit (2);
     }
 
-  if (! recalibrate (dev))
+  if (0 >= floppy_recalibrate (f, data_rate))
     {
       fprintf (stderr, "error recalibrating drive\n");
       exit (2);
     }
 
-  if (! seek (dev, seek_cylinder))
+  if (0 >= floppy_seek (f, data_rate, seek_cylinder))
     {
       fprintf (stderr, "error seeking\n");
       exit (2);
     }
 
+  if (reads)
+    {
+      count = capture_ids (f, data_rate, fm, seek_head, reads,
+			   ring, ring_size, & first);
+      floppy_close (f);
+      if (! write_capture (capture_fn, ring, count, first, rate, fm,
+			   seek_head))
+	exit (2);
+      free (ring);
+      exit (0);
+    }
+
   while (1)
     {
-      if (read_id (dev, fm, seek_head, & cylinder, & head, & sector, & sector_size))
+      if (0 < floppy_read_id (f, data_rate, fm, seek_head, & id))
 	{
 	  printf ("cyl %02d, head %d, sector %02d, size %d\n",
-		  cylinder, head, sector, sector_size);
+		  id.cylinder, id.head, id.sector, 128 << id.size_code);
 	}
       else
 	{
@@ -200,7 +534,7 @@ int main (int argc, char *argv[])
 	}
     }
 
-  close (dev);
+  floppy_close (f);
 
   exit (0);
 }
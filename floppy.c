@@ -0,0 +1,949 @@
+/*
+ * floppy - access to floppy drives through the controller's commands
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include <linux/fd.h>
+#include <linux/fdreg.h>
+
+#include "libdmk.h"
+#include "floppy.h"
+
+
+/* 8272 command codes which are NOT defined in fdreg.h */
+#define FD_READ_TRACK 0x42
+
+
+#define EMU_MAX_CYLINDERS 96
+
+
+typedef struct
+{
+  int (*reset)         (floppy_t f);
+  int (*drive_params)  (floppy_t f, int *cmos, int *tracks, int *rpm);
+  int (*recalibrate)   (floppy_t f, int rate);
+  int (*seek)          (floppy_t f, int rate, int cylinder);
+  int (*read_id)       (floppy_t f, int rate, int fm, int head,
+			floppy_id_t *id);
+  int (*read_sectors)  (floppy_t f, int rate, int fm, int head,
+			floppy_id_t *id, int eot, int count, uint8_t *buf,
+			int *done);
+  int (*read_track)    (floppy_t f, int rate, int fm, int head, int cylinder,
+			int size_code, uint8_t *buf);
+  int (*read_sector_crc) (floppy_t f, int rate, int fm, int head,
+			  floppy_id_t *id, uint8_t *buf, uint16_t *crc);
+  double (*time)       (floppy_t f);
+  void (*close)        (floppy_t f);
+} floppy_ops_t;
+
+
+typedef struct
+{
+  dmk_handle h;
+  int ds;
+  int cylinders;
+  int dd;
+
+  dmk_timing_t timing;  /* rotation, step and settle times */
+  double command_us;    /* to issue a command and collect its result */
+  double err;           /* probability of a CRC error per field read */
+  int bits;             /* bits flipped in a data field read with an error */
+  unsigned int seed;
+  int double_step;      /* boolean */
+  double speed;         /* of the clock relative to wall time, 0 if unpaced */
+  struct timespec start;
+
+  double clock;         /* microseconds of drive time */
+  int position;         /* physical cylinder under the head */
+
+  /* decoded layout of the track under the head */
+  int track_cylinder;
+  int track_head;
+  int sector_count;
+  dmk_sector_t sectors [DMK_MAX_SECTOR];
+} emu_t;
+
+
+struct floppy
+{
+  const floppy_ops_t *ops;
+  uint8_t reply [7];
+  int dev;              /* real drive */
+  struct timespec start;
+  emu_t *emu;           /* emulated drive */
+};
+
+
+/* -----------------------------------------------------------------------------
+ * Linux FDRAWCMD driver
+ * -------------------------------------------------------------------------- */
+
+static int raw_command (floppy_t f, struct floppy_raw_cmd *cmd)
+{
+  if (0 > ioctl (f->dev, FDRAWCMD, cmd))
+    return (-1);
+  memcpy (f->reply, cmd->reply, sizeof (f->reply));
+  return (! (cmd->reply [0] & 0xc0));
+}
+
+
+static int raw_reset (floppy_t f)
+{
+  int reset_now = FD_RESET_IF_NEEDED; /* FD_RESET_ALWAYS */
+
+  return (0 <= ioctl (f->dev, FDRESET, & reset_now));
+}
+
+
+static int raw_drive_params (floppy_t f, int *cmos, int *tracks, int *rpm)
+{
+  struct floppy_drive_params fdp;
+
+  if (0 > ioctl (f->dev, FDGETDRVPRM, & fdp))
+    return (0);
+  *cmos = fdp.cmos;
+  *tracks = fdp.tracks;
+  *rpm = fdp.rps * 60;
+  return (1);
+}
+
+
+static int raw_recalibrate (floppy_t f, int rate)
+{
+  struct floppy_raw_cmd cmd;
+  int i = 0;
+
+  cmd.data = NULL;
+  cmd.length = 0;
+  cmd.rate = rate;
+  cmd.flags = FD_RAW_INTR;
+  cmd.cmd [i++] = FD_RECALIBRATE;
+  cmd.cmd [i++] = 0;
+  cmd.cmd_count = i;
+  return ((0 <= ioctl (f->dev, FDRAWCMD, & cmd)) ? 1 : -1);
+}
+
+
+static int raw_seek (floppy_t f, int rate, int cylinder)
+{
+  struct floppy_raw_cmd cmd;
+  int i = 0;
+
+  cmd.data = NULL;
+  cmd.length = 0;
+  cmd.rate = rate;
+  cmd.flags = FD_RAW_INTR;
+  cmd.cmd[i++] = FD_SEEK;
+  cmd.cmd[i++] = 0;
+  cmd.cmd[i++] = cylinder;
+  cmd.cmd_count = i;
+  return ((0 <= ioctl (f->dev, FDRAWCMD, & cmd)) ? 1 : -1);
+}
+
+
+static int raw_read_id (floppy_t f, int rate, int fm, int head,
+			floppy_id_t *id)
+{
+  struct floppy_raw_cmd cmd;
+  uint8_t mask = 0x5f;
+  int i = 0;
+  int status;
+
+  if (fm)
+    mask &= ~0x40;
+
+  cmd.data = NULL;   /* No data to transfer */
+  cmd.length = 0;
+  cmd.rate = rate;
+  cmd.flags = FD_RAW_INTR;
+  cmd.cmd[i++] = FD_READID & mask;
+  cmd.cmd[i++] = head ? 4 : 0;
+  cmd.cmd_count = i;
+
+  status = raw_command (f, & cmd);
+  if (status <= 0)
+    return (status);
+
+  id->cylinder  = cmd.reply [3];
+  id->head      = cmd.reply [4];
+  id->sector    = cmd.reply [5];
+  id->size_code = cmd.reply [6];
+  return (1);
+}
+
+
+static int raw_read_sectors (floppy_t f, int rate, int fm, int head,
+			     floppy_id_t *id, int eot, int count, uint8_t *buf,
+			     int *done)
+{
+  struct floppy_raw_cmd cmd;
+  int i = 0;
+  uint8_t mask = 0x5f;
+  int sector_length = 128 << id->size_code;
+  int status;
+
+  if (fm)
+    mask &= ~0x40;
+
+  /* the DMA terminal count ends the command after count sectors */
+  cmd.data = buf;
+  cmd.length = sector_length * count;
+  cmd.rate = rate;
+  cmd.flags = FD_RAW_INTR | FD_RAW_READ;
+  cmd.cmd[i++] = FD_READ & mask;
+  cmd.cmd[i++] = head ? 4 : 0;
+  cmd.cmd[i++] = id->cylinder; /* Cylinder value (to check with header) */
+  cmd.cmd[i++] = id->head;  /* Head value (to check with header) */
+  cmd.cmd[i++] = id->sector;
+  cmd.cmd[i++] = id->size_code; /* sector length */
+  cmd.cmd[i++] = eot; /* last sector number on a track */
+  cmd.cmd[i++] = 14; /* gap length */
+  cmd.cmd[i++] = (sector_length < 255) ? sector_length : 0xff;
+  cmd.cmd_count=i;
+
+  status = raw_command (f, & cmd);
+  if (status > 0)
+    *done = count;
+  else if (status == 0)
+    {
+      /* the result phase ID is that of the sector that failed */
+      *done = cmd.reply [5] - id->sector;
+      if ((*done < 0) || (*done > count))
+	*done = 0;
+    }
+  return (status);
+}
+
+
+static int raw_read_track (floppy_t f, int rate, int fm, int head,
+			   int cylinder, int size_code, uint8_t *buf)
+{
+  struct floppy_raw_cmd cmd;
+  int i = 0;
+  uint8_t mask = 0x5f;
+  int sector_size = 128 << size_code;
+
+  if (fm)
+    mask &= ~0x40;
+
+  cmd.data = buf;
+  cmd.length = 128 << size_code;
+  cmd.rate = rate;
+  cmd.flags = FD_RAW_INTR | FD_RAW_READ;
+  cmd.cmd[i++] = FD_READ_TRACK & mask;
+  cmd.cmd[i++] = head ? 4 : 0;
+  cmd.cmd[i++] = cylinder; /* Cylinder value (to check with header) */
+  cmd.cmd[i++] = head ? 1 : 0; /* Head value (to check with header) */
+  cmd.cmd[i++] = 0;
+  cmd.cmd[i++] = size_code; /* 256 byte MFM sectors */
+  cmd.cmd[i++] = 0xff; /* last sector number on a track */
+  cmd.cmd[i++] = 14; /* gap length */
+  cmd.cmd[i++] = (sector_size < 255) ? sector_size : 0xff;
+  cmd.cmd_count=i;
+  return (raw_command (f, & cmd));
+}
+
+
+/*
+ * The controller doesn't compare the size code of the ID with the
+ * command's, so reading with a size code one larger carries on through
+ * the CRC into the gap after the data field.
+ */
+static int raw_read_sector_crc (floppy_t f, int rate, int fm, int head,
+				floppy_id_t *id, uint8_t *buf, uint16_t *crc)
+{
+  floppy_id_t big = *id;
+  int length = 128 << id->size_code;
+  uint8_t *data;
+  int status, done;
+
+  big.size_code++;
+  data = malloc (2 * length);
+  if (! data)
+    return (-1);
+  status = raw_read_sectors (f, rate, fm, head, & big, id->sector, 1, data,
+			     & done);
+  /* the CRC check lands in the wrong place, so a data error in the data
+     field is expected, and anything else means it wasn't read */
+  if ((status > 0) ||
+      ((status == 0) && (f->reply [2] & ST2_DATA_ERROR) &&
+       ! (f->reply [1] & (ST1_MISSING_AM | ST1_NO_DATA))))
+    {
+      memcpy (buf, data, length);
+      *crc = (data [length] << 8) | data [length + 1];
+      status = 1;
+    }
+  free (data);
+  return (status);
+}
+
+
+static double raw_time (floppy_t f)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, & now);
+  return ((now.tv_sec - f->start.tv_sec) +
+	  (now.tv_nsec - f->start.tv_nsec) * 1e-9);
+}
+
+
+static void raw_close (floppy_t f)
+{
+  close (f->dev);
+}
+
+
+static const floppy_ops_t raw_ops =
+{
+  raw_reset,
+  raw_drive_params,
+  raw_recalibrate,
+  raw_seek,
+  raw_read_id,
+  raw_read_sectors,
+  raw_read_track,
+  raw_read_sector_crc,
+  raw_time,
+  raw_close
+};
+
+
+/* -----------------------------------------------------------------------------
+ * Emulated drive serving a DMK image
+ *
+ * Nothing actually waits: each command advances a clock by the time
+ * the real drive would have taken, as given by libdmk's timing model
+ * (see dmk_set_timing), so the angular position of the disk is the
+ * clock modulo one revolution.
+ * -------------------------------------------------------------------------- */
+
+static double emu_revolution (emu_t *e)
+{
+  return (60.0e6 / e->timing.rpm);
+}
+
+
+/* start of the revolution in progress */
+static double emu_index_time (emu_t *e)
+{
+  double rev = emu_revolution (e);
+
+  return ((long long) (e->clock / rev) * rev);
+}
+
+
+/* true, pseudorandomly, with probability err */
+static int emu_inject_error (emu_t *e)
+{
+  return ((e->err > 0.0) &&
+	  ((rand_r (& e->seed) / (RAND_MAX + 1.0)) < e->err));
+}
+
+
+/* damage a data field, and its CRC if crc isn't NULL, as a read error */
+static void emu_flip_bits (emu_t *e, uint8_t *buf, int length, uint16_t *crc)
+{
+  int i, bit;
+
+  for (i = 0; i < e->bits; i++)
+    {
+      bit = rand_r (& e->seed) % ((length + (crc ? 2 : 0)) * 8);
+      if (bit < length * 8)
+	buf [bit >> 3] ^= 0x80 >> (bit & 7);
+      else
+	*crc ^= 0x8000 >> (bit - length * 8);
+    }
+}
+
+
+static int emu_fail (floppy_t f, uint8_t st1, uint8_t st2)
+{
+  f->reply [0] = ST0_ABNORMAL;
+  f->reply [1] = st1;
+  f->reply [2] = st2;
+  return (0);
+}
+
+
+/* decode the track under the head, if it isn't already */
+static int emu_load_track (emu_t *e, int head)
+{
+  int cylinder = e->double_step ? e->position / 2 : e->position;
+
+  if ((cylinder == e->track_cylinder) && (head == e->track_head))
+    return (1);
+  e->track_cylinder = cylinder;
+  e->track_head = head;
+  e->sector_count = 0;
+
+  /* beyond the recorded cylinders or sides, the disk is blank */
+  if ((cylinder >= e->cylinders) || (head > e->ds))
+    return (1);
+  if (! dmk_seek (e->h, cylinder, head))
+    return (0);
+  e->sector_count = dmk_track_sectors (e->h, e->sectors);
+  if (e->sector_count < 0)
+    {
+      e->sector_count = 0;
+      return (0);
+    }
+  return (1);
+}
+
+
+static int emu_mode_matches (emu_t *e, dmk_sector_t *sector, int fm)
+{
+  if (sector->id_status != 1)
+    return (0);  /* the controller ignores IDs with bad CRCs */
+  return (fm ? (sector->id.mode == DMK_FM) : (sector->id.mode != DMK_FM));
+}
+
+
+static int emu_step (emu_t *e, int fm)
+{
+  return ((e->dd && fm) ? 2 : 1);
+}
+
+
+/*
+ * Find the next ID field, of the right density and accepted by match
+ * (if given), to start passing under the head, within the two index
+ * pulses the controller waits before giving up.  Advances the clock to
+ * the end of the ID field and returns the sector's index, or returns
+ * -1 with the clock advanced by two revolutions.
+ */
+static int emu_next_id (emu_t *e, int fm,
+			int (*match) (dmk_sector_t *sector, void *arg),
+			void *arg)
+{
+  double limit = e->clock + 2 * emu_revolution (e);
+  double t, start;
+  int i;
+
+  /* take the IDs in the order they pass the head, each pass over one
+     possibly missing it */
+  if (e->sector_count)
+    for (t = e->clock;
+	 ((i = dmk_next_id_time (e->h, t, & start)) >= 0) && (start <= limit);
+	 t = start + dmk_offset_time (e->h, 1))
+      if (emu_mode_matches (e, & e->sectors [i], fm) &&
+	  ((! match) || match (& e->sectors [i], arg)) &&
+	  ! emu_inject_error (e))
+	{
+	  e->clock = start + dmk_offset_time (e->h, 7 * emu_step (e, fm));
+	  return (i);
+	}
+
+  e->clock = limit;
+  return (-1);
+}
+
+
+static void emu_reply_id (floppy_t f, dmk_sector_t *sector)
+{
+  f->reply [3] = sector->id.cylinder;
+  f->reply [4] = sector->id.head;
+  f->reply [5] = sector->id.sector;
+  f->reply [6] = sector->id.size_code;
+}
+
+
+static int emu_reset (floppy_t f)
+{
+  return (1);
+}
+
+
+static int emu_drive_params (floppy_t f, int *cmos, int *tracks, int *rpm)
+{
+  emu_t *e = f->emu;
+
+  *cmos = 0;
+  *tracks = e->double_step ? e->cylinders * 2 : e->cylinders;
+  *rpm = (int) e->timing.rpm;
+  return (1);
+}
+
+
+static int emu_seek (floppy_t f, int rate, int cylinder)
+{
+  emu_t *e = f->emu;
+
+  if ((cylinder < 0) || (cylinder >= EMU_MAX_CYLINDERS))
+    return (-1);
+  e->clock += e->command_us + dmk_seek_time (e->h, e->position, cylinder);
+  e->position = cylinder;
+  memset (f->reply, 0, sizeof (f->reply));
+  return (1);
+}
+
+
+static int emu_recalibrate (floppy_t f, int rate)
+{
+  return (emu_seek (f, rate, 0));
+}
+
+
+static int emu_read_id (floppy_t f, int rate, int fm, int head,
+			floppy_id_t *id)
+{
+  emu_t *e = f->emu;
+  int i;
+
+  e->clock += e->command_us;
+  if (! emu_load_track (e, head))
+    return (-1);
+  i = emu_next_id (e, fm, NULL, NULL);
+  if (i < 0)
+    return (emu_fail (f, ST1_MISSING_AM, 0));
+
+  memset (f->reply, 0, 3);
+  emu_reply_id (f, & e->sectors [i]);
+  id->cylinder  = e->sectors [i].id.cylinder;
+  id->head      = e->sectors [i].id.head;
+  id->sector    = e->sectors [i].id.sector;
+  id->size_code = e->sectors [i].id.size_code;
+  return (1);
+}
+
+
+static int emu_match_id (dmk_sector_t *sector, void *arg)
+{
+  floppy_id_t *id = arg;
+
+  return ((sector->id.cylinder  == id->cylinder) &&
+	  (sector->id.head      == id->head) &&
+	  (sector->id.sector    == id->sector) &&
+	  (sector->id.size_code == id->size_code));
+}
+
+
+/*
+ * Advance the clock past the data field of a sector and read it.  If
+ * crc isn't NULL, the CRC recorded after the data is stored there, and
+ * the data is returned even if it doesn't match.
+ */
+static int emu_read_data (floppy_t f, dmk_sector_t *sector, int fm,
+			  uint8_t *buf, int length, uint16_t *crc)
+{
+  emu_t *e = f->emu;
+  double rev = emu_revolution (e);
+  double base = emu_index_time (e);
+  double end;
+  uint8_t *data;
+  int size, status;
+
+  emu_reply_id (f, sector);
+  if (! sector->data_status)
+    return (emu_fail (f, ST1_MISSING_AM, ST2_MISSING_DAM));
+
+  /* the data field follows its ID in the same revolution unless the
+     ID straddles the index hole */
+  end = base + dmk_offset_time (e->h, sector->data_offset +
+				 sector->data_length + 2 * emu_step (e, fm));
+  if (end < e->clock)
+    end += rev;
+  e->clock = end;
+
+  size = dmk_sector_size (& sector->id);
+  if (length > size)
+    length = size;
+  data = malloc (size);
+  if ((! data) ||
+      (! dmk_read_sector_with_crcs (e->h, & sector->id, data, crc, NULL)))
+    {
+      free (data);
+      return (-1);
+    }
+  memcpy (buf, data, length);
+  free (data);
+
+  if (sector->data_status < 0)
+    status = emu_fail (f, ST1_DATA_ERROR, ST2_DATA_ERROR);
+  else if (emu_inject_error (e))
+    {
+      emu_flip_bits (e, buf, length, crc);
+      status = emu_fail (f, ST1_DATA_ERROR, ST2_DATA_ERROR);
+    }
+  else
+    {
+      memset (f->reply, 0, 3);
+      status = 1;
+    }
+  return (crc ? 1 : status);
+}
+
+
+/*
+ * Like the controller, read sectors with successive numbers, each
+ * found by waiting for its ID, until the count is satisfied, stopping
+ * at the first one that can't be read.
+ */
+static int emu_read_sectors (floppy_t f, int rate, int fm, int head,
+			     floppy_id_t *id, int eot, int count, uint8_t *buf,
+			     int *done)
+{
+  emu_t *e = f->emu;
+  floppy_id_t next = *id;
+  int length = 128 << id->size_code;
+  int i, status;
+
+  *done = 0;
+  e->clock += e->command_us;
+  if (! emu_load_track (e, head))
+    return (-1);
+  for (; *done < count; (*done)++, next.sector++)
+    {
+      if (next.sector > eot)
+	{
+	  f->reply [5] = next.sector;
+	  return (emu_fail (f, ST1_END_OF_CYL, 0));
+	}
+      i = emu_next_id (e, fm, emu_match_id, & next);
+      if (i < 0)
+	{
+	  f->reply [5] = next.sector;
+	  return (emu_fail (f, ST1_NO_DATA, 0));
+	}
+      status = emu_read_data (f, & e->sectors [i], fm,
+			      buf + *done * length, length, NULL);
+      if (status <= 0)
+	return (status);
+    }
+  return (1);
+}
+
+
+static int emu_read_track (floppy_t f, int rate, int fm, int head,
+			   int cylinder, int size_code, uint8_t *buf)
+{
+  emu_t *e = f->emu;
+  double rev = emu_revolution (e);
+  int i, first = -1;
+
+  e->clock += e->command_us;
+  if (! emu_load_track (e, head))
+    return (-1);
+
+  /* wait for the index hole, then take the first sector after it */
+  if (e->clock > emu_index_time (e))
+    e->clock = emu_index_time (e) + rev;
+  for (i = 0; i < e->sector_count; i++)
+    if (emu_mode_matches (e, & e->sectors [i], fm) &&
+	((first < 0) ||
+	 (e->sectors [i].idam_offset < e->sectors [first].idam_offset)))
+      first = i;
+  if (first < 0)
+    {
+      e->clock += 2 * rev;
+      return (emu_fail (f, ST1_MISSING_AM, 0));
+    }
+  e->clock += dmk_offset_time (e->h, e->sectors [first].idam_offset +
+			       7 * emu_step (e, fm));
+  return (emu_read_data (f, & e->sectors [first], fm, buf, 128 << size_code,
+			 NULL));
+}
+
+
+static int emu_read_sector_crc (floppy_t f, int rate, int fm, int head,
+				floppy_id_t *id, uint8_t *buf, uint16_t *crc)
+{
+  emu_t *e = f->emu;
+  int i;
+
+  e->clock += e->command_us;
+  if (! emu_load_track (e, head))
+    return (-1);
+  i = emu_next_id (e, fm, emu_match_id, id);
+  if (i < 0)
+    {
+      f->reply [5] = id->sector;
+      return (emu_fail (f, ST1_NO_DATA, 0));
+    }
+  return (emu_read_data (f, & e->sectors [i], fm, buf, 128 << id->size_code,
+			 crc));
+}
+
+
+static double emu_time (floppy_t f)
+{
+  return (f->emu->clock * 1e-6);
+}
+
+
+static void emu_close (floppy_t f)
+{
+  dmk_close_image (f->emu->h);
+  free (f->emu);
+}
+
+
+static const floppy_ops_t emu_ops =
+{
+  emu_reset,
+  emu_drive_params,
+  emu_recalibrate,
+  emu_seek,
+  emu_read_id,
+  emu_read_sectors,
+  emu_read_track,
+  emu_read_sector_crc,
+  emu_time,
+  emu_close
+};
+
+
+/*
+ * With a speed set, keep the clock from running ahead of wall time
+ * scaled by the speed, so that an emulated drive is as slow as a real
+ * one, or a known factor faster, and captures from several drives
+ * overlap as they would on real hardware.
+ */
+static void emu_pace (emu_t *e)
+{
+  struct timespec now, delay;
+  double ahead;
+
+  if (e->speed <= 0.0)
+    return;
+  clock_gettime (CLOCK_MONOTONIC, & now);
+  ahead = e->clock / e->speed -
+	  ((now.tv_sec - e->start.tv_sec) * 1e6 +
+	   (now.tv_nsec - e->start.tv_nsec) * 1e-3);
+  if (ahead <= 0.0)
+    return;
+  delay.tv_sec = (time_t) (ahead * 1e-6);
+  delay.tv_nsec = (long) ((ahead - delay.tv_sec * 1e6) * 1e3);
+  while (nanosleep (& delay, & delay) && (errno == EINTR))
+    ;
+}
+
+
+/* parse "image.dmk,name=value,..." */
+static int emu_open (floppy_t f, char *spec)
+{
+  emu_t *e;
+  char *s, *opt, *value;
+
+  s = strdup (spec);
+  if (! s)
+    return (0);
+  e = calloc (1, sizeof (emu_t));
+  if (! e)
+    goto fail;
+  e->timing.rpm = 300.0;
+  e->timing.rate = 0;  /* the track data fills a revolution */
+  e->timing.step_us = 3000.0;
+  e->timing.settle_us = 15000.0;
+  e->command_us = 2000.0;
+  e->seed = 1;
+  e->track_cylinder = -1;
+
+  for (opt = strchr (s, ','); opt; opt = strchr (opt, ','))
+    {
+      *opt++ = '\0';
+      value = strchr (opt, '=');
+      if (! value)
+	goto bad_option;
+      value++;
+      if (strncmp (opt, "rpm=", 4) == 0)
+	e->timing.rpm = atof (value);
+      else if (strncmp (opt, "step=", 5) == 0)
+	e->timing.step_us = atof (value) * 1000.0;
+      else if (strncmp (opt, "settle=", 7) == 0)
+	e->timing.settle_us = atof (value) * 1000.0;
+      else if (strncmp (opt, "cmd=", 4) == 0)
+	e->command_us = atof (value) * 1000.0;
+      else if (strncmp (opt, "err=", 4) == 0)
+	e->err = atof (value);
+      else if (strncmp (opt, "bits=", 5) == 0)
+	e->bits = atoi (value);
+      else if (strncmp (opt, "seed=", 5) == 0)
+	e->seed = strtoul (value, NULL, 0);
+      else if (strncmp (opt, "double=", 7) == 0)
+	e->double_step = atoi (value);
+      else if (strncmp (opt, "speed=", 6) == 0)
+	e->speed = atof (value);
+      else
+	goto bad_option;
+    }
+  if (e->speed < 0.0)
+    goto bad_option;
+  clock_gettime (CLOCK_MONOTONIC, & e->start);
+
+  e->h = dmk_open_image (s, 0, & e->ds, & e->cylinders, & e->dd);
+  if (! e->h)
+    {
+      fprintf (stderr, "error opening emulated disk image %s\n", s);
+      goto fail;
+    }
+  if (! dmk_set_timing (e->h, & e->timing))
+    {
+      dmk_close_image (e->h);
+      goto bad_option;
+    }
+  free (s);
+  f->emu = e;
+  return (1);
+
+ bad_option:
+  fprintf (stderr, "bad emulated drive option in '%s'\n", spec);
+ fail:
+  free (e);
+  free (s);
+  return (0);
+}
+
+
+/* -----------------------------------------------------------------------------
+ * Interface
+ * -------------------------------------------------------------------------- */
+
+/* return the status of a drive command, once it would have completed */
+static int paced (floppy_t f, int status)
+{
+  if (f->emu)
+    emu_pace (f->emu);
+  return (status);
+}
+
+
+floppy_t floppy_open (char *name)
+{
+  floppy_t f;
+
+  f = calloc (1, sizeof (struct floppy));
+  if (! f)
+    return (NULL);
+  if (strncmp (name, "emu:", 4) == 0)
+    {
+      f->ops = & emu_ops;
+      if (! emu_open (f, name + 4))
+	goto fail;
+    }
+  else
+    {
+      f->ops = & raw_ops;
+      f->dev = open (name, O_RDONLY | O_NDELAY, 0);
+      if (f->dev < 0)
+	goto fail;
+      clock_gettime (CLOCK_MONOTONIC, & f->start);
+    }
+  return (f);
+
+ fail:
+  free (f);
+  return (NULL);
+}
+
+
+void floppy_close (floppy_t f)
+{
+  f->ops->close (f);
+  free (f);
+}
+
+
+int floppy_reset (floppy_t f)
+{
+  return (paced (f, f->ops->reset (f)));
+}
+
+
+int floppy_drive_params (floppy_t f, int *cmos, int *tracks, int *rpm)
+{
+  return (f->ops->drive_params (f, cmos, tracks, rpm));
+}
+
+
+int floppy_recalibrate (floppy_t f, int rate)
+{
+  return (paced (f, f->ops->recalibrate (f, rate)));
+}
+
+
+int floppy_seek (floppy_t f, int rate, int cylinder)
+{
+  return (paced (f, f->ops->seek (f, rate, cylinder)));
+}
+
+
+int floppy_read_id (floppy_t f, int rate, int fm, int head, floppy_id_t *id)
+{
+  return (paced (f, f->ops->read_id (f, rate, fm, head, id)));
+}
+
+
+int floppy_read_sector (floppy_t f, int rate, int fm, int head,
+			floppy_id_t *id, int eot, uint8_t *buf)
+{
+  int done;
+
+  return (paced (f, f->ops->read_sectors (f, rate, fm, head, id, eot, 1,
+					  buf, & done)));
+}
+
+
+int floppy_read_sectors (floppy_t f, int rate, int fm, int head,
+			 floppy_id_t *id, int eot, int count, uint8_t *buf,
+			 int *done)
+{
+  return (paced (f, f->ops->read_sectors (f, rate, fm, head, id, eot, count,
+					  buf, done)));
+}
+
+
+int floppy_read_sector_crc (floppy_t f, int rate, int fm, int head,
+			    floppy_id_t *id, uint8_t *buf, uint16_t *crc)
+{
+  return (paced (f, f->ops->read_sector_crc (f, rate, fm, head, id,
+					     buf, crc)));
+}
+
+
+int floppy_read_track (floppy_t f, int rate, int fm, int head, int cylinder,
+		       int size_code, uint8_t *buf)
+{
+  return (paced (f, f->ops->read_track (f, rate, fm, head, cylinder,
+					size_code, buf)));
+}
+
+
+uint8_t *floppy_status (floppy_t f)
+{
+  return (f->reply);
+}
+
+
+double floppy_time (floppy_t f)
+{
+  return (f->ops->time (f));
+}
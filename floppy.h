@@ -0,0 +1,201 @@
+/*
+ * floppy - access to floppy drives through the controller's commands
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+#ifndef DMKLIB_FLOPPY_H
+#define DMKLIB_FLOPPY_H
+
+/*
+ * A floppy is either a real drive, driven with the Linux FDRAWCMD
+ * ioctl, or an emulated one that serves a DMK image as a spinning
+ * disk, so that capture programs can be exercised and timed without
+ * hardware.
+ *
+ * Commands return 1 if the controller completed them normally, 0 if
+ * it terminated them abnormally (see floppy_status), or -1 if the
+ * command couldn't be issued at all, in which case the drive may need
+ * floppy_reset.
+ */
+
+
+/* rate codes are unfortunately NOT defined in fdreg.h */
+/* these rates are for MFM.  effective FM rates are half the MFM rates */
+#define FD_RATE_250_KBPS 2
+#define FD_RATE_300_KBPS 1
+#define FD_RATE_500_KBPS 0
+
+
+/* 8272 status bits, see floppy_status */
+#define ST0_ABNORMAL     0x40
+#define ST1_MISSING_AM   0x01
+#define ST1_NO_DATA      0x04
+#define ST1_DATA_ERROR   0x20
+#define ST1_END_OF_CYL   0x80
+#define ST2_MISSING_DAM  0x01
+#define ST2_DATA_ERROR   0x20  /* in the data field, which was read */
+
+
+typedef struct floppy *floppy_t;
+
+
+typedef struct
+{
+  int cylinder;
+  int head;
+  int sector;
+  int size_code;
+} floppy_id_t;
+
+
+floppy_t floppy_open (char *name);
+
+/*
+ * Open a floppy device, such as /dev/fd0, or an emulated drive named
+ *
+ *   emu:<image.dmk>[,rpm=<n>][,step=<ms>][,settle=<ms>][,cmd=<ms>]
+ *                  [,err=<p>][,bits=<n>][,seed=<n>][,double=1]
+ *                  [,speed=<x>]
+ *
+ * rpm is the rotation speed (default 300), step the time per cylinder
+ * stepped (default 3 ms), settle the head settling time after a seek
+ * (default 15 ms), cmd the time taken by the host to issue each command
+ * (default 2 ms), and err the probability that any one ID or sector
+ * read fails with a CRC error, drawn from a generator seeded with seed.
+ * A data field read with an injected error has bits of its data and
+ * CRC flipped at random (default none).  double=1 serves a 48 tpi
+ * image in a 96 tpi drive, as read with double stepping.  Emulated
+ * commands complete as fast as they can be computed, unless speed is
+ * given: then each waits until the drive time it models, divided by
+ * speed, has passed (speed=1 runs in real time).
+ */
+
+
+void floppy_close (floppy_t f);
+
+
+int floppy_reset (floppy_t f);
+
+
+int floppy_drive_params (floppy_t f,
+			 int *cmos,
+			 int *tracks,
+			 int *rpm);
+
+/*
+ * The drive type, number of cylinders and rotation speed, as known to
+ * the driver.
+ */
+
+
+int floppy_recalibrate (floppy_t f,
+			int rate);
+
+
+int floppy_seek (floppy_t f,
+		 int rate,
+		 int cylinder);  /* physical, after any double stepping */
+
+
+int floppy_read_id (floppy_t f,
+		    int rate,
+		    int fm,
+		    int head,
+		    floppy_id_t *id);
+
+/*
+ * Read the next ID field to pass under the head.
+ */
+
+
+int floppy_read_sector (floppy_t f,
+			int rate,
+			int fm,
+			int head,
+			floppy_id_t *id,  /* logical ID of the sector */
+			int eot,          /* last sector number on the track */
+			uint8_t *buf);
+
+
+int floppy_read_sectors (floppy_t f,
+			 int rate,
+			 int fm,
+			 int head,
+			 floppy_id_t *id,  /* logical ID of the first sector */
+			 int eot,
+			 int count,
+			 uint8_t *buf,
+			 int *done);
+
+/*
+ * Read count sectors with successive sector numbers, starting with id,
+ * in one command, so that they are taken as they pass under the head
+ * rather than each waiting for the next command to be issued.  buf
+ * must hold count sectors.  *done is set to the number of sectors read
+ * correctly; if the command terminates abnormally, the sector that
+ * failed is the one numbered id->sector + *done.
+ */
+
+
+int floppy_read_sector_crc (floppy_t f,
+			    int rate,
+			    int fm,
+			    int head,
+			    floppy_id_t *id,
+			    uint8_t *buf,
+			    uint16_t *crc);
+
+/*
+ * Read a sector's data field together with the CRC recorded after it,
+ * whether or not they agree, so that the caller can check the data
+ * itself (see dmk_data_crc in libdmk.h).  Returns 1 if the data field
+ * was read, 0 if it wasn't found.
+ */
+
+
+int floppy_read_track (floppy_t f,
+		       int rate,
+		       int fm,
+		       int head,
+		       int cylinder,
+		       int size_code,
+		       uint8_t *buf);
+
+/*
+ * Read the data field of the first sector after the index hole,
+ * whatever its ID.
+ */
+
+
+uint8_t *floppy_status (floppy_t f);
+
+/*
+ * The seven result bytes of the last command: ST0, ST1, ST2, and the
+ * cylinder, head, sector and size code of the last ID seen.
+ */
+
+
+double floppy_time (floppy_t f);
+
+/*
+ * Seconds of drive time since the floppy was opened: elapsed real time
+ * for a real drive, or modeled time for an emulated one.
+ */
+
+#endif
@@ -25,12 +25,19 @@
 #define DEBUG_CRC 0
 #undef DEBUG_GAP
 
+#define _GNU_SOURCE  /* for copy_file_range */
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <pthread.h>
 
 #if defined(WIN64) || defined(WIN32)
 #include <windows.h>
@@ -38,6 +45,7 @@
 
 #include "dmk.h"
 #include "libdmk.h"
+#include "dmksimd.h"
 
 
 typedef struct
@@ -137,6 +145,44 @@ track_format_t track_format [MAX_SECTOR_MODE] =
 };
 
 
+#define MAX_SECTOR_SIZE 4096
+
+
+/* decoded ID and data fields, one per IDAM pointer */
+typedef struct
+{
+  uint8_t cylinder;
+  uint8_t head;
+  uint8_t sector;
+  uint8_t size_code;
+  uint8_t mode;         /* sector_mode_t */
+  int8_t id_status;     /* 1 good, -1 bad CRC, 0 no ID field */
+  uint8_t data_mark;    /* 0 if no data field found */
+  int8_t data_status;   /* 1 good, -1 bad CRC, 0 no data field */
+  uint16_t idam;        /* offset of ID address mark in track buffer */
+  uint16_t data;        /* offset of first data byte in track buffer */
+  uint16_t id_actual_crc;
+  uint16_t id_computed_crc;
+  uint16_t data_actual_crc;
+  uint16_t data_computed_crc;
+  uint64_t hash;        /* dmk_hash of the sector data */
+} sector_map_t;
+
+/*
+ * Refcounted track data.  A buffer may be modified only while its
+ * refcount is one and it isn't interned; otherwise it is shared with
+ * other tracks or with snapshots, and is copied on write.
+ */
+typedef struct shared_buf
+{
+  struct shared_buf *next;  /* in hash bucket, if interned */
+  int refcount;
+  int interned;  /* boolean, in the table of identical buffers */
+  int length;
+  uint64_t hash;
+  uint8_t data [];
+} shared_buf_t;
+
 typedef struct
 {
   int resident;  /* boolean */
@@ -144,14 +190,29 @@ typedef struct
   uint8_t  mfm_sector   [DMK_MAX_SECTOR];
   uint16_t idam_pointer [DMK_MAX_SECTOR];
   uint8_t *buf;
+  shared_buf_t *shared;  /* holds buf, NULL if buf was malloced directly */
+  uint64_t version;      /* clock value of the last modification */
+  int map_count;
+  sector_map_t *map;  /* NULL if not decoded, or invalidated by a write */
+  struct track_timing *timing;  /* built from map, and dropped with it */
+  int classified;     /* boolean, track_class and fill are valid */
+  int track_class;    /* track_class_t */
+  uint8_t fill;       /* data byte of every sector of a blank track */
+  int no_ids;         /* boolean, the data has been scanned for ID fields
+			 and has none, so an empty IDAM table is right */
 } track_state_t;
 
 struct dmk_state
 {
   FILE *f;
+  char *fn;
+  dmk_io_t *io;   /* if not NULL, tracks are read through this instead of f */
+  void *io_arg;
 
   int new_image;  /* boolean */
   int writable;   /* boolean */
+  int ids_only;   /* boolean, opened by dmk_open_image_ids, no track data */
+  int indexed;    /* boolean, sector maps loaded from sidecar index */
 
   /* parameters specified by user */
   int ds;    /* disk is double sided */
@@ -161,12 +222,18 @@ struct dmk_state
   int rate;  /* 125, 250, 300, or 500 Kbps */
   int rx02;  /* boolean */
 
+  /* rotational timing model, see dmk_set_timing */
+  dmk_timing_t timing;
+  double rev_time;   /* microseconds per revolution */
+  double byte_time;  /* microseconds per byte of track data */
+
   /* computed parameters */
   int track_length;  /* length of a track buffer, not including IDAM
 			pointers -- raw data only */
 
   /* track information */
   track_state_t *track;  /* index by 2 * cylinder + head */
+  uint64_t clock;        /* source of track versions and snapshot IDs */
 
   /* current status */
   int cur_cylinder;
@@ -179,9 +246,32 @@ struct dmk_state
   int p;  /* index into buf */
 
   int read_id_index;
+
+  struct journal *journal;  /* if not NULL, writes are also logged here */
+  struct merkle *merkle;    /* track hash tree, built on first use */
+  struct watch *watch;      /* if not NULL, watching for outside changes */
+  uint64_t generation;      /* count of reloads of changed tracks */
 };
 
 
+/* write journal, see dmk_journal_open */
+static int journal_sector (dmk_handle h, sector_info_t *sector_info,
+			   uint8_t *data);
+static int journal_track (dmk_handle h, int cylinder, int head);
+static int journal_written (dmk_handle h, int ok);
+static void journal_stop (dmk_handle h);
+static void journal_close (dmk_handle h);
+
+/* track hash tree, see dmk_merkle_root */
+static void merkle_close (dmk_handle h);
+
+/* watch mode, see dmk_watch */
+static void watch_written (dmk_handle h, int i, uint8_t *idam_table,
+			   uint8_t *data);
+static void watch_sync (dmk_handle h);
+static void watch_close (dmk_handle h);
+
+
 
 static void init_crc (dmk_handle h)
 {
@@ -189,15 +279,340 @@ static void init_crc (dmk_handle h)
 }
 
 
-static void compute_crc (dmk_handle h, uint8_t data)
+/* CRC-CCITT (x^16 + x^12 + x^5 + 1), one byte at a time */
+static const uint16_t crc_table [256] =
 {
-  int i;
-  uint16_t d2 = data << 8;
-  for (i = 0; i < 8; i++)
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+  0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+  0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+  0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+  0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+  0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+  0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+  0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+  0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+  0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+  0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+  0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+  0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+  0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+  0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+  0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+  0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+  0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+  0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+  0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+  0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+  0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+  0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+
+static inline void compute_crc (dmk_handle h, uint8_t data)
+{
+  h->crc = (h->crc << 8) ^ crc_table [(h->crc >> 8) ^ data];
+}
+
+
+static void compute_crc_buf (dmk_handle h, uint8_t *data, int len)
+{
+  uint16_t crc = h->crc;
+
+  while (len--)
+    crc = (crc << 8) ^ crc_table [(crc >> 8) ^ *(data++)];
+  h->crc = crc;
+}
+
+
+static inline void put_le16 (uint8_t *p, uint16_t v)
+{
+  p [0] = v & 0xff;
+  p [1] = v >> 8;
+}
+
+
+static inline void put_le32 (uint8_t *p, uint32_t v)
+{
+  put_le16 (p, v & 0xffff);
+  put_le16 (p + 2, v >> 16);
+}
+
+
+static inline void put_le64 (uint8_t *p, uint64_t v)
+{
+  put_le32 (p, v & 0xffffffff);
+  put_le32 (p + 4, v >> 32);
+}
+
+
+static inline uint16_t get_le16 (const uint8_t *p)
+{
+  return (p [0] | (p [1] << 8));
+}
+
+
+static inline uint32_t get_le32 (const uint8_t *p)
+{
+  return (p [0] | (p [1] << 8) | (p [2] << 16) | ((uint32_t) p [3] << 24));
+}
+
+
+static inline uint64_t get_le64 (const uint8_t *p)
+{
+  return (get_le32 (p) | ((uint64_t) get_le32 (p + 4) << 32));
+}
+
+
+/* 64-bit content hash, using the XXH64 algorithm with a seed of zero */
+
+#define HASH_PRIME_1 0x9e3779b185ebca87ULL
+#define HASH_PRIME_2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME_3 0x165667b19e3779f9ULL
+#define HASH_PRIME_4 0x85ebca77c2b2ca63ULL
+#define HASH_PRIME_5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t rotl64 (uint64_t x, int r)
+{
+  return ((x << r) | (x >> (64 - r)));
+}
+
+
+static inline uint64_t hash_round (uint64_t acc, uint64_t input)
+{
+  acc += input * HASH_PRIME_2;
+  acc = rotl64 (acc, 31);
+  return (acc * HASH_PRIME_1);
+}
+
+
+static inline uint64_t hash_merge (uint64_t acc, uint64_t val)
+{
+  acc ^= hash_round (0, val);
+  return (acc * HASH_PRIME_1 + HASH_PRIME_4);
+}
+
+
+uint64_t dmk_hash (const uint8_t *data, int len)
+{
+  const uint8_t *end = data + len;
+  uint64_t h;
+
+  if (len >= 32)
+    {
+      uint64_t v1 = HASH_PRIME_1 + HASH_PRIME_2;
+      uint64_t v2 = HASH_PRIME_2;
+      uint64_t v3 = 0;
+      uint64_t v4 = - HASH_PRIME_1;
+
+      while (data + 32 <= end)
+	{
+	  v1 = hash_round (v1, get_le64 (data));
+	  v2 = hash_round (v2, get_le64 (data + 8));
+	  v3 = hash_round (v3, get_le64 (data + 16));
+	  v4 = hash_round (v4, get_le64 (data + 24));
+	  data += 32;
+	}
+      h = rotl64 (v1, 1) + rotl64 (v2, 7) + rotl64 (v3, 12) + rotl64 (v4, 18);
+      h = hash_merge (h, v1);
+      h = hash_merge (h, v2);
+      h = hash_merge (h, v3);
+      h = hash_merge (h, v4);
+    }
+  else
+    h = HASH_PRIME_5;
+
+  h += (uint64_t) len;
+
+  while (data + 8 <= end)
+    {
+      h ^= hash_round (0, get_le64 (data));
+      h = rotl64 (h, 27) * HASH_PRIME_1 + HASH_PRIME_4;
+      data += 8;
+    }
+  if (data + 4 <= end)
+    {
+      h ^= get_le32 (data) * HASH_PRIME_1;
+      h = rotl64 (h, 23) * HASH_PRIME_2 + HASH_PRIME_3;
+      data += 4;
+    }
+  while (data < end)
+    {
+      h ^= (*data++) * HASH_PRIME_5;
+      h = rotl64 (h, 11) * HASH_PRIME_1;
+    }
+
+  h ^= h >> 33;
+  h *= HASH_PRIME_2;
+  h ^= h >> 29;
+  h *= HASH_PRIME_3;
+  h ^= h >> 32;
+  return (h);
+}
+
+
+/*
+ * Shared track buffers.  Blank and unformatted tracks, including the
+ * virgin fill of new images, are usually identical to tracks of the
+ * same length elsewhere in this image or in other open images, so they
+ * are interned: kept once in a process-wide table.  Other buffers are
+ * shared only between a track and snapshots of it.  Either way they are
+ * copied on the first write.
+ */
+
+#define SHARED_BUF_BUCKETS 256
+
+/* one lock per bucket, so handles used from different threads only
+   contend when they intern buffers that hash alike */
+static shared_buf_t *shared_buf_table [SHARED_BUF_BUCKETS];
+static pthread_mutex_t shared_buf_mutex [SHARED_BUF_BUCKETS] =
+  { [0 ... SHARED_BUF_BUCKETS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+
+static shared_buf_t *alloc_shared_buf (int length)
+{
+  shared_buf_t *sb;
+
+  sb = malloc (sizeof (shared_buf_t) + length);
+  if (! sb)
+    return (NULL);
+  sb->next = NULL;
+  sb->refcount = 1;
+  sb->interned = 0;
+  sb->length = length;
+  sb->hash = 0;
+  return (sb);
+}
+
+
+/* find or add an interned buffer with the given contents */
+static shared_buf_t *get_shared_buf (uint8_t *data, int length)
+{
+  uint64_t hash = dmk_hash (data, length);
+  int b = hash % SHARED_BUF_BUCKETS;
+  shared_buf_t **bucket = & shared_buf_table [b];
+  shared_buf_t *sb;
+
+  pthread_mutex_lock (& shared_buf_mutex [b]);
+  for (sb = *bucket; sb; sb = sb->next)
+    if ((sb->hash == hash) && (sb->length == length) &&
+	(memcmp (sb->data, data, length) == 0))
+      break;
+  if (sb)
+    __atomic_add_fetch (& sb->refcount, 1, __ATOMIC_RELAXED);
+  else
+    {
+      sb = alloc_shared_buf (length);
+      if (sb)
+	{
+	  sb->interned = 1;
+	  sb->hash = hash;
+	  memcpy (sb->data, data, length);
+	  sb->next = *bucket;
+	  *bucket = sb;
+	}
+    }
+  pthread_mutex_unlock (& shared_buf_mutex [b]);
+  return (sb);
+}
+
+
+/* take another reference; the caller must already hold one */
+static shared_buf_t *ref_shared_buf (shared_buf_t *sb)
+{
+  __atomic_add_fetch (& sb->refcount, 1, __ATOMIC_RELAXED);
+  return (sb);
+}
+
+
+static void put_shared_buf (shared_buf_t *sb)
+{
+  shared_buf_t **p;
+  int b;
+  int old;
+
+  if (! sb->interned)
+    {
+      if (__atomic_sub_fetch (& sb->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+	free (sb);
+      return;
+    }
+
+  /* interned buffers can be found by lookups, so only the last
+     reference is dropped under the lock; lookups revive a buffer
+     only while holding it */
+  old = __atomic_load_n (& sb->refcount, __ATOMIC_RELAXED);
+  while (old > 1)
+    if (__atomic_compare_exchange_n (& sb->refcount, & old, old - 1, 0,
+				     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return;
+
+  b = sb->hash % SHARED_BUF_BUCKETS;
+  pthread_mutex_lock (& shared_buf_mutex [b]);
+  if (__atomic_sub_fetch (& sb->refcount, 1, __ATOMIC_ACQ_REL) == 0)
     {
-      h->crc = (h->crc << 1) ^ ((((h->crc ^ d2) & 0x8000) ? 0x1021 : 0));
-      d2 <<= 1;
+      for (p = & shared_buf_table [b]; *p != sb; p = & (*p)->next)
+	;
+      *p = sb->next;
+      free (sb);
     }
+  pthread_mutex_unlock (& shared_buf_mutex [b]);
+}
+
+
+/* replace a track's buffer with the interned copy of its contents */
+static void share_track_buf (track_state_t *track, int length)
+{
+  shared_buf_t *sb;
+
+  sb = get_shared_buf (track->buf, length);
+  if (! sb)
+    return;  /* keep the private copy */
+  if (track->shared)
+    put_shared_buf (track->shared);
+  else
+    free (track->buf);
+  track->shared = sb;
+  track->buf = sb->data;
+}
+
+
+/* give a track a buffer of its own before it is modified */
+static int unshare_track_buf (track_state_t *track, int length)
+{
+  shared_buf_t *sb;
+
+  if ((! track->shared) ||
+      ((! track->shared->interned) &&
+       (__atomic_load_n (& track->shared->refcount, __ATOMIC_ACQUIRE) == 1)))
+    return (1);
+  sb = alloc_shared_buf (length);
+  if (! sb)
+    return (0);
+  memcpy (sb->data, track->buf, length);
+  put_shared_buf (track->shared);
+  track->shared = sb;
+  track->buf = sb->data;
+  return (1);
+}
+
+
+static void release_track_buf (track_state_t *track)
+{
+  if (track->shared)
+    put_shared_buf (track->shared);
+  else if (track->buf)
+    free (track->buf);
+  track->shared = NULL;
+  track->buf = NULL;
 }
 
 
@@ -298,451 +713,3369 @@ static int check_crc (dmk_handle h)
 }
 
 
-static void write_buf (dmk_handle h,
-		       int len,
-		       uint8_t *data)
+#define MAX_ID_GAP 50  /* shouldn't ever be more than 17 for FM, 34 for MFM */
+
+
+/* FM sectors are stored with every byte doubled in DD images */
+static int byte_step (dmk_handle h, int mode)
 {
-  if (! h->writable)
-    return;  /* ideally we wouldn't get this far */
+  return ((h->dd && ((mode == DMK_FM) || (mode == DMK_RX02))) ? 2 : 1);
+}
 
-  assert (h->p >= 0);
 
-  h->cur_track->dirty = 1;
+/*
+ * Decode an ID field from raw image bytes.  The bytes start at the ID
+ * address mark, and are doubled for FM sectors in a DD image.
+ */
+static void decode_id_field (dmk_handle h,
+			     int mode,
+			     uint8_t *raw,
+			     sector_map_t *map)
+{
+  int j;
+  int step = byte_step (h, mode);
+  track_format_t *fmt = & track_format [mode];
+  uint8_t d [7];
+
+  for (j = 0; j < 7; j++)
+    d [j] = raw [j * step];
+
+  init_crc (h);
+  for (j = 0; j < fmt->id_address_mark [0].count; j++)
+    compute_crc (h, fmt->id_address_mark [0].data);
+  for (j = 0; j < 5; j++)
+    compute_crc (h, d [j]);
+
+  map->cylinder        = d [1];
+  map->head            = d [2];
+  map->sector          = d [3];
+  map->size_code       = d [4];
+  map->mode            = mode;
+  map->id_actual_crc   = (d [5] << 8) | d [6];
+  map->id_computed_crc = h->crc;
+  if (d [0] != fmt->id_address_mark [1].data)
+    map->id_status = 0;
+  else
+    map->id_status = (map->id_actual_crc == map->id_computed_crc) ? 1 : -1;
+}
+
+
+static void copy_track_data (track_state_t *track,
+			     int p,
+			     int step,
+			     int len,
+			     uint8_t *data)
+{
   while (len--)
     {
-      compute_crc (h, *data);
-      h->cur_track->buf [h->p] = *data;
-      inc_p (h);
-      if (h->dd && (h->cur_mode == DMK_FM))
-	{
-	  h->cur_track->buf [h->p] = *data;
-	  inc_p (h);
-	}
-      data++;
+      *(data++) = track->buf [p];
+      p += step;
     }
 }
 
 
-static void write_buf_const (dmk_handle h,
-			     int count,
-			     uint8_t val)
+/* locate and check the data field following an ID field ending at p */
+static void decode_data_field (dmk_handle h,
+			       track_state_t *track,
+			       sector_map_t *map,
+			       int p)
 {
-  while (count--)
-    write_buf (h, 1, & val);
+  int q, end;
+  int step = byte_step (h, map->mode);
+  int len;
+  uint8_t b;
+  uint8_t data [MAX_SECTOR_SIZE + 2];
+
+  /* look for F8..FD (FD for RX02) in the gap, skipping the second copy
+     of each doubled FM byte */
+  end = p + MAX_ID_GAP * step;
+  if (end > h->track_length)
+    end = h->track_length;
+  if (p >= end)
+    return;
+  for (q = p; ; q++)
+    {
+      q += simd_find_range (& track->buf [q], end - q, 0xf8, 0xfd);
+      if (q >= end)
+	return;
+      if (((q - p) % step) == 0)
+	break;
+    }
+  b = track->buf [q];
+  p = q + step;
+
+  /* RX02 data fields are MFM, so aren't doubled */
+  if (map->mode == DMK_RX02)
+    step = 1;
+
+  len = sector_size (map->mode, map->size_code);
+  if ((p + (len + 2) * step) > h->track_length)
+    return;
+  copy_track_data (track, p, step, len + 2, data);
+
+  init_crc (h);
+  if (map->mode == DMK_MFM)
+    {
+      /* In MFM, the three A1 bytes are included in the CRC */
+      compute_crc (h, 0xa1);
+      compute_crc (h, 0xa1);
+      compute_crc (h, 0xa1);
+    }
+  compute_crc (h, b);
+  compute_crc_buf (h, data, len);
+
+  map->data_mark         = b;
+  map->data              = p;
+  map->data_actual_crc   = (data [len] << 8) | data [len + 1];
+  map->data_computed_crc = h->crc;
+  map->data_status       = (map->data_actual_crc == h->crc) ? 1 : -1;
+  map->hash              = dmk_hash (data, len);
 }
 
 
-static void write_buf_count_data (dmk_handle h, count_data_t *cd)
+/* decode all ID and data fields of a resident track */
+static int build_sector_map (dmk_handle h, track_state_t *track)
 {
-  write_buf_const (h, cd->count, cd->data);
+  int i, p, step;
+  sector_map_t *map;
+
+  for (i = 0; i < DMK_MAX_SECTOR; i++)
+    if (! track->idam_pointer [i])
+      break;
+  track->map_count = i;
+  track->map = calloc (i ? i : 1, sizeof (sector_map_t));
+  if (! track->map)
+    return (0);
+
+  for (i = 0; i < track->map_count; i++)
+    {
+      map = & track->map [i];
+      p = track->idam_pointer [i];
+      step = byte_step (h, track->mfm_sector [i]);
+      map->idam = p;
+      map->mode = track->mfm_sector [i];
+      if ((p + 7 * step) > h->track_length)
+	continue;
+      decode_id_field (h, map->mode, & track->buf [p], map);
+      map->idam = p;
+      if (map->id_status)
+	decode_data_field (h, track, map, p + 7 * step);
+    }
+  return (1);
 }
 
 
-static void write_buf_count_data_clock (dmk_handle h, count_data_clock_t *cd)
+/*
+ * IDAM table recovery.  Some tools leave the IDAM pointer table zeroed
+ * or corrupt, so when a table doesn't make sense the track data is
+ * scanned for ID address marks instead: FE preceded by A1 A1 A1 for
+ * MFM, or FE preceded by a zero sync byte for FM (each byte doubled in
+ * DD images).  Only ID fields with good CRCs are accepted, and the data
+ * field following each one is skipped so sector contents aren't taken
+ * for address marks.
+ */
+
+/* check the table is in range and without holes, and, if the track
+   data is resident, that each pointer is at an FE byte */
+static int idam_table_valid (dmk_handle h, track_state_t *track)
 {
-  write_buf_const (h, cd->count, cd->data);
+  int i, p;
+  int end = 0;  /* boolean, seen the end of the table */
+
+  for (i = 0; i < DMK_MAX_SECTOR; i++)
+    {
+      p = track->idam_pointer [i];
+      if (! p)
+	{
+	  end = 1;
+	  continue;
+	}
+      if (end)
+	return (0);
+      if ((p + 7 * byte_step (h, track->mfm_sector [i])) > h->track_length)
+	return (0);
+      if (track->buf && (track->buf [p] != 0xfe))
+	return (0);
+    }
+  return (1);
 }
 
 
-static void write_crc (dmk_handle h)
+static int try_id_field (dmk_handle h,
+			 track_state_t *track,
+			 int mode,
+			 int p,
+			 sector_map_t *map)
 {
-  uint8_t d [2];
-  /* $$$ byte order? */
-  d [0] = h->crc >> 8;
-  d [1] = h->crc & 0xff;
-  write_buf (h, 2, d);
+  if ((p + 7 * byte_step (h, mode)) > h->track_length)
+    return (0);
+  memset (map, 0, sizeof (sector_map_t));
+  decode_id_field (h, mode, & track->buf [p], map);
+  return (map->id_status == 1);
 }
 
 
-dmk_handle dmk_open_image (char *fn,
-			   int write_enable,
-			   int *ds,
-			   int *cylinders,
-			   int *dd)
+/* rebuild the IDAM table of a resident track, returning the ID count */
+static int scan_idams (dmk_handle h, track_state_t *track)
 {
-  dmk_handle h;
-  uint8_t dmk_header [DMK_HEADER_LENGTH];
-
-  h = calloc (1, sizeof (struct dmk_state));
-  if (! h)
-    goto fail;
+  int p = 0;
+  int count = 0;
+  int mode, step;
+  int fm_mode = h->rx02 ? DMK_RX02 : DMK_FM;
+  uint8_t *buf = track->buf;
+  sector_map_t map;
 
-  h->f = fopen (fn, write_enable ? "r+" : "rb");
-  if (! h->f)
-    goto fail;
+  memset (track->idam_pointer, 0, sizeof (track->idam_pointer));
+  memset (track->mfm_sector, 0, sizeof (track->mfm_sector));
 
-  if (1 != fread (dmk_header, sizeof (dmk_header), 1, h->f))
+  while (count < DMK_MAX_SECTOR)
     {
-      fprintf (stderr, "error reading DMK header\n");
-      goto fail;
-    }
+      p += simd_find_range (& buf [p], h->track_length - p, 0xfe, 0xfe);
+      if (p >= h->track_length)
+	break;
 
-  /* if write requested, make sure the file isn't locked */
-  if (write_enable && dmk_header [0])
-    {
-      fprintf (stderr, "write-locked DMK file\n");
-      goto fail;
+      step = byte_step (h, fm_mode);
+      if (h->dd && (! h->rx02) && (p >= 3) &&
+	  (buf [p - 1] == 0xa1) && (buf [p - 2] == 0xa1) && (buf [p - 3] == 0xa1) &&
+	  try_id_field (h, track, DMK_MFM, p, & map))
+	mode = DMK_MFM;
+      else if ((p >= step) && (buf [p - step] == 0x00) &&
+	       ((step == 1) || ((p + 1 < h->track_length) && (buf [p + 1] == 0xfe))) &&
+	       try_id_field (h, track, fm_mode, p, & map))
+	mode = fm_mode;
+      else
+	{
+	  p++;
+	  continue;
+	}
+
+      track->idam_pointer [count] = p;
+      track->mfm_sector [count] = mode;
+      count++;
+
+      step = byte_step (h, mode);
+      decode_data_field (h, track, & map, p + 7 * step);
+      if (map.data_status)
+	p = map.data + ((sector_size (mode, map.size_code) + 2) *
+			((mode == DMK_RX02) ? 1 : step));
+      else
+	p += 7 * step;
     }
+  return (count);
+}
 
-  h->writable = write_enable;
 
-  h->cylinders = dmk_header [1];
-  h->track_length = ((dmk_header [3] << 8) | dmk_header [2]) - 2 * DMK_MAX_SECTOR;
+static void recover_idam_table (dmk_handle h,
+				track_state_t *track,
+				int cylinder,
+				int head)
+{
+  int had_table = track->idam_pointer [0] != 0;
+  int count;
+
+  count = scan_idams (h, track);
+  track->no_ids = ! count;
+  if (had_table || count)
+    fprintf (stderr, "cylinder %d head %d: IDAM table rebuilt from track data, %d IDs found\n",
+	     cylinder, head, count);
+}
+
+
+static void invalidate_sector_map (track_state_t *track)
+{
+  if (track->map)
+    free (track->map);
+  track->map = NULL;
+  track->map_count = 0;
+  track->classified = 0;
+  track->no_ids = 0;
+  free (track->timing);
+  track->timing = NULL;
+}
+
+
+/*
+ * Tracks of a new image that still hold nothing but the fill they were
+ * created with are left as holes in the file.  Anything written to a
+ * track is kept, even if no ID field can be found in it.
+ */
+static int track_is_hole (dmk_handle h, track_state_t *track)
+{
+  return (h->new_image &&
+	  ((! track->buf) || (! track->dirty) ||
+	   simd_uniform (track->buf, h->track_length, 0xff)));
+}
+
+
+/* classify a track from its sector map, caching the result */
+static int classify_track (dmk_handle h, track_state_t *track)
+{
+  int i, len;
+  sector_map_t *map;
+
+  if (track->classified)
+    return (1);
+  if ((! track->map) && ((! track->buf) || ! build_sector_map (h, track)))
+    return (0);
+
+  track->fill = 0;
+  if (! track->map_count)
+    track->track_class = DMK_TRACK_UNFORMATTED;
+  else if (! track->buf)
+    track->track_class = DMK_TRACK_USED;  /* no data to check */
+  else
+    {
+      track->track_class = DMK_TRACK_BLANK;
+      track->fill = track->buf [track->map [0].data];
+      for (i = 0; i < track->map_count; i++)
+	{
+	  map = & track->map [i];
+	  if ((map->id_status != 1) || (map->data_status != 1))
+	    break;
+	  /* doubled FM data is uniform iff its raw bytes are */
+	  len = sector_size (map->mode, map->size_code);
+	  if (map->mode != DMK_RX02)
+	    len *= byte_step (h, map->mode);
+	  if (! simd_uniform (& track->buf [map->data], len, track->fill))
+	    break;
+	}
+      if (i < track->map_count)
+	{
+	  track->track_class = DMK_TRACK_USED;
+	  track->fill = 0;
+	}
+    }
+  track->classified = 1;
+  return (1);
+}
+
+
+static sector_map_t *find_sector_map (track_state_t *track,
+				      sector_info_t *req_sector)
+{
+  int i;
+  sector_map_t *map;
+
+  for (i = 0; i < track->map_count; i++)
+    {
+      map = & track->map [i];
+      if ((map->id_status == 1) &&
+	  (map->mode      == req_sector->mode) &&
+	  (map->cylinder  == req_sector->cylinder) &&
+	  (map->head      == req_sector->head) &&
+	  (map->sector    == req_sector->sector) &&
+	  (map->size_code == req_sector->size_code))
+	return (map);
+    }
+  return (NULL);
+}
+
+
+/*
+ * Sidecar index files.  The index holds the decoded sector map of every
+ * track, and is only trusted if the image size, modification time and
+ * header all match what was recorded when the index was written.
+ */
+
+#define INDEX_EXT ".dmkidx"
+#define INDEX_MAGIC "DMKIDX\0\1"
+#define INDEX_HEADER_LENGTH 40
+#define INDEX_RECORD_LENGTH 28
+
+static char *sidecar_name (char *fn, char *ext)
+{
+  char *name;
+  int len = strlen (fn);
+
+  name = malloc (len + strlen (ext) + 1);
+  if (! name)
+    return (NULL);
+  strcpy (name, fn);
+  if ((len > 4) && (strcmp (& name [len - 4], ".dmk") == 0))
+    len -= 4;
+  strcpy (& name [len], ext);
+  return (name);
+}
+
+
+static void index_header (dmk_handle h,
+			  struct stat *st,
+			  uint8_t *dmk_header,
+			  uint8_t *buf)
+{
+  memcpy (buf, INDEX_MAGIC, 8);
+  put_le64 (& buf [8], st->st_size);
+  put_le64 (& buf [16], st->st_mtim.tv_sec);
+  put_le32 (& buf [24], st->st_mtim.tv_nsec);
+  put_le64 (& buf [28], dmk_hash (dmk_header, DMK_HEADER_LENGTH));
+  put_le32 (& buf [36], h->cylinders * (h->ds + 1));
+}
+
+
+static int read_index (dmk_handle h, uint8_t *dmk_header)
+{
+  char *name;
+  FILE *f = NULL;
+  struct stat st;
+  long len;
+  uint8_t *buf = NULL;
+  uint8_t expected [INDEX_HEADER_LENGTH];
+  uint8_t *p, *end;
+  int i, j;
+  track_state_t *track;
+  sector_map_t *map;
+
+  name = sidecar_name (h->fn, INDEX_EXT);
+  if (! name)
+    return (0);
+  f = fopen (name, "rb");
+  free (name);
+  if (! f)
+    return (0);
+
+  if ((0 > fstat (fileno (h->f), & st)) ||
+      (0 > fseek (f, 0, SEEK_END)) ||
+      (0 > (len = ftell (f))) ||
+      (len < INDEX_HEADER_LENGTH + 8) ||
+      (0 > fseek (f, 0, SEEK_SET)))
+    goto fail;
+
+  buf = malloc (len);
+  if ((! buf) || (1 != fread (buf, len, 1, f)))
+    goto fail;
+
+  index_header (h, & st, dmk_header, expected);
+  if (memcmp (buf, expected, INDEX_HEADER_LENGTH) != 0)
+    goto fail;
+  if (dmk_hash (buf, len - 8) != get_le64 (& buf [len - 8]))
+    goto fail;
+
+  p = & buf [INDEX_HEADER_LENGTH];
+  end = & buf [len - 8];
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
+    {
+      track = & h->track [i];
+      if ((p >= end) || (p [0] > DMK_MAX_SECTOR) ||
+	  ((p + 1 + p [0] * INDEX_RECORD_LENGTH) > end))
+	goto fail;
+      track->map_count = *(p++);
+      track->map = calloc (track->map_count ? track->map_count : 1,
+			   sizeof (sector_map_t));
+      if (! track->map)
+	goto fail;
+      track->no_ids = ! track->map_count;  /* no need to scan it again */
+      for (j = 0; j < track->map_count; j++)
+	{
+	  map = & track->map [j];
+	  map->cylinder          = p [0];
+	  map->head              = p [1];
+	  map->sector            = p [2];
+	  map->size_code         = p [3];
+	  map->mode              = p [4];
+	  map->id_status         = (int8_t) p [5];
+	  map->data_mark         = p [6];
+	  map->data_status       = (int8_t) p [7];
+	  map->idam              = get_le16 (& p [8]);
+	  map->data              = get_le16 (& p [10]);
+	  map->id_actual_crc     = get_le16 (& p [12]);
+	  map->id_computed_crc   = get_le16 (& p [14]);
+	  map->data_actual_crc   = get_le16 (& p [16]);
+	  map->data_computed_crc = get_le16 (& p [18]);
+	  map->hash              = get_le64 (& p [20]);
+	  if ((map->mode >= MAX_SECTOR_MODE) ||
+	      (map->idam >= h->track_length) ||
+	      (map->data + sector_size (map->mode, map->size_code) *
+	       byte_step (h, map->mode) > h->track_length))
+	    goto fail;
+	  p += INDEX_RECORD_LENGTH;
+	}
+    }
+  if (p != end)
+    goto fail;
+
+  free (buf);
+  fclose (f);
+  return (1);
+
+ fail:
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
+    invalidate_sector_map (& h->track [i]);
+  if (buf)
+    free (buf);
+  fclose (f);
+  return (0);
+}
+
+
+static void write_buf (dmk_handle h,
+		       int len,
+		       uint8_t *data)
+{
+  if (! h->writable)
+    return;  /* ideally we wouldn't get this far */
+
+  assert (h->p >= 0);
+
+  if (! unshare_track_buf (h->cur_track, h->track_length))
+    {
+      fprintf (stderr, "out of memory copying shared track\n");
+      return;
+    }
+  h->cur_track->dirty = 1;
+  h->cur_track->version = ++h->clock;
+  invalidate_sector_map (h->cur_track);
+  while (len--)
+    {
+      compute_crc (h, *data);
+      h->cur_track->buf [h->p] = *data;
+      inc_p (h);
+      if (h->dd && (h->cur_mode == DMK_FM))
+	{
+	  h->cur_track->buf [h->p] = *data;
+	  inc_p (h);
+	}
+      data++;
+    }
+}
+
+
+static void write_buf_const (dmk_handle h,
+			     int count,
+			     uint8_t val)
+{
+  while (count--)
+    write_buf (h, 1, & val);
+}
+
+
+static void write_buf_count_data (dmk_handle h, count_data_t *cd)
+{
+  write_buf_const (h, cd->count, cd->data);
+}
+
+
+static void write_buf_count_data_clock (dmk_handle h, count_data_clock_t *cd)
+{
+  write_buf_const (h, cd->count, cd->data);
+}
+
+
+static void write_crc (dmk_handle h)
+{
+  uint8_t d [2];
+  /* $$$ byte order? */
+  d [0] = h->crc >> 8;
+  d [1] = h->crc & 0xff;
+  write_buf (h, 2, d);
+}
+
+
+static void default_timing (dmk_handle h)
+{
+  dmk_timing_t timing;
+
+  timing.rpm = h->rpm;
+  timing.rate = h->rate;
+  timing.step_us = 3000.0;
+  timing.settle_us = 15000.0;
+  dmk_set_timing (h, & timing);
+}
+
+
+static void parse_header (dmk_handle h, uint8_t *dmk_header)
+{
+  h->cylinders = dmk_header [1];
+  h->track_length = ((dmk_header [3] << 8) | dmk_header [2]) - 2 * DMK_MAX_SECTOR;
   h->dd   = ! (dmk_header [4] & DMK_FLAG_SD_MASK);
   h->ds   = ! (dmk_header [4] & DMK_FLAG_SS_MASK);
   h->rx02 = !!(dmk_header [4] & DMK_FLAG_RX02_MASK);
 
-  *ds = h->ds;
-  *cylinders = h->cylinders;
-  *dd = h->dd;
+  /* the header doesn't record the rotation speed or data rate, so take
+     the 8-inch track lengths of the DMK spec as 360 RPM, anything else
+     as 300, and spread the track data over one revolution */
+  if ((h->track_length == 0x2900) || (h->track_length == 0x14a0))
+    h->rpm = 360;
+  else
+    h->rpm = 300;
+  h->rate = 0;
+  default_timing (h);
+}
+
+
+dmk_handle dmk_open_image (char *fn,
+			   int write_enable,
+			   int *ds,
+			   int *cylinders,
+			   int *dd)
+{
+  dmk_handle h;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+
+  h = calloc (1, sizeof (struct dmk_state));
+  if (! h)
+    goto fail;
+
+  h->f = fopen (fn, write_enable ? "r+" : "rb");
+  if (! h->f)
+    goto fail;
+
+  h->fn = strdup (fn);
+  if (! h->fn)
+    goto fail;
+
+  if (1 != fread (dmk_header, sizeof (dmk_header), 1, h->f))
+    {
+      fprintf (stderr, "error reading DMK header\n");
+      goto fail;
+    }
+
+  /* if write requested, make sure the file isn't locked */
+  if (write_enable && dmk_header [0])
+    {
+      fprintf (stderr, "write-locked DMK file\n");
+      goto fail;
+    }
+
+  h->writable = write_enable;
+
+  parse_header (h, dmk_header);
+
+  *ds = h->ds;
+  *cylinders = h->cylinders;
+  *dd = h->dd;
+
+  h->track = calloc (h->cylinders * (h->ds + 1), sizeof (track_state_t));
+  if (! h->track)
+    goto fail;
+
+  /* use the sidecar index, if there's a valid one */
+  h->indexed = read_index (h, dmk_header);
+
+  /* 
+   * Make sure the first seek will do the right thing, by setting
+   * the current position to a non-existent track
+   */
+  h->cur_cylinder = -1;
+  h->cur_head = -1;
+
+  return (h);
+
+ fail:
+  if (h)
+    {
+      if (h->f)
+	fclose (h->f);
+      if (h->fn)
+	free (h->fn);
+      if (h->track)
+	free (h->track);
+      free (h);
+    }
+  return (NULL);
+}
+
+
+dmk_handle dmk_open_io (dmk_io_t *io,
+			void *arg,
+			uint8_t *dmk_header,
+			int *ds,
+			int *cylinders,
+			int *dd)
+{
+  dmk_handle h;
+
+  h = calloc (1, sizeof (struct dmk_state));
+  if (! h)
+    return (NULL);
+
+  h->io = io;
+  h->io_arg = arg;
+  h->writable = io->write_track != NULL;
+
+  parse_header (h, dmk_header);
+
+  *ds = h->ds;
+  *cylinders = h->cylinders;
+  *dd = h->dd;
+
+  h->track = calloc (h->cylinders * (h->ds + 1), sizeof (track_state_t));
+  if (! h->track)
+    {
+      free (h);
+      return (NULL);
+    }
+
+  h->cur_cylinder = -1;
+  h->cur_head = -1;
+
+  return (h);
+}
+
+
+/*
+ * Overlay images.  Tracks are read from a read-only base image unless
+ * they have been modified, in which case they come from a delta file.
+ * The delta file holds a header identifying the base, a directory with
+ * one slot number per track (zero if the track is unmodified), then the
+ * slots, each a whole track in image file format followed by its hash.
+ * A track keeps its slot when rewritten.
+ */
+
+#define OVERLAY_MAGIC "DMKOVL\0\1"
+#define OVERLAY_HEADER_LENGTH 48
+
+typedef struct
+{
+  int base_fd;
+  int delta_fd;
+  int heads;
+  int track_count;
+  int raw_length;      /* IDAM pointer table plus track data */
+  uint32_t *slot;      /* per track, 0 if unmodified */
+  uint32_t slot_count;
+} overlay_t;
+
+
+static long overlay_slot_offset (overlay_t *ovl, uint32_t slot)
+{
+  return (OVERLAY_HEADER_LENGTH + 4L * ovl->track_count +
+	  (slot - 1) * (ovl->raw_length + 8L));
+}
+
+
+static int overlay_read_track (void *arg,
+			       int cylinder,
+			       int head,
+			       uint8_t *idam_table,
+			       uint8_t *data,
+			       int track_length)
+{
+  overlay_t *ovl = arg;
+  int t = cylinder * ovl->heads + head;
+  uint8_t *raw;
+  int ok = 0;
+
+  raw = malloc (ovl->raw_length + 8);
+  if (! raw)
+    return (0);
+
+  if (ovl->slot [t])
+    {
+      if (((ovl->raw_length + 8) ==
+	   pread (ovl->delta_fd, raw, ovl->raw_length + 8,
+		  overlay_slot_offset (ovl, ovl->slot [t]))) &&
+	  (get_le64 (raw + ovl->raw_length) == dmk_hash (raw, ovl->raw_length)))
+	ok = 1;
+      else
+	fprintf (stderr, "overlay: bad delta track, cylinder %d head %d\n",
+		 cylinder, head);
+    }
+  else
+    ok = (ovl->raw_length ==
+	  pread (ovl->base_fd, raw, ovl->raw_length,
+		 DMK_HEADER_LENGTH + (long) t * ovl->raw_length));
+
+  if (ok)
+    {
+      memcpy (idam_table, raw, 2 * DMK_MAX_SECTOR);
+      memcpy (data, raw + 2 * DMK_MAX_SECTOR, track_length);
+    }
+  free (raw);
+  return (ok);
+}
+
+
+static int overlay_write_track (void *arg,
+				int cylinder,
+				int head,
+				uint8_t *idam_table,
+				uint8_t *data,
+				int track_length)
+{
+  overlay_t *ovl = arg;
+  int t = cylinder * ovl->heads + head;
+  uint32_t slot = ovl->slot [t];
+  uint8_t *raw;
+  uint8_t d [4];
+  int ok;
+
+  raw = malloc (ovl->raw_length + 8);
+  if (! raw)
+    return (0);
+  memcpy (raw, idam_table, 2 * DMK_MAX_SECTOR);
+  memcpy (raw + 2 * DMK_MAX_SECTOR, data, track_length);
+  put_le64 (raw + ovl->raw_length, dmk_hash (raw, ovl->raw_length));
+
+  /* the track must be on disk before the directory entry that points
+     to it, or a crash could leave the entry pointing at garbage */
+  if (! slot)
+    slot = ovl->slot_count + 1;
+  ok = ((ovl->raw_length + 8) ==
+	pwrite (ovl->delta_fd, raw, ovl->raw_length + 8,
+		overlay_slot_offset (ovl, slot)));
+  free (raw);
+  if (ok && ! ovl->slot [t])
+    {
+      put_le32 (d, slot);
+      ok = ((fdatasync (ovl->delta_fd) == 0) &&
+	    (4 == pwrite (ovl->delta_fd, d, 4,
+			  OVERLAY_HEADER_LENGTH + 4L * t)));
+      if (ok)
+	{
+	  ovl->slot [t] = slot;
+	  ovl->slot_count = slot;
+	}
+    }
+  if (! ok)
+    fprintf (stderr, "overlay: error writing delta file\n");
+  return (ok);
+}
+
+
+static void overlay_close (void *arg)
+{
+  overlay_t *ovl = arg;
+
+  if (ovl->delta_fd >= 0)
+    {
+      fsync (ovl->delta_fd);
+      close (ovl->delta_fd);
+    }
+  if (ovl->base_fd >= 0)
+    close (ovl->base_fd);
+  free (ovl->slot);
+  free (ovl);
+}
+
+
+static dmk_io_t overlay_io =
+{
+  overlay_read_track,
+  overlay_close,
+  overlay_write_track
+};
+
+
+/* the header identifies the base by its DMK header, size and mtime */
+static void overlay_header (uint8_t *hdr,
+			    uint8_t *dmk_header,
+			    struct stat *st,
+			    int track_count)
+{
+  memset (hdr, 0, OVERLAY_HEADER_LENGTH);
+  memcpy (hdr, OVERLAY_MAGIC, 8);
+  memcpy (hdr + 8, dmk_header, DMK_HEADER_LENGTH);
+  put_le64 (hdr + 24, st->st_size);
+  put_le64 (hdr + 32, st->st_mtim.tv_sec);
+  put_le32 (hdr + 40, st->st_mtim.tv_nsec);
+  put_le32 (hdr + 44, track_count);
+}
+
+
+dmk_handle dmk_open_overlay (char *base_fn,
+			     char *delta_fn,
+			     int *ds,
+			     int *cylinders,
+			     int *dd)
+{
+  overlay_t *ovl;
+  dmk_handle h;
+  struct stat st;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  uint8_t hdr [OVERLAY_HEADER_LENGTH];
+  uint8_t expected [OVERLAY_HEADER_LENGTH];
+  uint8_t *dir = NULL;
+  int i;
+
+  ovl = calloc (1, sizeof (overlay_t));
+  if (! ovl)
+    return (NULL);
+  ovl->delta_fd = -1;
+
+  ovl->base_fd = open (base_fn, O_RDONLY);
+  if ((ovl->base_fd < 0) ||
+      (0 > fstat (ovl->base_fd, & st)) ||
+      (DMK_HEADER_LENGTH != pread (ovl->base_fd, dmk_header,
+				   DMK_HEADER_LENGTH, 0)))
+    {
+      fprintf (stderr, "overlay: error reading base image\n");
+      goto fail;
+    }
+
+  ovl->heads = (dmk_header [4] & DMK_FLAG_SS_MASK) ? 1 : 2;
+  ovl->track_count = dmk_header [1] * ovl->heads;
+  ovl->raw_length = dmk_header [2] | (dmk_header [3] << 8);
+  ovl->slot = calloc (ovl->track_count ? ovl->track_count : 1, sizeof (uint32_t));
+  dir = malloc (4 * ovl->track_count + 1);
+  if ((! ovl->slot) || (! dir))
+    goto fail;
+  overlay_header (expected, dmk_header, & st, ovl->track_count);
+
+  ovl->delta_fd = open (delta_fn, O_RDWR | O_CREAT, 0666);
+  if (ovl->delta_fd < 0)
+    {
+      fprintf (stderr, "overlay: can't open delta file\n");
+      goto fail;
+    }
+  i = pread (ovl->delta_fd, hdr, OVERLAY_HEADER_LENGTH, 0);
+  if (i == 0)
+    {
+      /* new delta: header and an empty directory */
+      memset (dir, 0, 4 * ovl->track_count);
+      if ((OVERLAY_HEADER_LENGTH != pwrite (ovl->delta_fd, expected,
+					    OVERLAY_HEADER_LENGTH, 0)) ||
+	  ((4 * ovl->track_count) != pwrite (ovl->delta_fd, dir,
+					     4 * ovl->track_count,
+					     OVERLAY_HEADER_LENGTH)))
+	{
+	  fprintf (stderr, "overlay: error writing delta file\n");
+	  goto fail;
+	}
+    }
+  else if ((i != OVERLAY_HEADER_LENGTH) ||
+	   (memcmp (hdr, expected, OVERLAY_HEADER_LENGTH) != 0))
+    {
+      fprintf (stderr, "overlay: delta file doesn't belong to this base image\n");
+      goto fail;
+    }
+  else
+    {
+      if ((4 * ovl->track_count) != pread (ovl->delta_fd, dir,
+					   4 * ovl->track_count,
+					   OVERLAY_HEADER_LENGTH))
+	{
+	  fprintf (stderr, "overlay: error reading delta file\n");
+	  goto fail;
+	}
+      for (i = 0; i < ovl->track_count; i++)
+	{
+	  ovl->slot [i] = get_le32 (dir + 4 * i);
+	  if (ovl->slot [i] > ovl->slot_count)
+	    ovl->slot_count = ovl->slot [i];
+	}
+    }
+  free (dir);
+  dir = NULL;
+
+  h = dmk_open_io (& overlay_io, ovl, dmk_header, ds, cylinders, dd);
+  if (! h)
+    goto fail;
+  return (h);
+
+ fail:
+  free (dir);
+  overlay_close (ovl);
+  return (NULL);
+}
+
+
+int dmk_overlay_modified (dmk_handle h,
+			  int cylinder,
+			  int head)
+{
+  overlay_t *ovl = h->io_arg;
+
+  if ((h->io != & overlay_io) ||
+      (cylinder < 0) || (cylinder >= h->cylinders) ||
+      (head < 0) || (head > h->ds))
+    return (0);
+  return (ovl->slot [cylinder * ovl->heads + head] != 0);
+}
+
+
+dmk_handle dmk_create_image (char *fn,
+			     int ds,    /* boolean */
+			     int cylinders,
+			     int dd,    /* boolean */
+			     int rpm,   /* 300 or 360 RPM */
+			     int rate)  /* 125, 250, 300, or 500 Kbps */
+{
+  dmk_handle h;
+
+  h = calloc (1, sizeof (struct dmk_state));
+  if (! h)
+    goto fail;
+
+  h->f = fopen (fn, "wb");
+  if (! h->f)
+    goto fail;
+
+  h->fn = strdup (fn);
+  if (! h->fn)
+    goto fail;
+
+  h->new_image = 1;
+  h->writable = 1;
+
+  h->ds = ds;
+  h->cylinders = cylinders;
+  h->dd = dd;
+  h->rpm = rpm;
+  h->rate = rate;
+
+  if ((rpm == 360) && (rate == 500) && dd)
+    h->track_length = 0x2900;  /* 8-inch DD, defined in DMK spec
+				  (doesn't include IDAM pointers */
+  else if ((rpm == 360) && (rate == 250) && ! dd)
+    h->track_length = 0x14a0;  /* 8-inch SD, defined in DMK spec
+				  (doesn't include IDAM pointers */
+  else
+    {
+      h->track_length = (rate * 7500L) / rpm;
+      if (h->track_length > 0x2900)
+	fprintf (stderr, "warning: track length %d exceeds maximum DMK spec\n",
+		 h->track_length);
+    }
+  default_timing (h);
+
+  h->track = calloc (cylinders * (ds + 1), sizeof (track_state_t));
+  if (! h->track)
+    goto fail;
+
+  /* 
+   * Make sure the first seek will do the right thing, by setting
+   * the current position to a non-existent track
+   */
+  h->cur_cylinder = -1;
+  h->cur_head = -1;
+
+  return (h);
+
+ fail:
+  if (h)
+    free (h);
+  return (NULL);
+}
+
+
+static long track_file_offset (dmk_handle h, int cylinder, int head)
+{
+  return (DMK_HEADER_LENGTH + (((h->ds + 1) * cylinder + head) *
+			       ((2L * DMK_MAX_SECTOR) + h->track_length)));
+}
+
+
+int dmk_image_file_seek_track (dmk_handle h, int cylinder, int head)
+{
+  return (0 <= fseek (h->f, track_file_offset (h, cylinder, head), SEEK_SET));
+}
+
+
+/* encode the IDAM pointer table of a track in image file format */
+static void encode_idam_table (track_state_t *track,
+			       uint8_t *idam_table)
+{
+  int sector;
+  int idam_ptr;
+
+  for (sector = 0; sector < DMK_MAX_SECTOR; sector++)
+    {
+      idam_ptr = track->idam_pointer [sector];
+      if (idam_ptr)
+	{
+	  idam_ptr += 2 * DMK_MAX_SECTOR;
+	  /* mfm_sector holds the mode; RX02 images carry it in the header */
+	  if (track->mfm_sector [sector] == DMK_MFM)
+	    idam_ptr |= DMK_IDAM_POINTER_MFM_MASK;
+	}
+      put_le16 (& idam_table [2 * sector], idam_ptr);
+    }
+}
+
+
+/* header for a new image file */
+static void encode_header (dmk_handle h,
+			   uint8_t *dmk_header)
+{
+  memset (dmk_header, 0, DMK_HEADER_LENGTH);
+  dmk_header [0] = 0x00;  /* unprotected */
+  dmk_header [1] = h->cylinders;
+  dmk_header [2] = (h->track_length + 2 * DMK_MAX_SECTOR) & 0xff;
+  dmk_header [3] = (h->track_length + 2 * DMK_MAX_SECTOR) >> 8;
+  dmk_header [4] = 0x00;  /* flags */
+  if (! h->ds)
+    dmk_header [4] |= DMK_FLAG_SS_MASK;
+  if (h->rx02)
+    dmk_header [4] |= DMK_FLAG_RX02_MASK;
+  if (! h->dd)
+    dmk_header [4] |= DMK_FLAG_SD_MASK;
+}
+
+
+static void free_tracks (dmk_handle h)
+{
+  int i;
+
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
+    {
+      release_track_buf (& h->track [i]);
+      if (h->track [i].map)
+	free (h->track [i].map);
+      free (h->track [i].timing);
+    }
+  free (h->track);
+}
+
+
+int dmk_close_image (dmk_handle h)
+{
+  int cylinder, head;
+  track_state_t *track;
+  uint8_t idam_table [2 * DMK_MAX_SECTOR];
+
+  if (! h->writable)
+    goto done;
+
+  if (h->journal)
+    journal_stop (h);
+
+  if (h->new_image)
+    {
+      uint8_t dmk_header [DMK_HEADER_LENGTH];
+
+      encode_header (h, dmk_header);
+
+      /* note that we should still be positioned to the start of the file */
+      if (1 != fwrite (dmk_header, sizeof (dmk_header), 1, h->f))
+	{
+	  fprintf (stderr, "error writing DMK header\n");
+	  return (0);
+	}
+    }
+
+  for (cylinder = 0; cylinder < h->cylinders; cylinder++)
+    for (head = 0; head <= h->ds; head++)
+      {
+	track = & h->track [(h->ds + 1) * cylinder + head];
+
+	if (track_is_hole (h, track))
+	  continue;
+
+	if (track->buf && track->dirty && h->io)
+	  {
+	    encode_idam_table (track, idam_table);
+	    if (! h->io->write_track (h->io_arg, cylinder, head, idam_table,
+				      track->buf, h->track_length))
+	      return (0);
+	    track->dirty = 0;
+	  }
+	else if (track->buf && track->dirty)
+	  {
+	    if (! dmk_image_file_seek_track (h, cylinder, head))
+	      {
+		fprintf (stderr, "error seeking image file\n");
+		return (0);
+	      }
+	    /* write IDAM offsets */
+	    encode_idam_table (track, idam_table);
+	    if (1 != fwrite (idam_table, sizeof (idam_table), 1, h->f))
+	      {
+		fprintf (stderr, "error writing IDAM offsets to image file\n");
+		return (0);
+	      }
+
+	    /* write track data */
+	    if (1 != fwrite (track->buf, h->track_length, 1, h->f))
+	      {
+		if (ferror (h->f))
+		  fprintf (stderr, "error writing track data to image file\n");
+		else
+		  fprintf (stderr, "fwrite failed writing track data to image file\n");
+		return (0);
+	      }
+	    track->dirty = 0;
+	  }
+      }
+
+  if (h->new_image)
+    {
+      /* fill out any unwritten tracks at the end */
+      if ((0 != fflush (h->f)) ||
+	  (0 != ftruncate (fileno (h->f),
+			   track_file_offset (h, h->cylinders, 0))))
+	{
+	  fprintf (stderr, "error extending image file\n");
+	  return (0);
+	}
+    }
+
+  if (h->journal)
+    journal_close (h);
+
+ done:
+  if (h->watch)
+    watch_close (h);
+  if (h->merkle)
+    merkle_close (h);
+  free_tracks (h);
+  if (h->f)
+    fclose (h->f);
+  if (h->io && h->io->close)
+    h->io->close (h->io_arg);
+  free (h->fn);
+  free (h);
+  return (1);
+}
+
+
+/* decode the on-disk IDAM pointer table of a track */
+static int decode_idam_table (dmk_handle h,
+			      track_state_t *track,
+			      uint8_t *idam_table)
+{
+  int i;
+  uint16_t idam_ptr;
+
+  for (i = 0; i < DMK_MAX_SECTOR; i++)
+    {
+      idam_ptr = idam_table [2 * i + 1] << 8 | idam_table [2 * i];
+      if (idam_ptr == 0)
+	continue;
+      if (idam_ptr < (2 * DMK_MAX_SECTOR))
+	return (0);
+      idam_ptr -= 2 * DMK_MAX_SECTOR;
+      if (h->rx02)
+	{
+	  track->mfm_sector [i] = DMK_RX02;
+	}
+      else if (idam_ptr & DMK_IDAM_POINTER_MFM_MASK)
+	{
+	  track->mfm_sector [i] = DMK_MFM;
+	  idam_ptr &= ~ DMK_IDAM_POINTER_FLAGS_MASK;
+	}
+      else
+	track->mfm_sector [i] = DMK_FM;
+      track->idam_pointer [i] = idam_ptr;
+    }
+  return (1);
+}
+
+
+/* bring a track's data into memory */
+static int load_track (dmk_handle h,
+		       int cylinder,
+		       int head)
+{
+  track_state_t *track = & h->track [(h->ds + 1) * cylinder + head];
+  uint8_t idam_table [2 * DMK_MAX_SECTOR];
+
+  if (track->buf || h->ids_only)
+    return (1);
+
+  track->shared = alloc_shared_buf (h->track_length);
+  if (! track->shared)
+    return (0);
+  track->buf = track->shared->data;
+  if (h->new_image)
+    {
+      /* virgin image: fill the new track with FFs */
+      memset (track->buf, 0xff, h->track_length);
+    }
+  else if (h->io)
+    {
+      if (! h->io->read_track (h->io_arg, cylinder, head, idam_table,
+			       track->buf, h->track_length))
+	{
+	  fprintf (stderr, "error reading track\n");
+	  release_track_buf (track);
+	  return (0);
+	}
+      if ((! decode_idam_table (h, track, idam_table)) ||
+	  (! idam_table_valid (h, track)) ||
+	  ((! track->idam_pointer [0]) && ! track->no_ids))
+	recover_idam_table (h, track, cylinder, head);
+    }
+  else
+    {
+      /* existing image: read the track from the image file */
+      if (! dmk_image_file_seek_track (h, cylinder, head))
+	{
+	  fprintf (stderr, "error seeking image file\n");
+	  exit (2);
+	}
+      if (1 != fread (idam_table, sizeof (idam_table), 1, h->f))
+	{
+	  fprintf (stderr, "error reading image file\n");
+	  exit (2);
+	}
+      if (1 != fread (track->buf, h->track_length, 1, h->f))
+	{
+	  fprintf (stderr, "error reading image file\n");
+	  exit (2);
+	}
+      if ((! decode_idam_table (h, track, idam_table)) ||
+	  (! idam_table_valid (h, track)) ||
+	  ((! track->idam_pointer [0]) && ! track->no_ids))
+	recover_idam_table (h, track, cylinder, head);
+    }
+
+  /* blank and unformatted tracks can share one copy of their data */
+  if (classify_track (h, track) &&
+      (track->track_class != DMK_TRACK_USED))
+    share_track_buf (track, h->track_length);
+  return (1);
+}
+
+
+int dmk_seek (dmk_handle h,
+	      int cylinder,
+	      int head)
+{
+  if (cylinder > h->cylinders)
+    return (0);
+
+  if (head && ! h->ds)
+    return (0);
+
+  if ((cylinder == h->cur_cylinder) &&
+      (head == h->cur_head))
+    {
+      /* already there */
+      h->read_id_index = 0;
+      return (1);
+    }
+
+  if (! load_track (h, cylinder, head))
+    return (0);
+
+  h->cur_cylinder = cylinder;
+  h->cur_head = head;
+  h->cur_track = & h->track [(h->ds + 1) * cylinder + head];
+
+  h->read_id_index = 0;
+
+  return (1);
+}
+
+
+/*
+ * Snapshots.  A snapshot holds a reference to every track's buffer, so
+ * taking one costs a pointer per track; the track, if written later,
+ * gets a copy of its own.  Each track carries the clock value of its
+ * last modification, which lets a snapshot be saved as just the tracks
+ * that changed since an earlier one.
+ */
+
+#define SNAPSHOT_MAGIC "DMKSNAP\1"
+#define SNAPSHOT_HEADER_LENGTH 32
+
+typedef struct
+{
+  shared_buf_t *shared;
+  uint8_t idam_table [2 * DMK_MAX_SECTOR];
+  uint64_t version;
+  int dirty;  /* boolean, differed from the image file */
+} snapshot_track_t;
+
+struct dmk_snapshot
+{
+  uint64_t id;
+  uint64_t parent_id;  /* of the snapshot it was read on top of, or 0 */
+  int track_count;
+  int track_length;
+  snapshot_track_t *track;
+};
+
+
+void dmk_snapshot_free (dmk_snapshot_t snap)
+{
+  int i;
+
+  if (! snap)
+    return;
+  for (i = 0; i < snap->track_count; i++)
+    if (snap->track [i].shared)
+      put_shared_buf (snap->track [i].shared);
+  free (snap->track);
+  free (snap);
+}
+
+
+static dmk_snapshot_t alloc_snapshot (int track_count, int track_length)
+{
+  dmk_snapshot_t snap;
+
+  snap = calloc (1, sizeof (struct dmk_snapshot));
+  if (! snap)
+    return (NULL);
+  snap->track = calloc (track_count, sizeof (snapshot_track_t));
+  if (! snap->track)
+    {
+      free (snap);
+      return (NULL);
+    }
+  snap->track_count = track_count;
+  snap->track_length = track_length;
+  return (snap);
+}
+
+
+dmk_snapshot_t dmk_snapshot (dmk_handle h)
+{
+  dmk_snapshot_t snap;
+  track_state_t *track;
+  int cylinder, head;
+  int i;
+
+  if (h->ids_only)
+    {
+      fprintf (stderr, "can't snapshot a handle without track data\n");
+      return (NULL);
+    }
+
+  for (cylinder = 0; cylinder < h->cylinders; cylinder++)
+    for (head = 0; head <= h->ds; head++)
+      if (! load_track (h, cylinder, head))
+	return (NULL);
+
+  snap = alloc_snapshot (h->cylinders * (h->ds + 1), h->track_length);
+  if (! snap)
+    return (NULL);
+  for (i = 0; i < snap->track_count; i++)
+    {
+      track = & h->track [i];
+      snap->track [i].shared = ref_shared_buf (track->shared);
+      encode_idam_table (track, snap->track [i].idam_table);
+      snap->track [i].version = track->version;
+      snap->track [i].dirty = track->dirty;
+    }
+  snap->id = ++h->clock;
+  return (snap);
+}
+
+
+int dmk_restore (dmk_handle h,
+		 dmk_snapshot_t snap)
+{
+  track_state_t *track;
+  int changed;
+  int ok = 1;
+  int i;
+
+  if ((snap->track_count != h->cylinders * (h->ds + 1)) ||
+      (snap->track_length != h->track_length) ||
+      h->ids_only)
+    {
+      fprintf (stderr, "snapshot doesn't match image geometry\n");
+      return (0);
+    }
+
+  for (i = 0; i < snap->track_count; i++)
+    {
+      track = & h->track [i];
+      changed = track->shared != snap->track [i].shared;
+      if (changed)
+	{
+	  /* a different buffer may hold different contents */
+	  release_track_buf (track);
+	  track->shared = ref_shared_buf (snap->track [i].shared);
+	  track->buf = track->shared->data;
+	  invalidate_sector_map (track);
+	}
+      if ((! decode_idam_table (h, track, snap->track [i].idam_table)) ||
+	  (! idam_table_valid (h, track)))
+	recover_idam_table (h, track, i / (h->ds + 1), i % (h->ds + 1));
+      track->version = snap->track [i].version;
+      if (h->clock < track->version)
+	h->clock = track->version;
+
+      /* the image file may have been saved or updated from the journal
+	 since, so a track put back must be written again */
+      track->dirty = snap->track [i].dirty || changed;
+      if (changed && h->journal &&
+	  ! journal_written (h, journal_track (h, i / (h->ds + 1),
+					       i % (h->ds + 1))))
+	ok = 0;
+    }
+  if (h->clock < snap->id)
+    h->clock = snap->id;
+
+  h->read_id_index = 0;
+  return (ok);
+}
+
+
+int dmk_snapshot_write (dmk_snapshot_t snap,
+			dmk_snapshot_t parent,
+			char *fn)
+{
+  FILE *f;
+  uint8_t hdr [SNAPSHOT_HEADER_LENGTH];
+  uint8_t rec [16];
+  snapshot_track_t *t;
+  int i;
+
+  if (parent && ((parent->track_count != snap->track_count) ||
+		 (parent->track_length != snap->track_length)))
+    {
+      fprintf (stderr, "parent snapshot doesn't match image geometry\n");
+      return (0);
+    }
+
+  f = fopen (fn, "wb");
+  if (! f)
+    {
+      fprintf (stderr, "error opening snapshot file\n");
+      return (0);
+    }
+
+  memcpy (hdr, SNAPSHOT_MAGIC, 8);
+  put_le32 (& hdr [8], snap->track_count);
+  put_le32 (& hdr [12], snap->track_length);
+  put_le64 (& hdr [16], snap->id);
+  put_le64 (& hdr [24], parent ? parent->id : 0);
+  if (1 != fwrite (hdr, sizeof (hdr), 1, f))
+    goto fail;
+
+  /* each changed track: index, version, IDAM table, data, data hash */
+  for (i = 0; i < snap->track_count; i++)
+    {
+      t = & snap->track [i];
+      if (parent && (parent->track [i].version == t->version) &&
+	  (parent->track [i].dirty == t->dirty))
+	continue;
+      put_le32 (& rec [0], i | (t->dirty ? 0x80000000 : 0));
+      put_le64 (& rec [4], t->version);
+      if ((1 != fwrite (rec, 12, 1, f)) ||
+	  (1 != fwrite (t->idam_table, sizeof (t->idam_table), 1, f)) ||
+	  (1 != fwrite (t->shared->data, snap->track_length, 1, f)))
+	goto fail;
+      put_le64 (rec, dmk_hash (t->shared->data, snap->track_length));
+      if (1 != fwrite (rec, 8, 1, f))
+	goto fail;
+    }
+
+  if (0 != fclose (f))
+    {
+      fprintf (stderr, "error writing snapshot file\n");
+      return (0);
+    }
+  return (1);
+
+ fail:
+  fprintf (stderr, "error writing snapshot file\n");
+  fclose (f);
+  return (0);
+}
+
+
+dmk_snapshot_t dmk_snapshot_read (dmk_handle h,
+				  char *fn,
+				  dmk_snapshot_t parent)
+{
+  FILE *f;
+  dmk_snapshot_t snap = NULL;
+  uint8_t hdr [SNAPSHOT_HEADER_LENGTH];
+  uint8_t rec [12];
+  uint8_t hash [8];
+  snapshot_track_t *t;
+  uint64_t parent_id;
+  uint32_t index;
+  int i;
+
+  f = fopen (fn, "rb");
+  if (! f)
+    {
+      fprintf (stderr, "error opening snapshot file\n");
+      return (NULL);
+    }
+  if ((1 != fread (hdr, sizeof (hdr), 1, f)) ||
+      (memcmp (hdr, SNAPSHOT_MAGIC, 8) != 0))
+    {
+      fprintf (stderr, "not a snapshot file\n");
+      goto fail;
+    }
+  if ((get_le32 (& hdr [8]) != h->cylinders * (h->ds + 1)) ||
+      (get_le32 (& hdr [12]) != h->track_length))
+    {
+      fprintf (stderr, "snapshot doesn't match image geometry\n");
+      goto fail;
+    }
+  parent_id = get_le64 (& hdr [24]);
+  if (parent_id && ((! parent) || (parent->id != parent_id)))
+    {
+      fprintf (stderr, "snapshot requires its parent snapshot\n");
+      goto fail;
+    }
+
+  snap = alloc_snapshot (h->cylinders * (h->ds + 1), h->track_length);
+  if (! snap)
+    goto fail;
+  snap->id = get_le64 (& hdr [16]);
+  snap->parent_id = parent_id;
+  if (parent_id)
+    for (i = 0; i < snap->track_count; i++)
+      {
+	snap->track [i] = parent->track [i];
+	ref_shared_buf (snap->track [i].shared);
+      }
+
+  while (1 == fread (rec, sizeof (rec), 1, f))
+    {
+      index = get_le32 (rec);
+      i = index & 0x7fffffff;
+      if (i >= snap->track_count)
+	{
+	  fprintf (stderr, "corrupt snapshot file\n");
+	  goto fail;
+	}
+      t = & snap->track [i];
+      if (t->shared)
+	put_shared_buf (t->shared);
+      t->shared = alloc_shared_buf (snap->track_length);
+      if (! t->shared)
+	goto fail;
+      t->version = get_le64 (& rec [4]);
+      t->dirty = (index & 0x80000000) != 0;
+      if ((1 != fread (t->idam_table, sizeof (t->idam_table), 1, f)) ||
+	  (1 != fread (t->shared->data, snap->track_length, 1, f)) ||
+	  (1 != fread (hash, sizeof (hash), 1, f)) ||
+	  (get_le64 (hash) != dmk_hash (t->shared->data, snap->track_length)))
+	{
+	  fprintf (stderr, "corrupt snapshot file\n");
+	  goto fail;
+	}
+      if (h->clock < t->version)
+	h->clock = t->version;
+    }
+  if (ferror (f))
+    {
+      fprintf (stderr, "error reading snapshot file\n");
+      goto fail;
+    }
+
+  for (i = 0; i < snap->track_count; i++)
+    if (! snap->track [i].shared)
+      {
+	fprintf (stderr, "snapshot file is missing tracks\n");
+	goto fail;
+      }
+  if (h->clock < snap->id)
+    h->clock = snap->id;
+
+  fclose (f);
+  return (snap);
+
+ fail:
+  dmk_snapshot_free (snap);
+  fclose (f);
+  return (NULL);
+}
+
+
+/*
+ * Write journal.  Each sector write, format or restore is appended to
+ * the journal as a self-checking record, so it survives a crash without
+ * rewriting whole tracks of the image.  Records are collected in memory
+ * and a committer thread writes and syncs everything collected so far
+ * in one go while the next records accumulate.  Once the journal grows
+ * large, a compactor thread writes a snapshot of the modified tracks
+ * back into the image and advances the checkpoint recorded in the
+ * journal header, so that later opens replay only newer records.
+ */
+
+#define JOURNAL_EXT ".dmkjnl"
+#define JOURNAL_MAGIC "DMKJNL\0\1"
+#define JOURNAL_HEADER_LENGTH 24
+#define JOURNAL_RECORD_HEADER_LENGTH 16
+#define JOURNAL_COMPACT_SIZE (4L << 20)
+
+#define JOURNAL_SECTOR 1  /* sector ID and data, as for dmk_write_sector */
+#define JOURNAL_TRACK  2  /* IDAM table and track data */
+
+typedef struct journal
+{
+  int fd;
+  int flags;
+  pthread_mutex_t mutex;
+  pthread_cond_t work;     /* wakes the committer */
+  pthread_cond_t durable;  /* signalled after each commit */
+  pthread_t committer;
+
+  /* protected by mutex */
+  uint8_t *pending;        /* records not yet written */
+  size_t pending_length;
+  size_t pending_size;
+  uint8_t *spare;          /* the other buffer, while committing */
+  size_t spare_size;
+  uint64_t appended_lsn;   /* last record appended */
+  uint64_t durable_lsn;    /* last record synced to the journal */
+  uint64_t checkpoint_lsn; /* last record included in the image */
+  off_t end;               /* length of the journal file */
+  int committing;          /* boolean, a batch is being written */
+  int stop;                /* boolean */
+  int error;               /* boolean */
+
+  /* compaction, started and reaped by the handle's thread */
+  dmk_handle h;
+  pthread_t compactor;
+  int compacting;          /* boolean, compactor thread exists */
+  int compacted;           /* boolean, compactor thread has finished */
+  int compact_ok;          /* boolean */
+  dmk_snapshot_t snap;
+  uint64_t snap_lsn;
+} journal_t;
+
+
+static void *journal_committer (void *arg)
+{
+  journal_t *j = arg;
+  uint8_t *batch;
+  size_t length, size;
+  uint64_t lsn;
+  off_t offset;
+  int ok;
+
+  pthread_mutex_lock (& j->mutex);
+  for (;;)
+    {
+      while ((! j->stop) && (! j->pending_length))
+	pthread_cond_wait (& j->work, & j->mutex);
+      if (! j->pending_length)
+	break;
+
+      /* take everything appended so far as one batch */
+      batch = j->pending;
+      length = j->pending_length;
+      size = j->pending_size;
+      j->pending = j->spare;
+      j->pending_size = j->spare_size;
+      j->pending_length = 0;
+      j->spare = NULL;
+      lsn = j->appended_lsn;
+      offset = j->end;
+      j->end += length;
+      j->committing = 1;
+      pthread_mutex_unlock (& j->mutex);
+
+      ok = ((pwrite (j->fd, batch, length, offset) == (ssize_t) length) &&
+	    (fdatasync (j->fd) == 0));
+
+      pthread_mutex_lock (& j->mutex);
+      j->committing = 0;
+      j->spare = batch;
+      j->spare_size = size;
+      if (ok)
+	j->durable_lsn = lsn;
+      else
+	{
+	  fprintf (stderr, "error writing journal\n");
+	  j->error = 1;
+	}
+      pthread_cond_broadcast (& j->durable);
+    }
+  pthread_mutex_unlock (& j->mutex);
+  return (NULL);
+}
+
+
+static int journal_append (dmk_handle h,
+			   int type,
+			   int cylinder,
+			   int head,
+			   uint8_t *body,
+			   int body_length,
+			   uint8_t *data,
+			   int data_length)
+{
+  journal_t *j = h->journal;
+  size_t length = (JOURNAL_RECORD_HEADER_LENGTH + body_length + data_length +
+		   8);
+  uint8_t *rec;
+  uint64_t lsn;
+  int ok;
+
+  pthread_mutex_lock (& j->mutex);
+  if (j->error)
+    {
+      pthread_mutex_unlock (& j->mutex);
+      return (0);
+    }
+  if (j->pending_length + length > j->pending_size)
+    {
+      size_t size = 2 * (j->pending_length + length);
+      uint8_t *p = realloc (j->pending, size);
+      if (! p)
+	{
+	  pthread_mutex_unlock (& j->mutex);
+	  return (0);
+	}
+      j->pending = p;
+      j->pending_size = size;
+    }
+
+  lsn = ++j->appended_lsn;
+  rec = j->pending + j->pending_length;
+  put_le32 (& rec [0], length);
+  rec [4] = type;
+  rec [5] = cylinder;
+  rec [6] = head;
+  rec [7] = 0;
+  put_le64 (& rec [8], lsn);
+  memcpy (rec + JOURNAL_RECORD_HEADER_LENGTH, body, body_length);
+  memcpy (rec + JOURNAL_RECORD_HEADER_LENGTH + body_length, data,
+	  data_length);
+  put_le64 (rec + length - 8, dmk_hash (rec, length - 8));
+  j->pending_length += length;
+  pthread_cond_signal (& j->work);
+
+  if (j->flags & DMK_JOURNAL_SYNC)
+    while ((j->durable_lsn < lsn) && ! j->error)
+      pthread_cond_wait (& j->durable, & j->mutex);
+  ok = ! j->error;
+  pthread_mutex_unlock (& j->mutex);
+  return (ok);
+}
+
+
+static int journal_sector (dmk_handle h,
+			   sector_info_t *sector_info,
+			   uint8_t *data)
+{
+  uint8_t body [6];
+
+  body [0] = sector_info->cylinder;
+  body [1] = sector_info->head;
+  body [2] = sector_info->sector;
+  body [3] = sector_info->size_code;
+  body [4] = sector_info->mode;
+  body [5] = sector_info->data_mark;
+  return (journal_append (h, JOURNAL_SECTOR, h->cur_cylinder, h->cur_head,
+			  body, sizeof (body),
+			  data, dmk_sector_size (sector_info)));
+}
+
+
+static int journal_track (dmk_handle h,
+			  int cylinder,
+			  int head)
+{
+  track_state_t *track = & h->track [(h->ds + 1) * cylinder + head];
+  uint8_t idam_table [2 * DMK_MAX_SECTOR];
+
+  encode_idam_table (track, idam_table);
+  return (journal_append (h, JOURNAL_TRACK, cylinder, head,
+			  idam_table, sizeof (idam_table),
+			  track->buf, h->track_length));
+}
+
+
+static void journal_write_header (journal_t *j,
+				  dmk_handle h,
+				  uint8_t *hdr)
+{
+  memcpy (hdr, JOURNAL_MAGIC, 8);
+  put_le32 (& hdr [8], h->cylinders * (h->ds + 1));
+  put_le32 (& hdr [12], h->track_length);
+  put_le64 (& hdr [16], j->checkpoint_lsn);
+}
+
+
+static void *journal_compactor (void *arg)
+{
+  journal_t *j = arg;
+  dmk_handle h = j->h;
+  dmk_snapshot_t snap = j->snap;
+  uint8_t hdr [JOURNAL_HEADER_LENGTH];
+  int fd = fileno (h->f);
+  long offset;
+  int i;
+
+  /* write back the tracks that differ from the image file */
+  for (i = 0; i < snap->track_count; i++)
+    {
+      if (! snap->track [i].dirty)
+	continue;
+      offset = track_file_offset (h, i / (h->ds + 1), i % (h->ds + 1));
+      if ((pwrite (fd, snap->track [i].idam_table, 2 * DMK_MAX_SECTOR, offset) !=
+	   2 * DMK_MAX_SECTOR) ||
+	  (pwrite (fd, snap->track [i].shared->data, snap->track_length,
+		   offset + 2 * DMK_MAX_SECTOR) != snap->track_length))
+	goto fail;
+    }
+  if (fsync (fd) != 0)
+    goto fail;
+
+  /* the image now holds every record up to snap_lsn */
+  pthread_mutex_lock (& j->mutex);
+  j->checkpoint_lsn = j->snap_lsn;
+  journal_write_header (j, h, hdr);
+  if ((pwrite (j->fd, hdr, sizeof (hdr), 0) != sizeof (hdr)) ||
+      (fdatasync (j->fd) != 0))
+    {
+      pthread_mutex_unlock (& j->mutex);
+      goto fail;
+    }
+  if ((j->durable_lsn == j->checkpoint_lsn) &&
+      (j->appended_lsn == j->checkpoint_lsn) &&
+      (! j->committing) &&
+      (ftruncate (j->fd, JOURNAL_HEADER_LENGTH) == 0))
+    j->end = JOURNAL_HEADER_LENGTH;
+  j->compact_ok = 1;
+  __atomic_store_n (& j->compacted, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (& j->mutex);
+  return (NULL);
+
+ fail:
+  fprintf (stderr, "error compacting journal into image file\n");
+  j->compact_ok = 0;
+  __atomic_store_n (& j->compacted, 1, __ATOMIC_RELEASE);
+  return (NULL);
+}
+
+
+/* collect a finished compaction; if wait is true, wait for it to finish */
+static void journal_reap (dmk_handle h,
+			  int wait)
+{
+  journal_t *j = h->journal;
+  int i;
+
+  if ((! j->compacting) ||
+      ((! wait) && ! __atomic_load_n (& j->compacted, __ATOMIC_ACQUIRE)))
+    return;
+  pthread_join (j->compactor, NULL);
+  if (j->compact_ok)
+    {
+      for (i = 0; i < j->snap->track_count; i++)
+	{
+	  if (! j->snap->track [i].dirty)
+	    continue;
+	  if (h->track [i].version == j->snap->track [i].version)
+	    h->track [i].dirty = 0;
+	  if (h->watch)
+	    watch_written (h, i, j->snap->track [i].idam_table,
+			   j->snap->track [i].shared->data);
+	}
+      if (h->watch)
+	watch_sync (h);
+    }
+  dmk_snapshot_free (j->snap);
+  j->snap = NULL;
+  j->compacting = 0;
+  j->compacted = 0;
+}
+
+
+static int journal_compact (dmk_handle h)
+{
+  journal_t *j = h->journal;
+
+  journal_reap (h, 0);
+  if (j->compacting)
+    return (1);
+  j->snap = dmk_snapshot (h);
+  if (! j->snap)
+    return (0);
+  pthread_mutex_lock (& j->mutex);
+  j->snap_lsn = j->appended_lsn;
+  pthread_mutex_unlock (& j->mutex);
+  j->h = h;
+  if (pthread_create (& j->compactor, NULL, journal_compactor, j))
+    {
+      dmk_snapshot_free (j->snap);
+      j->snap = NULL;
+      return (0);
+    }
+  j->compacting = 1;
+  return (1);
+}
+
+
+/* after a write has been journaled, compact if the journal is large */
+static int journal_written (dmk_handle h,
+			    int ok)
+{
+  journal_t *j = h->journal;
+  off_t size;
+
+  if (! ok)
+    {
+      fprintf (stderr, "error appending to journal\n");
+      return (0);
+    }
+  journal_reap (h, 0);
+  pthread_mutex_lock (& j->mutex);
+  size = j->end + j->pending_length;
+  pthread_mutex_unlock (& j->mutex);
+  if ((size > JOURNAL_COMPACT_SIZE) && ! j->compacting)
+    journal_compact (h);
+  return (1);
+}
+
+
+/* apply one record to the in-memory tracks */
+static int journal_replay_record (dmk_handle h,
+				  uint8_t *rec,
+				  int length)
+{
+  track_state_t *track;
+  sector_info_t sector_info;
+  uint8_t *body = rec + JOURNAL_RECORD_HEADER_LENGTH;
+  int body_length = length - JOURNAL_RECORD_HEADER_LENGTH - 8;
+
+  if ((rec [5] >= h->cylinders) || (rec [6] > h->ds) ||
+      (! dmk_seek (h, rec [5], rec [6])))
+    return (0);
+
+  switch (rec [4])
+    {
+    case JOURNAL_SECTOR:
+      memset (& sector_info, 0, sizeof (sector_info));
+      sector_info.cylinder = body [0];
+      sector_info.head = body [1];
+      sector_info.sector = body [2];
+      sector_info.size_code = body [3];
+      sector_info.mode = body [4];
+      sector_info.data_mark = body [5];
+      if (body_length != 6 + dmk_sector_size (& sector_info))
+	return (0);
+      return (dmk_write_sector (h, & sector_info, body + 6));
+
+    case JOURNAL_TRACK:
+      if (body_length != 2 * DMK_MAX_SECTOR + h->track_length)
+	return (0);
+      track = h->cur_track;
+      if (! unshare_track_buf (track, h->track_length))
+	return (0);
+      memcpy (track->buf, body + 2 * DMK_MAX_SECTOR, h->track_length);
+      if ((! decode_idam_table (h, track, body)) ||
+	  (! idam_table_valid (h, track)))
+	recover_idam_table (h, track, rec [5], rec [6]);
+      invalidate_sector_map (track);
+      track->dirty = 1;
+      track->version = ++h->clock;
+      return (1);
+    }
+  return (0);
+}
+
+
+/* apply the records after the checkpoint, truncating any torn tail */
+static int journal_replay (dmk_handle h,
+			   journal_t *j)
+{
+  int max_length = (JOURNAL_RECORD_HEADER_LENGTH + 2 * DMK_MAX_SECTOR +
+		    h->track_length + 8);
+  uint8_t *rec;
+  uint32_t length;
+  uint64_t lsn;
+  off_t offset = JOURNAL_HEADER_LENGTH;
+  int count = 0;
+
+  rec = malloc (max_length);
+  if (! rec)
+    return (0);
+  j->appended_lsn = j->checkpoint_lsn;
+  while (pread (j->fd, rec, JOURNAL_RECORD_HEADER_LENGTH, offset) ==
+	 JOURNAL_RECORD_HEADER_LENGTH)
+    {
+      length = get_le32 (rec);
+      lsn = get_le64 (& rec [8]);
+      if ((length < JOURNAL_RECORD_HEADER_LENGTH + 8) ||
+	  (length > max_length) ||
+	  (pread (j->fd, rec, length, offset) != length) ||
+	  (get_le64 (rec + length - 8) != dmk_hash (rec, length - 8)) ||
+	  (lsn <= j->appended_lsn && lsn > j->checkpoint_lsn))
+	break;  /* torn or stale record */
+      if (lsn > j->checkpoint_lsn)
+	{
+	  if (! journal_replay_record (h, rec, length))
+	    {
+	      fprintf (stderr, "%s: can't replay journal record %llu\n",
+		       h->fn, (unsigned long long) lsn);
+	      free (rec);
+	      return (0);
+	    }
+	  j->appended_lsn = lsn;
+	  count++;
+	}
+      offset += length;
+    }
+  free (rec);
+
+  if (ftruncate (j->fd, offset) != 0)
+    return (0);
+  j->end = offset;
+  j->durable_lsn = j->appended_lsn;
+  if (count)
+    fprintf (stderr, "%s: replayed %d journaled writes\n", h->fn, count);
+  return (1);
+}
+
+
+int dmk_journal_open (dmk_handle h,
+		      char *fn,
+		      int flags)
+{
+  journal_t *j;
+  uint8_t hdr [JOURNAL_HEADER_LENGTH];
+  char *default_fn = NULL;
+  struct stat st;
+  int cylinder = h->cur_cylinder;
+  int head = h->cur_head;
+
+  if ((! h->writable) || (! h->f) || h->new_image || h->ids_only ||
+      h->journal)
+    {
+      fprintf (stderr, "journal needs an existing image opened for writing\n");
+      return (0);
+    }
+
+  if (! fn)
+    {
+      default_fn = sidecar_name (h->fn, JOURNAL_EXT);
+      if (! default_fn)
+	return (0);
+      fn = default_fn;
+    }
+
+  j = calloc (1, sizeof (journal_t));
+  if (! j)
+    goto fail;
+  j->flags = flags;
+  pthread_mutex_init (& j->mutex, NULL);
+  pthread_cond_init (& j->work, NULL);
+  pthread_cond_init (& j->durable, NULL);
+  j->fd = open (fn, O_RDWR | O_CREAT, 0666);
+  if ((j->fd < 0) || (fstat (j->fd, & st) != 0))
+    {
+      fprintf (stderr, "error opening journal %s\n", fn);
+      goto fail;
+    }
+
+  if (st.st_size < JOURNAL_HEADER_LENGTH)
+    {
+      /* new journal */
+      journal_write_header (j, h, hdr);
+      if ((pwrite (j->fd, hdr, sizeof (hdr), 0) != sizeof (hdr)) ||
+	  (ftruncate (j->fd, sizeof (hdr)) != 0) ||
+	  (fdatasync (j->fd) != 0))
+	{
+	  fprintf (stderr, "error writing journal %s\n", fn);
+	  goto fail;
+	}
+      j->end = sizeof (hdr);
+    }
+  else
+    {
+      if ((pread (j->fd, hdr, sizeof (hdr), 0) != sizeof (hdr)) ||
+	  (memcmp (hdr, JOURNAL_MAGIC, 8) != 0) ||
+	  (get_le32 (& hdr [8]) != h->cylinders * (h->ds + 1)) ||
+	  (get_le32 (& hdr [12]) != h->track_length))
+	{
+	  fprintf (stderr, "%s isn't a journal for this image\n", fn);
+	  goto fail;
+	}
+      j->checkpoint_lsn = get_le64 (& hdr [16]);
+      if (! journal_replay (h, j))
+	{
+	  fprintf (stderr, "error replaying journal %s\n", fn);
+	  goto fail;
+	}
+    }
+
+  /* go back where we were before replaying */
+  if (cylinder >= 0)
+    dmk_seek (h, cylinder, head);
+  else
+    h->cur_cylinder = h->cur_head = -1;
+
+  if (pthread_create (& j->committer, NULL, journal_committer, j))
+    goto fail;
+  h->journal = j;
+  free (default_fn);
+  return (1);
+
+ fail:
+  if (j)
+    {
+      if (j->fd >= 0)
+	close (j->fd);
+      free (j);
+    }
+  free (default_fn);
+  return (0);
+}
+
+
+int dmk_journal_sync (dmk_handle h)
+{
+  journal_t *j = h->journal;
+  int ok;
+
+  if (! j)
+    return (0);
+  pthread_mutex_lock (& j->mutex);
+  while ((j->durable_lsn < j->appended_lsn) && ! j->error)
+    pthread_cond_wait (& j->durable, & j->mutex);
+  ok = ! j->error;
+  pthread_mutex_unlock (& j->mutex);
+  return (ok);
+}
+
+
+int dmk_journal_checkpoint (dmk_handle h)
+{
+  if (! h->journal)
+    return (0);
+  return (journal_compact (h));
+}
+
+
+/* finish background work before the image is written at close */
+static void journal_stop (dmk_handle h)
+{
+  journal_t *j = h->journal;
+
+  journal_reap (h, 1);
+  pthread_mutex_lock (& j->mutex);
+  j->stop = 1;
+  pthread_cond_signal (& j->work);
+  pthread_mutex_unlock (& j->mutex);
+  pthread_join (j->committer, NULL);
+}
+
+
+/* the image file holds every write so far, so empty the journal */
+static void journal_empty (dmk_handle h)
+{
+  journal_t *j = h->journal;
+  uint8_t hdr [JOURNAL_HEADER_LENGTH];
+
+  if (! dmk_journal_sync (h))
+    return;
+  pthread_mutex_lock (& j->mutex);
+  j->checkpoint_lsn = j->appended_lsn;
+  journal_write_header (j, h, hdr);
+  if ((pwrite (j->fd, hdr, sizeof (hdr), 0) != sizeof (hdr)) ||
+      (ftruncate (j->fd, sizeof (hdr)) != 0) ||
+      (fdatasync (j->fd) != 0))
+    fprintf (stderr, "error emptying journal\n");
+  else
+    j->end = sizeof (hdr);
+  pthread_mutex_unlock (& j->mutex);
+}
+
+
+/*
+ * Once every dirty track has been written, the image holds every
+ * record, so the journal can be emptied.
+ */
+static void journal_close (dmk_handle h)
+{
+  journal_t *j = h->journal;
+
+  if ((fflush (h->f) == 0) && (fsync (fileno (h->f)) == 0))
+    journal_empty (h);
+  close (j->fd);
+  free (j->pending);
+  free (j->spare);
+  pthread_mutex_destroy (& j->mutex);
+  pthread_cond_destroy (& j->work);
+  pthread_cond_destroy (& j->durable);
+  free (j);
+  h->journal = NULL;
+}
+
+
+/*
+ * Copy a range of the old image file into the new one.  copy_file_range
+ * lets the kernel share the blocks (reflink) or at least copy them
+ * without a trip through user space; where it isn't supported, fall
+ * back to reading and writing.
+ */
+static int copy_range (int in,
+		       int out,
+		       off_t offset,
+		       off_t length)
+{
+  loff_t in_offset = offset;
+  loff_t out_offset = offset;
+  uint8_t buf [65536];
+  ssize_t n;
+
+  while (length > 0)
+    {
+      n = copy_file_range (in, & in_offset, out, & out_offset, length, 0);
+      if (n > 0)
+	{
+	  length -= n;
+	  continue;
+	}
+      if ((n == 0) ||
+	  ((errno != ENOSYS) && (errno != EXDEV) && (errno != EINVAL) &&
+	   (errno != EOPNOTSUPP)))
+	return (n == 0);  /* end of the old file, or a real error */
+      break;
+    }
+
+  while (length > 0)
+    {
+      n = pread (in, buf, (length < sizeof (buf)) ? length : sizeof (buf),
+		 in_offset);
+      if (n <= 0)
+	return (n == 0);
+      if (pwrite (out, buf, n, out_offset) != n)
+	return (0);
+      in_offset += n;
+      out_offset += n;
+      length -= n;
+    }
+  return (1);
+}
+
+
+/* make a rename in the directory holding fn durable */
+static int sync_directory (char *fn)
+{
+  char *dir = strdup (fn);
+  char *slash;
+  int fd, ok;
+
+  if (! dir)
+    return (0);
+  slash = strrchr (dir, '/');
+  if (slash == dir)
+    slash [1] = '\0';
+  else if (slash)
+    *slash = '\0';
+  else
+    strcpy (dir, ".");
+  fd = open (dir, O_RDONLY | O_DIRECTORY);
+  free (dir);
+  if (fd < 0)
+    return (0);
+  ok = (fsync (fd) == 0);
+  close (fd);
+  return (ok);
+}
+
+
+int dmk_save_image (dmk_handle h)
+{
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  uint8_t idam_table [2 * DMK_MAX_SECTOR];
+  char *temp_fn = NULL;
+  track_state_t *track;
+  struct stat st;
+  FILE *f;
+  off_t clean = 0;  /* start of the old file not yet copied */
+  long offset;
+  int in, out = -1;
+  int i;
+
+  if ((! h->writable) || (! h->f))
+    {
+      fprintf (stderr, "dmk_save_image: not a writable image file\n");
+      return (0);
+    }
+
+  /* the compactor writes to the old file */
+  if (h->journal)
+    journal_reap (h, 1);
+
+  in = fileno (h->f);
+  if ((fflush (h->f) != 0) || (fstat (in, & st) != 0))
+    goto fail;
+
+  temp_fn = malloc (strlen (h->fn) + sizeof (".XXXXXX"));
+  if (! temp_fn)
+    goto fail;
+  sprintf (temp_fn, "%s.XXXXXX", h->fn);
+  out = mkstemp (temp_fn);
+  if (out < 0)
+    {
+      free (temp_fn);
+      temp_fn = NULL;
+      goto fail;
+    }
+  if (fchmod (out, st.st_mode & 07777) != 0)
+    goto fail;
+
+  if (h->new_image)
+    {
+      encode_header (h, dmk_header);
+      if (pwrite (out, dmk_header, sizeof (dmk_header), 0) !=
+	  sizeof (dmk_header))
+	goto fail;
+    }
+
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
+    {
+      track = & h->track [i];
+      if (! (track->buf && track->dirty))
+	continue;
+      if (track_is_hole (h, track))
+	continue;
+
+      offset = track_file_offset (h, i / (h->ds + 1), i % (h->ds + 1));
+      if ((! h->new_image) && (! copy_range (in, out, clean, offset - clean)))
+	goto fail;
+      encode_idam_table (track, idam_table);
+      if ((pwrite (out, idam_table, sizeof (idam_table), offset) !=
+	   sizeof (idam_table)) ||
+	  (pwrite (out, track->buf, h->track_length,
+		   offset + sizeof (idam_table)) != h->track_length))
+	goto fail;
+      clean = offset + sizeof (idam_table) + h->track_length;
+    }
+
+  /* the rest of the old file, or for a new image its full length */
+  if (h->new_image)
+    {
+      if (ftruncate (out, track_file_offset (h, h->cylinders, 0)) != 0)
+	goto fail;
+    }
+  else if ((clean < st.st_size) &&
+	   (! copy_range (in, out, clean, st.st_size - clean)))
+    goto fail;
+
+  if ((fsync (out) != 0) || (close (out) != 0))
+    {
+      out = -1;
+      goto fail;
+    }
+  out = -1;
+  if (rename (temp_fn, h->fn) != 0)
+    goto fail;
+  free (temp_fn);
+  temp_fn = NULL;
+  if (! sync_directory (h->fn))
+    fprintf (stderr, "warning: can't sync directory of %s\n", h->fn);
+
+  /* carry on with the new file */
+  f = fopen (h->fn, "r+");
+  if (! f)
+    {
+      fprintf (stderr, "error reopening %s\n", h->fn);
+      return (0);
+    }
+  fclose (h->f);
+  h->f = f;
+  h->new_image = 0;
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
+    {
+      track = & h->track [i];
+      if (h->watch && track->buf && track->dirty)
+	{
+	  encode_idam_table (track, idam_table);
+	  watch_written (h, i, idam_table, track->buf);
+	}
+      track->dirty = 0;
+    }
+  if (h->watch)
+    watch_sync (h);
+
+  if (h->journal)
+    journal_empty (h);
+  return (1);
+
+ fail:
+  fprintf (stderr, "error saving %s\n", h->fn);
+  if (out >= 0)
+    close (out);
+  if (temp_fn)
+    {
+      unlink (temp_fn);
+      free (temp_fn);
+    }
+  return (0);
+}
+
+
+/*
+ * Read a whole track to rebuild its IDAM table and sector map, for
+ * metadata-only handles whose table can't be trusted.
+ */
+static int load_scanned_map (dmk_handle h,
+			     int cylinder,
+			     int head)
+{
+  track_state_t *track = & h->track [(h->ds + 1) * cylinder + head];
+  long pos = track_file_offset (h, cylinder, head) + 2 * DMK_MAX_SECTOR;
+  int ok;
+
+  invalidate_sector_map (track);
+  track->buf = malloc (h->track_length);
+  if (! track->buf)
+    return (0);
+  if (h->track_length != pread (fileno (h->f), track->buf, h->track_length, pos))
+    {
+      fprintf (stderr, "error reading image file\n");
+      free (track->buf);
+      track->buf = NULL;
+      return (0);
+    }
+  recover_idam_table (h, track, cylinder, head);
+  ok = build_sector_map (h, track);
+  free (track->buf);
+  track->buf = NULL;
+  return (ok);
+}
+
+
+/*
+ * Gather the IDAM pointer tables of all tracks, then the ID fields they
+ * point to, without reading the rest of the track data.  Tracks whose
+ * tables are broken are read in full and scanned, as are all tracks if
+ * every table is empty.
+ */
+static int load_id_maps (dmk_handle h)
+{
+  int fd = fileno (h->f);
+  int cylinder, head, i;
+  int id_count = 0;
+  long pos;
+  track_state_t *track;
+  uint8_t idam_table [2 * DMK_MAX_SECTOR];
+  uint8_t raw [14];
+
+  for (cylinder = 0; cylinder < h->cylinders; cylinder++)
+    for (head = 0; head <= h->ds; head++)
+      {
+	track = & h->track [(h->ds + 1) * cylinder + head];
+	pos = track_file_offset (h, cylinder, head);
+	if (sizeof (idam_table) != pread (fd, idam_table, sizeof (idam_table), pos))
+	  {
+	    fprintf (stderr, "error reading image file\n");
+	    return (0);
+	  }
+	if ((! decode_idam_table (h, track, idam_table)) ||
+	    ! idam_table_valid (h, track))
+	  {
+	    if (! load_scanned_map (h, cylinder, head))
+	      return (0);
+	    id_count += track->map_count;
+	    continue;
+	  }
+
+	for (i = 0; i < DMK_MAX_SECTOR; i++)
+	  if (! track->idam_pointer [i])
+	    break;
+	track->map_count = i;
+	track->map = calloc (i ? i : 1, sizeof (sector_map_t));
+	if (! track->map)
+	  return (0);
+
+	pos += sizeof (idam_table);
+	for (i = 0; i < track->map_count; i++)
+	  {
+	    int len = sizeof (raw);
+	    if (track->idam_pointer [i] + len > h->track_length)
+	      len = h->track_length - track->idam_pointer [i];
+	    memset (raw, 0, sizeof (raw));
+	    if (0 > pread (fd, raw, len, pos + track->idam_pointer [i]))
+	      {
+		fprintf (stderr, "error reading image file\n");
+		return (0);
+	      }
+	    decode_id_field (h, track->mfm_sector [i], raw, & track->map [i]);
+	    track->map [i].idam = track->idam_pointer [i];
+	    if (! track->map [i].id_status)
+	      break;  /* pointer isn't at an address mark */
+	  }
+	if (i < track->map_count)
+	  {
+	    if (! load_scanned_map (h, cylinder, head))
+	      return (0);
+	  }
+	id_count += track->map_count;
+      }
+
+  if (! id_count)
+    for (cylinder = 0; cylinder < h->cylinders; cylinder++)
+      for (head = 0; head <= h->ds; head++)
+	if (! load_scanned_map (h, cylinder, head))
+	  return (0);
+  return (1);
+}
+
+
+dmk_handle dmk_open_image_ids (char *fn,
+			       int *ds,
+			       int *cylinders,
+			       int *dd)
+{
+  dmk_handle h;
+
+  h = dmk_open_image (fn, 0, ds, cylinders, dd);
+  if (! h)
+    return (NULL);
+
+  h->ids_only = 1;
+  if ((! h->indexed) && ! load_id_maps (h))
+    {
+      dmk_close_image (h);
+      return (NULL);
+    }
+  return (h);
+}
+
+
+static int write_data_field (dmk_handle h,
+			     sector_info_t *sector_info,
+			     int single_value,  /* boolean */
+			     uint8_t *data,
+			     const uint16_t *crc)  /* NULL to compute it */
+{
+  track_format_t *fmt;
+  count_data_clock_t mark [2];
+
+  fmt = & track_format [sector_info->mode];
+
+  /* the mark byte is the last element with a nonzero count */
+  memcpy (mark, fmt->data_mark, sizeof (mark));
+  if ((sector_info->data_mark >= 0xf8) && (sector_info->data_mark <= 0xfb) &&
+      (sector_info->mode != DMK_M2FM))
+    mark [mark [1].count ? 1 : 0].data = sector_info->data_mark;
+
+  write_buf_count_data (h, & fmt->id_gap [1]);
+  init_crc (h);
+  write_buf_count_data_clock (h, & mark [0]);
+  write_buf_count_data_clock (h, & mark [1]);
+  if (single_value)
+    write_buf_const (h, si_sector_size (sector_info), *data);
+  else
+    write_buf       (h, si_sector_size (sector_info), data);
+  if (crc)
+    h->crc = *crc;
+  write_crc (h);
+  write_buf_count_data (h, & fmt->post_data_gap [0]);
+
+  return (1);
+}
+
+
+/* -1 - bad read, CRCs set
+ *  0 - bad read, CRCs not set
+ *  1 - good read, CRCs set
+ */
+static int read_data_field_with_crcs (dmk_handle h,
+			    sector_info_t *sector_info,
+			    uint8_t *data,
+			    uint16_t *actual_crc,
+			    uint16_t *computed_crc)
+{
+  int i;
+  uint8_t b;
+
+  for (i = 0; i < MAX_ID_GAP; i++)
+    {
+      b = read_buf_byte (h);
+      if ((b >= 0xf8) && (b <= 0xfd))
+	break;
+    }
+  if (i >= MAX_ID_GAP)
+    return (0);
+
+  /* temporarily flip current mode to MFM when processing RX02 data field */
+  if (sector_info->mode == DMK_RX02)
+    h->cur_mode = DMK_MFM;
+
+  init_crc (h);
+  if (sector_info->mode == DMK_MFM)
+    {
+      /* In MFM, the three A1 bytes are included in the CRC */
+      compute_crc (h, 0xa1);
+      compute_crc (h, 0xa1);
+      compute_crc (h, 0xa1);
+    }
+  compute_crc (h, b);  /* the data mark is included in the CRC */
+  sector_info->data_mark = b;
+  read_buf (h, si_sector_size (sector_info), data);
+  int ret = check_crc (h) ? 1 : -1;
+  if (actual_crc)   *actual_crc   = h->actual_crc;
+  if (computed_crc) *computed_crc = h->crc;
+
+  if (sector_info->mode == DMK_RX02)
+    h->cur_mode = DMK_RX02;
+
+  return (ret);
+}
+
+
+int dmk_write_index (dmk_handle h)
+{
+  char *name, *tmp_name = NULL;
+  FILE *f = NULL;
+  struct stat st;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  uint8_t *buf = NULL, *p;
+  long len;
+  int cylinder, head, i;
+  track_state_t *track;
+  sector_map_t *map;
+
+  if (h->new_image || h->ids_only || ! h->f)
+    return (0);
+
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
+    if (h->track [i].dirty)
+      {
+	fprintf (stderr, "dmk_write_index: image has unsaved changes\n");
+	return (0);
+      }
+
+  if ((0 > fstat (fileno (h->f), & st)) ||
+      (DMK_HEADER_LENGTH != pread (fileno (h->f), dmk_header,
+				   DMK_HEADER_LENGTH, 0)))
+    return (0);
+
+  len = INDEX_HEADER_LENGTH + 8;
+  for (cylinder = 0; cylinder < h->cylinders; cylinder++)
+    for (head = 0; head <= h->ds; head++)
+      {
+	if (! dmk_seek (h, cylinder, head))
+	  return (0);
+	if ((! h->cur_track->map) && ! build_sector_map (h, h->cur_track))
+	  return (0);
+	len += 1 + h->cur_track->map_count * INDEX_RECORD_LENGTH;
+      }
+
+  buf = malloc (len);
+  if (! buf)
+    return (0);
+  index_header (h, & st, dmk_header, buf);
+  p = & buf [INDEX_HEADER_LENGTH];
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
+    {
+      track = & h->track [i];
+      *(p++) = track->map_count;
+      for (map = track->map; map < track->map + track->map_count; map++)
+	{
+	  p [0] = map->cylinder;
+	  p [1] = map->head;
+	  p [2] = map->sector;
+	  p [3] = map->size_code;
+	  p [4] = map->mode;
+	  p [5] = map->id_status;
+	  p [6] = map->data_mark;
+	  p [7] = map->data_status;
+	  put_le16 (& p [8],  map->idam);
+	  put_le16 (& p [10], map->data);
+	  put_le16 (& p [12], map->id_actual_crc);
+	  put_le16 (& p [14], map->id_computed_crc);
+	  put_le16 (& p [16], map->data_actual_crc);
+	  put_le16 (& p [18], map->data_computed_crc);
+	  put_le64 (& p [20], map->hash);
+	  p += INDEX_RECORD_LENGTH;
+	}
+    }
+  put_le64 (p, dmk_hash (buf, len - 8));
+
+  /* write a temporary file and rename it, so readers never see a
+     partial index */
+  name = sidecar_name (h->fn, INDEX_EXT);
+  if (name)
+    tmp_name = sidecar_name (h->fn, INDEX_EXT ".tmp");
+  if ((! name) || (! tmp_name))
+    goto fail;
+  f = fopen (tmp_name, "wb");
+  if (! f)
+    goto fail;
+  if (1 != fwrite (buf, len, 1, f))
+    {
+      fclose (f);
+      remove (tmp_name);
+      goto fail;
+    }
+  if ((0 != fclose (f)) || (0 > rename (tmp_name, name)))
+    {
+      remove (tmp_name);
+      goto fail;
+    }
+
+  free (name);
+  free (tmp_name);
+  free (buf);
+  return (1);
 
-#if 0
-  /* could guess, but why bother */
-  h->rpm = rpm;
-  h->rate = rate;
-#endif
+ fail:
+  fprintf (stderr, "dmk_write_index: error writing index file\n");
+  if (name)
+    free (name);
+  if (tmp_name)
+    free (tmp_name);
+  free (buf);
+  return (0);
+}
 
-  h->track = calloc (h->cylinders * (h->ds + 1), sizeof (track_state_t));
-  if (! h->track)
-    goto fail;
 
-  /* 
-   * Make sure the first seek will do the right thing, by setting
-   * the current position to a non-existent track
-   */
-  h->cur_cylinder = -1;
-  h->cur_head = -1;
+/*
+ * Merkle tree over the tracks of an image.  Each leaf is the hash of a
+ * track in image file format, and each inner node the hash of its two
+ * children, so two images can be compared by descending only into the
+ * subtrees whose hashes differ.  A leaf is recomputed when its track's
+ * version changes, which every write_buf does, and the tree is saved
+ * in a sidecar file so that an unmodified image needn't be read again.
+ */
 
-  return (h);
+#define MERKLE_EXT ".dmktree"
+#define MERKLE_MAGIC "DMKTREE\1"
+#define MERKLE_HEADER_LENGTH 44
 
- fail:
-  if (h)
-    free (h);
-  return (NULL);
+typedef struct merkle
+{
+  int leaves;         /* one per track */
+  int size;           /* leaves rounded up to a power of two */
+  uint64_t *node;     /* node [1] is the root, leaf i is node [size + i] */
+  uint64_t *version;  /* track version each leaf was computed from */
+  uint8_t *valid;     /* boolean per leaf */
+} merkle_t;
+
+
+static uint64_t merkle_combine (uint64_t left,
+				uint64_t right)
+{
+  uint8_t buf [16];
+
+  put_le64 (& buf [0], left);
+  put_le64 (& buf [8], right);
+  return (dmk_hash (buf, sizeof (buf)));
 }
 
 
-dmk_handle dmk_create_image (char *fn,
-			     int ds,    /* boolean */
-			     int cylinders,
-			     int dd,    /* boolean */
-			     int rpm,   /* 300 or 360 RPM */
-			     int rate)  /* 125, 250, 300, or 500 Kbps */
+static void merkle_header (dmk_handle h,
+			   struct stat *st,
+			   uint8_t *dmk_header,
+			   uint8_t *buf)
 {
-  dmk_handle h;
+  memcpy (buf, MERKLE_MAGIC, 8);
+  put_le64 (& buf [8], st->st_size);
+  put_le64 (& buf [16], st->st_mtim.tv_sec);
+  put_le32 (& buf [24], st->st_mtim.tv_nsec);
+  put_le64 (& buf [28], dmk_hash (dmk_header, DMK_HEADER_LENGTH));
+  put_le32 (& buf [36], h->cylinders * (h->ds + 1));
+  put_le32 (& buf [40], h->track_length);
+}
 
-  h = calloc (1, sizeof (struct dmk_state));
-  if (! h)
-    goto fail;
 
-  h->f = fopen (fn, "wb");
-  if (! h->f)
-    goto fail;
+/* take leaves from the sidecar file, if it matches the image file */
+static void merkle_read (dmk_handle h)
+{
+  merkle_t *m = h->merkle;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  uint8_t expected [MERKLE_HEADER_LENGTH];
+  long len = MERKLE_HEADER_LENGTH + 8L * m->leaves + 8;
+  uint8_t *buf = NULL;
+  struct stat st;
+  char *name;
+  FILE *f;
+  int i;
 
-  h->new_image = 1;
-  h->writable = 1;
+  if (h->new_image || ! h->f)
+    return;
+  name = sidecar_name (h->fn, MERKLE_EXT);
+  if (! name)
+    return;
+  f = fopen (name, "rb");
+  free (name);
+  if (! f)
+    return;
+
+  buf = malloc (len);
+  if ((! buf) ||
+      (1 != fread (buf, len, 1, f)) ||
+      (0 > fstat (fileno (h->f), & st)) ||
+      (DMK_HEADER_LENGTH != pread (fileno (h->f), dmk_header,
+				   DMK_HEADER_LENGTH, 0)))
+    goto done;
+  merkle_header (h, & st, dmk_header, expected);
+  if ((memcmp (buf, expected, MERKLE_HEADER_LENGTH) != 0) ||
+      (dmk_hash (buf, len - 8) != get_le64 (& buf [len - 8])))
+    goto done;
 
-  h->ds = ds;
-  h->cylinders = cylinders;
-  h->dd = dd;
-  h->rpm = rpm;
-  h->rate = rate;
+  /* only tracks that still match the file */
+  for (i = 0; i < m->leaves; i++)
+    if ((! h->track [i].dirty) && (h->track [i].version == 0))
+      {
+	m->node [m->size + i] = get_le64 (& buf [MERKLE_HEADER_LENGTH + 8 * i]);
+	m->version [i] = 0;
+	m->valid [i] = 1;
+      }
 
-  if ((rpm == 360) && (rate == 500) && dd)
-    h->track_length = 0x2900;  /* 8-inch DD, defined in DMK spec
-				  (doesn't include IDAM pointers */
-  else if ((rpm == 360) && (rate == 250) && ! dd)
-    h->track_length = 0x14a0;  /* 8-inch SD, defined in DMK spec
-				  (doesn't include IDAM pointers */
-  else
-    {
-      h->track_length = (rate * 7500L) / rpm;
-      if (h->track_length > 0x2900)
-	fprintf (stderr, "warning: track length %d exceeds maximum DMK spec\n",
-		 h->track_length);
-    }
+ done:
+  free (buf);
+  fclose (f);
+}
 
-  h->track = calloc (cylinders * (ds + 1), sizeof (track_state_t));
-  if (! h->track)
-    goto fail;
 
-  /* 
-   * Make sure the first seek will do the right thing, by setting
-   * the current position to a non-existent track
-   */
-  h->cur_cylinder = -1;
-  h->cur_head = -1;
+static int merkle_write (dmk_handle h)
+{
+  merkle_t *m = h->merkle;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  long len = MERKLE_HEADER_LENGTH + 8L * m->leaves + 8;
+  uint8_t *buf;
+  struct stat st;
+  char *name, *tmp_name = NULL;
+  FILE *f;
+  int i;
 
-  return (h);
+  if ((0 != fflush (h->f)) ||
+      (0 > fstat (fileno (h->f), & st)) ||
+      (DMK_HEADER_LENGTH != pread (fileno (h->f), dmk_header,
+				   DMK_HEADER_LENGTH, 0)))
+    return (0);
+  buf = malloc (len);
+  if (! buf)
+    return (0);
+  merkle_header (h, & st, dmk_header, buf);
+  for (i = 0; i < m->leaves; i++)
+    put_le64 (& buf [MERKLE_HEADER_LENGTH + 8 * i], m->node [m->size + i]);
+  put_le64 (& buf [len - 8], dmk_hash (buf, len - 8));
+
+  name = sidecar_name (h->fn, MERKLE_EXT);
+  if (name)
+    tmp_name = sidecar_name (h->fn, MERKLE_EXT ".tmp");
+  if ((! name) || (! tmp_name))
+    goto fail;
+  f = fopen (tmp_name, "wb");
+  if (! f)
+    goto fail;
+  if (1 != fwrite (buf, len, 1, f))
+    {
+      fclose (f);
+      remove (tmp_name);
+      goto fail;
+    }
+  if ((0 != fclose (f)) || (0 > rename (tmp_name, name)))
+    {
+      remove (tmp_name);
+      goto fail;
+    }
+  free (name);
+  free (tmp_name);
+  free (buf);
+  return (1);
 
  fail:
-  if (h)
-    free (h);
-  return (NULL);
+  free (name);
+  free (tmp_name);
+  free (buf);
+  return (0);
 }
 
 
-int dmk_image_file_seek_track (dmk_handle h, int cylinder, int head)
+/*
+ * Hash of track i as it is, or will be once the image is closed.  The
+ * track is always hashed as dmk_read_track_raw would return it, with
+ * the IDAM table encoded from the loaded track rather than taken from
+ * the file, so that the leaf doesn't depend on whether it was loaded.
+ */
+static int merkle_leaf (dmk_handle h,
+			int i,
+			uint8_t *raw,
+			uint64_t *hash)
 {
-  int pos = DMK_HEADER_LENGTH + (((h->ds + 1) * cylinder + head) *
-				 ((2 * DMK_MAX_SECTOR) + h->track_length));
-  return (0 <= fseek (h->f, pos, SEEK_SET));
+  track_state_t *track = & h->track [i];
+  int cylinder = i / (h->ds + 1);
+  int head = i % (h->ds + 1);
+  int raw_length = 2 * DMK_MAX_SECTOR + h->track_length;
+
+  if (track_is_hole (h, track))
+    memset (raw, 0, raw_length);
+  else
+    {
+      if ((! load_track (h, cylinder, head)) || (! track->buf))
+	return (0);
+      encode_idam_table (track, raw);
+      memcpy (& raw [2 * DMK_MAX_SECTOR], track->buf, h->track_length);
+    }
+  *hash = dmk_hash (raw, raw_length);
+  return (1);
 }
 
 
-int dmk_close_image (dmk_handle h)
+static void merkle_free (dmk_handle h)
 {
-  int cylinder, head, sector;
-  track_state_t *track;
-  uint8_t b;
+  merkle_t *m = h->merkle;
+
+  if (! m)
+    return;
+  free (m->node);
+  free (m->version);
+  free (m->valid);
+  free (m);
+  h->merkle = NULL;
+}
 
-  if (! h->writable)
-    goto done;
 
-  if (h->new_image)
+/* recompute the leaves of modified tracks, and their paths to the root */
+static int merkle_update (dmk_handle h)
+{
+  merkle_t *m = h->merkle;
+  uint8_t *raw = NULL;
+  int i, n;
+
+  if (! m)
     {
-      uint8_t dmk_header [DMK_HEADER_LENGTH];
+      m = calloc (1, sizeof (merkle_t));
+      if (! m)
+	return (0);
+      m->leaves = h->cylinders * (h->ds + 1);
+      for (m->size = 1; m->size < m->leaves; m->size *= 2)
+	;
+      m->node = calloc (2 * m->size, sizeof (uint64_t));
+      m->version = calloc (m->leaves, sizeof (uint64_t));
+      m->valid = calloc (m->leaves, 1);
+      h->merkle = m;
+      if ((! m->node) || (! m->version) || (! m->valid))
+	{
+	  merkle_free (h);
+	  return (0);
+	}
+      merkle_read (h);
+      for (n = m->size - 1; n >= 1; n--)
+	m->node [n] = merkle_combine (m->node [2 * n], m->node [2 * n + 1]);
+    }
 
-      memset (dmk_header, 0, DMK_HEADER_LENGTH);
-      dmk_header [0] = 0x00;  /* unprotected */
-      dmk_header [1] = h->cylinders;
-      dmk_header [2] = (h->track_length + 2 * DMK_MAX_SECTOR) & 0xff;
-      dmk_header [3] = (h->track_length + 2 * DMK_MAX_SECTOR) >> 8;
-      dmk_header [4] = 0x00;  /* flags */
-      if (! h->ds)
-	dmk_header [4] |= DMK_FLAG_SS_MASK;
-      if (h->rx02)
-	dmk_header [4] |= DMK_FLAG_RX02_MASK;
-      if (! h->dd)
-	dmk_header [4] |= DMK_FLAG_SD_MASK;
-    
-      /* note that we should still be positioned to the start of the file */
-      if (1 != fwrite (dmk_header, sizeof (dmk_header), 1, h->f))
+  for (i = 0; i < m->leaves; i++)
+    {
+      if (m->valid [i] && (m->version [i] == h->track [i].version))
+	continue;
+      if ((! raw) && ! (raw = malloc (2 * DMK_MAX_SECTOR + h->track_length)))
+	return (0);
+      if (! merkle_leaf (h, i, raw, & m->node [m->size + i]))
 	{
-	  fprintf (stderr, "error writing DMK header\n");
+	  free (raw);
 	  return (0);
 	}
+      m->version [i] = h->track [i].version;
+      m->valid [i] = 1;
+      for (n = (m->size + i) / 2; n >= 1; n /= 2)
+	m->node [n] = merkle_combine (m->node [2 * n], m->node [2 * n + 1]);
     }
+  free (raw);
+  return (1);
+}
 
-  for (cylinder = 0; cylinder < h->cylinders; cylinder++)
-    for (head = 0; head <= h->ds; head++)
-      {
-	track = & h->track [(h->ds + 1) * cylinder + head];
 
-	if (track->buf && track->dirty)
-	  {
-	    if (! dmk_image_file_seek_track (h, cylinder, head))
-	      {
-		fprintf (stderr, "error seeking image file\n");
-		return (0);
-	      }
-	    /* write IDAM offsets */
-	    for (sector = 0; sector < DMK_MAX_SECTOR; sector++)
-	      {
-		int idam_ptr = track->idam_pointer [sector];
-		if (idam_ptr)
-		  {
-		    idam_ptr += 2 * DMK_MAX_SECTOR;
-		    if (track->mfm_sector [sector])
-		      idam_ptr |= DMK_IDAM_POINTER_MFM_MASK;
-		  }
-		b = idam_ptr & 0xff;
-		if (1 != fwrite (& b, 1, 1, h->f))
-		  {
-		    fprintf (stderr, "error writing IDAM offset low to image file\n");
-		    return (0);
-		  }
-		b = idam_ptr >> 8;
-		if (1 != fwrite (& b, 1, 1, h->f))
-		  {
-		    fprintf (stderr, "error writing IDAM offset high to image file\n");
-		    return (0);
-		  }
-	      }
+/* keep the saved tree in step with a writable image file, then free it */
+static void merkle_close (dmk_handle h)
+{
+  if (h->f && h->writable && merkle_update (h))
+    merkle_write (h);
+  merkle_free (h);
+}
 
-	    /* write track data */
-	    if (1 != fwrite (track->buf, h->track_length, 1, h->f))
-	      {
-		if (ferror (h->f))
-		  fprintf (stderr, "error writing track data to image file\n");
-		else
-		  fprintf (stderr, "fwrite failed writing track data to image file\n");
-		return (0);
-	      }
-	    track->dirty = 0;
-	  }
-	if (track->buf)
-	  free (track->buf);
-      }
 
- done:
-  fclose (h->f);
-  free (h);
+int dmk_merkle_root (dmk_handle h,
+		     uint64_t *root)
+{
+  if (! merkle_update (h))
+    return (0);
+  *root = h->merkle->node [1];
   return (1);
 }
 
 
-int dmk_seek (dmk_handle h,
-	      int cylinder,
-	      int head)
+static void merkle_diff_node (merkle_t *a,
+			      merkle_t *b,
+			      int n,
+			      int *tracks,
+			      int *count)
 {
-  track_state_t *new_track;
-  int i;
+  if (a->node [n] == b->node [n])
+    return;
+  if (n >= a->size)
+    {
+      if (n - a->size < a->leaves)
+	tracks [(*count)++] = n - a->size;
+      return;
+    }
+  merkle_diff_node (a, b, 2 * n, tracks, count);
+  merkle_diff_node (a, b, 2 * n + 1, tracks, count);
+}
 
-  if (cylinder > h->cylinders)
-    return (0);
 
-  if (head && ! h->ds)
-    return (0);
+int dmk_merkle_diff (dmk_handle a,
+		     dmk_handle b,
+		     int *tracks)
+{
+  int count = 0;
+
+  if ((a->cylinders != b->cylinders) || (a->ds != b->ds) ||
+      (a->track_length != b->track_length))
+    return (-1);
+  if ((! merkle_update (a)) || ! merkle_update (b))
+    return (-1);
+  merkle_diff_node (a->merkle, b->merkle, 1, tracks, & count);
+  return (count);
+}
+
+
+/*
+ * Watch mode.  Other programs may rewrite an image, in place or by
+ * renaming a new file over it, while a long-lived handle has it open.
+ * The directory holding the image is watched with inotify, and when
+ * the image changes each track's hash on disk is compared with the one
+ * last seen, so that only tracks that really changed are dropped from
+ * memory and read again.
+ */
+
+typedef struct watch
+{
+  int fd;               /* inotify instance */
+  char *name;           /* of the image within its directory */
+  uint64_t *disk_hash;  /* per track, as last seen in the file */
+  struct stat st;       /* of the file, as last seen */
+} watch_t;
+
+
+static uint64_t track_disk_hash (dmk_handle h,
+				 uint8_t *idam_table,
+				 uint8_t *data)
+{
+  return (merkle_combine (dmk_hash (idam_table, 2 * DMK_MAX_SECTOR),
+			  dmk_hash (data, h->track_length)));
+}
 
-  if ((cylinder == h->cur_cylinder) &&
-      (head == h->cur_head))
-    {
-      /* already there */
-      h->read_id_index = 0;
-      return (1);
-    }
 
-  new_track = & h->track [(h->ds + 1) * cylinder + head];
+/* hash every track of the image file */
+static int watch_scan (dmk_handle h,
+		       uint64_t *disk_hash)
+{
+  int raw_length = 2 * DMK_MAX_SECTOR + h->track_length;
+  uint8_t *raw;
+  int i;
 
-  if (! new_track->buf)
+  raw = malloc (raw_length);
+  if (! raw)
+    return (0);
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
     {
-      new_track->buf = calloc (1, h->track_length);
-      if (! new_track->buf)
-	return (0);
-      if (h->new_image)
-	{
-	  /* virgin image: fill the new track with FFs */
-	  for (i = 0; i < h->track_length; i++)
-	    new_track->buf [i] = 0xff;
-	}
-      else
+      if (raw_length != pread (fileno (h->f), raw, raw_length,
+			       track_file_offset (h, i / (h->ds + 1),
+						  i % (h->ds + 1))))
 	{
-	  /* existing image: read the track from the image file */
-	  if (! dmk_image_file_seek_track (h, cylinder, head))
-	    {
-	      fprintf (stderr, "error seeking image file\n");
-	      exit (2);
-	    }
-	  for (i = 0; i < DMK_MAX_SECTOR; i++)
-	    {
-	      uint8_t d [2];
-	      uint16_t idam_ptr;
-	      if (1 != fread (d, 2, 1, h->f))
-		{
-		  fprintf (stderr, "error reading image file\n");
-		  exit (2);
-		}
-	      idam_ptr = d [1] << 8 | d [0];
-	      if (idam_ptr == 0)
-		continue;
-	      if (idam_ptr < (2 * DMK_MAX_SECTOR))
-		{
-		  fprintf (stderr, "IDAM pointer out of range\n");
-		  exit (2);
-		}
-	      idam_ptr -= 2 * DMK_MAX_SECTOR;
-	      if (h->rx02)
-		{
-		  new_track->mfm_sector [i] = DMK_RX02;
-		}
-	      else if (idam_ptr & DMK_IDAM_POINTER_MFM_MASK)
-		{
-		  new_track->mfm_sector [i] = DMK_MFM;
-		  idam_ptr &= ~ DMK_IDAM_POINTER_FLAGS_MASK;
-		}
-	      else
-		new_track->mfm_sector [i] = DMK_FM;
-	      new_track->idam_pointer [i] = idam_ptr;
-	    }
-	  if (1 != fread (new_track->buf, h->track_length, 1, h->f))
-	    {
-	      fprintf (stderr, "error reading image file\n");
-	      exit (2);
-	    }
+	  free (raw);
+	  return (0);
 	}
+      disk_hash [i] = track_disk_hash (h, raw, & raw [2 * DMK_MAX_SECTOR]);
     }
+  free (raw);
+  return (1);
+}
 
-  h->cur_cylinder = cylinder;
-  h->cur_head = head;
-  h->cur_track = new_track;
 
-  h->read_id_index = 0;
+/* this handle has written a track to the image file itself */
+static void watch_written (dmk_handle h,
+			   int i,
+			   uint8_t *idam_table,
+			   uint8_t *data)
+{
+  h->watch->disk_hash [i] = track_disk_hash (h, idam_table, data);
+}
 
-  return (1);
+
+/* this handle has finished writing to the image file */
+static void watch_sync (dmk_handle h)
+{
+  fstat (fileno (h->f), & h->watch->st);
 }
 
 
-static int write_data_field (dmk_handle h,
-			     sector_info_t *sector_info,
-			     int single_value,  /* boolean */
-			     uint8_t *data)
+static void watch_close (dmk_handle h)
 {
-  track_format_t *fmt;
+  close (h->watch->fd);
+  free (h->watch->name);
+  free (h->watch->disk_hash);
+  free (h->watch);
+  h->watch = NULL;
+}
 
-  fmt = & track_format [sector_info->mode];
 
-  write_buf_count_data (h, & fmt->id_gap [1]);
-  init_crc (h);
-  write_buf_count_data_clock (h, & fmt->data_mark [0]);
-  write_buf_count_data_clock (h, & fmt->data_mark [1]);
-  if (single_value)
-    write_buf_const (h, si_sector_size (sector_info), *data);
+int dmk_watch (dmk_handle h)
+{
+  watch_t *w;
+  char *dir, *slash;
+
+  if ((! h->f) || h->new_image)
+    {
+      fprintf (stderr, "dmk_watch: not an existing image file\n");
+      return (0);
+    }
+  if (h->watch)
+    return (1);
+
+  w = calloc (1, sizeof (watch_t));
+  if (! w)
+    return (0);
+  w->fd = -1;
+  dir = strdup (h->fn);
+  w->disk_hash = calloc (h->cylinders * (h->ds + 1), sizeof (uint64_t));
+  if ((! dir) || (! w->disk_hash))
+    goto fail;
+
+  slash = strrchr (dir, '/');
+  w->name = strdup (slash ? slash + 1 : dir);
+  if (! w->name)
+    goto fail;
+  if (slash == dir)
+    slash [1] = '\0';
+  else if (slash)
+    *slash = '\0';
   else
-    write_buf       (h, si_sector_size (sector_info), data);
-  write_crc (h);
-  write_buf_count_data (h, & fmt->post_data_gap [0]);
+    strcpy (dir, ".");
+
+  /* the directory, to see new files renamed over the image too */
+  w->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if ((w->fd < 0) ||
+      (inotify_add_watch (w->fd, dir, (IN_MODIFY | IN_CLOSE_WRITE |
+				       IN_MOVED_TO | IN_CREATE)) < 0))
+    {
+      fprintf (stderr, "dmk_watch: can't watch %s\n", dir);
+      goto fail;
+    }
+  if ((fflush (h->f) != 0) || (fstat (fileno (h->f), & w->st) != 0) ||
+      (! watch_scan (h, w->disk_hash)))
+    goto fail;
 
+  free (dir);
+  h->watch = w;
   return (1);
+
+ fail:
+  if (w->fd >= 0)
+    close (w->fd);
+  free (w->name);
+  free (w->disk_hash);
+  free (w);
+  free (dir);
+  return (0);
 }
 
 
-#define MAX_ID_GAP 50  /* shouldn't ever be more than 17 for FM, 34 for MFM */
+int dmk_watch_fd (dmk_handle h)
+{
+  return (h->watch ? h->watch->fd : -1);
+}
 
-/* -1 - bad read, CRCs set
- *  0 - bad read, CRCs not set
- *  1 - good read, CRCs set
- */
-static int read_data_field_with_crcs (dmk_handle h,
-			    sector_info_t *sector_info,
-			    uint8_t *data,
-			    uint16_t *actual_crc,
-			    uint16_t *computed_crc)
+
+uint64_t dmk_generation (dmk_handle h)
 {
+  return (h->generation);
+}
+
+
+/* the image file has changed, drop the tracks that differ */
+static int watch_reload (dmk_handle h)
+{
+  watch_t *w = h->watch;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  uint64_t *disk_hash = NULL;
+  struct dmk_state image;
+  struct stat st;
+  track_state_t *track;
+  FILE *f;
+  int count = 0;
   int i;
-  uint8_t b;
 
-  for (i = 0; i < MAX_ID_GAP; i++)
+  /* don't mistake our own compaction for someone else's changes */
+  if (h->journal)
+    journal_reap (h, 1);
+
+  if (stat (h->fn, & st) != 0)
+    return (0);  /* gone for now, maybe being replaced */
+  if ((st.st_ino == w->st.st_ino) && (st.st_dev == w->st.st_dev) &&
+      (st.st_size == w->st.st_size) &&
+      (st.st_mtim.tv_sec == w->st.st_mtim.tv_sec) &&
+      (st.st_mtim.tv_nsec == w->st.st_mtim.tv_nsec))
+    return (0);
+
+  if ((st.st_ino != w->st.st_ino) || (st.st_dev != w->st.st_dev))
     {
-      b = read_buf_byte (h);
-      if ((b >= 0xf8) && (b <= 0xfd))
-	break;
+      /* a new file was renamed over the image */
+      f = fopen (h->fn, h->writable ? "r+" : "rb");
+      if (! f)
+	return (0);
+      fclose (h->f);
+      h->f = f;
+    }
+  else if (fflush (h->f) != 0)
+    return (-1);
+
+  if (DMK_HEADER_LENGTH != pread (fileno (h->f), dmk_header,
+				  DMK_HEADER_LENGTH, 0))
+    return (-1);
+  memset (& image, 0, sizeof (image));
+  parse_header (& image, dmk_header);
+  if ((image.cylinders != h->cylinders) || (image.ds != h->ds) ||
+      (image.dd != h->dd) || (image.track_length != h->track_length))
+    {
+      fprintf (stderr, "%s: image geometry changed, reopen it\n", h->fn);
+      return (-1);
     }
-  if (i >= MAX_ID_GAP)
-    return (0);
 
-  /* temporarily flip current mode to MFM when processing RX02 data field */
-  if (sector_info->mode == DMK_RX02)
-    h->cur_mode = DMK_MFM;
+  disk_hash = malloc (h->cylinders * (h->ds + 1) * sizeof (uint64_t));
+  if ((! disk_hash) || (fstat (fileno (h->f), & w->st) != 0) ||
+      (! watch_scan (h, disk_hash)))
+    {
+      free (disk_hash);
+      return (-1);
+    }
 
-  init_crc (h);
-  if (sector_info->mode == DMK_MFM)
+  for (i = 0; i < h->cylinders * (h->ds + 1); i++)
     {
-      /* In MFM, the three A1 bytes are included in the CRC */
-      compute_crc (h, 0xa1);
-      compute_crc (h, 0xa1);
-      compute_crc (h, 0xa1);
+      if (disk_hash [i] == w->disk_hash [i])
+	continue;
+      w->disk_hash [i] = disk_hash [i];
+      track = & h->track [i];
+      if (track->dirty)
+	{
+	  fprintf (stderr, "%s: cylinder %d head %d changed on disk and in "
+		   "memory, keeping the modified track\n",
+		   h->fn, i / (h->ds + 1), i % (h->ds + 1));
+	  continue;
+	}
+      release_track_buf (track);
+      invalidate_sector_map (track);
+      track->version = ++h->clock;
+      if (h->ids_only)
+	load_scanned_map (h, i / (h->ds + 1), i % (h->ds + 1));
+      count++;
     }
-  compute_crc (h, b);  /* the data mark is included in the CRC */
-  read_buf (h, si_sector_size (sector_info), data);
-  int ret = check_crc (h) ? 1 : -1;
-  if (actual_crc)   *actual_crc   = h->actual_crc;
-  if (computed_crc) *computed_crc = h->crc;
+  free (disk_hash);
 
-  if (sector_info->mode == DMK_RX02)
-    h->cur_mode = DMK_RX02;
+  if (count)
+    {
+      h->generation++;
+      h->read_id_index = 0;
+      /* the current track must stay readable */
+      if ((h->cur_cylinder >= 0) &&
+	  ! load_track (h, h->cur_cylinder, h->cur_head))
+	return (-1);
+    }
+  return (count);
+}
 
-  return (ret);
+
+int dmk_watch_check (dmk_handle h)
+{
+  char events [4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  struct inotify_event *ev;
+  ssize_t len;
+  char *p;
+  int seen = 0;
+
+  if (! h->watch)
+    return (-1);
+
+  /* drain every pending event, then reload once */
+  while ((len = read (h->watch->fd, events, sizeof (events))) > 0)
+    for (p = events; p < events + len; p += sizeof (*ev) + ev->len)
+      {
+	ev = (struct inotify_event *) p;
+	if (ev->len && (strcmp (ev->name, h->watch->name) == 0))
+	  seen = 1;
+      }
+  if ((len < 0) && (errno != EAGAIN))
+    return (-1);
+  if (! seen)
+    return (0);
+  return (watch_reload (h));
 }
 
 
@@ -906,7 +4239,7 @@ int dmk_format_track (dmk_handle h,
 #if 0
       fprintf (stderr, "sector %d IDAM pointer %d\n", sector, h->p);
 #endif
-      h->cur_track->mfm_sector [sector] = (mode == DMK_MFM);
+      h->cur_track->mfm_sector [sector] = mode;
 
       write_buf_count_data_clock (h, & fmt->id_address_mark [1]);
 #if (DEBUG_CRC >= 2)
@@ -945,7 +4278,7 @@ int dmk_format_track (dmk_handle h,
 	  write_buf_count_data (h, & fmt->id_gap [1]);
 	  
 	  if (! write_data_field (h, & sector_info [sector], 1,
-				  & sector_info [sector].data_value))
+				  & sector_info [sector].data_value, NULL))
 	    {
 	      return (0);
 	    }
@@ -970,6 +4303,9 @@ int dmk_format_track (dmk_handle h,
     gap4_len /= 2;
   write_buf_const (h, gap4_len, fmt->gap_4_data);
 
+  if (h->journal)
+    return (journal_written (h, journal_track (h, h->cur_cylinder,
+					       h->cur_head)));
   return (1);
 }
 
@@ -992,6 +4328,12 @@ static int find_address_mark (dmk_handle h,
       return (0);
     }
 
+  if (h->ids_only)
+    {
+      fprintf (stderr, "find_address_mark: no track data in metadata-only image\n");
+      return (0);
+    }
+
   for (i = 0; i < DMK_MAX_SECTOR; i++)
     {
       h->p = h->cur_track->idam_pointer [i];
@@ -1067,6 +4409,27 @@ int dmk_read_id_with_crcs (dmk_handle h,
   if (h->read_id_index >= DMK_MAX_SECTOR)
     return (0);
 
+  if ((! h->cur_track->map) && h->cur_track->buf)
+    build_sector_map (h, h->cur_track);  /* on failure, parse directly */
+
+  if (h->cur_track->map)
+    {
+      sector_map_t *map;
+
+      if (h->read_id_index >= h->cur_track->map_count)
+	return (0);
+      map = & h->cur_track->map [h->read_id_index++];
+      sector_info->cylinder  = map->cylinder;
+      sector_info->head      = map->head;
+      sector_info->sector    = map->sector;
+      sector_info->size_code = map->size_code;
+      sector_info->mode      = map->mode;
+      sector_info->data_mark = map->data_mark;
+      if (actual_crc)   *actual_crc   = map->id_actual_crc;
+      if (computed_crc) *computed_crc = map->id_computed_crc;
+      return (map->id_status);
+    }
+
   h->cur_mode = h->cur_track->mfm_sector [h->read_id_index];
   h->p = h->cur_track->idam_pointer [h->read_id_index++];
 
@@ -1102,6 +4465,7 @@ int dmk_read_id_with_crcs (dmk_handle h,
   sector_info->sector    = read_buf_byte (h);
   sector_info->size_code = read_buf_byte (h);
   sector_info->mode      = h->cur_mode;
+  sector_info->data_mark = 0;
 
   int ret = 1;
 
@@ -1139,6 +4503,31 @@ int dmk_read_sector_with_crcs (dmk_handle h,
 		     uint16_t *actual_crc,
 		     uint16_t *computed_crc)
 {
+  sector_map_t *map;
+
+  if ((h->cur_cylinder >= 0) && (! h->cur_track->map) && h->cur_track->buf)
+    build_sector_map (h, h->cur_track);  /* on failure, parse directly */
+
+  if ((h->cur_cylinder >= 0) && h->cur_track->map && ! h->ids_only)
+    {
+      /* track already decoded, no need to parse it again */
+      map = find_sector_map (h->cur_track, sector_info);
+      if (! map)
+	{
+	  fprintf (stderr, "dmk_read_sector_with_crcs: no ID in the sector map matches\n");
+	  return (0);
+	}
+      if (! map->data_status)
+	return (0);
+      sector_info->data_mark = map->data_mark;
+      copy_track_data (h->cur_track, map->data,
+		       (map->mode == DMK_RX02) ? 1 : byte_step (h, map->mode),
+		       si_sector_size (sector_info), data);
+      if (actual_crc)   *actual_crc   = map->data_actual_crc;
+      if (computed_crc) *computed_crc = map->data_computed_crc;
+      return (map->data_status);
+    }
+
   /* find address mark */
   if (! find_address_mark (h, sector_info))
     return (0);
@@ -1157,14 +4546,28 @@ int dmk_read_sector (dmk_handle h,
 }
 
 
-int dmk_write_sector (dmk_handle h,
-		      sector_info_t *sector_info,
-		      uint8_t *data)
+static int write_sector (dmk_handle h,
+			 sector_info_t *sector_info,
+			 uint8_t *data,
+			 const uint16_t *crc)
 {
   int count;
+  sector_map_t *map = NULL;
 
-  /* find address mark */
-  if (! find_address_mark (h, sector_info))
+  /* find address mark, from the decoded track if possible */
+  if ((h->cur_cylinder >= 0) && h->cur_track->buf)
+    {
+      if (! h->cur_track->map)
+	build_sector_map (h, h->cur_track);
+      if (h->cur_track->map)
+	map = find_sector_map (h->cur_track, sector_info);
+    }
+  if (map)
+    {
+      h->cur_mode = sector_info->mode;
+      h->p = map->idam + 7 * byte_step (h, map->mode);
+    }
+  else if (! find_address_mark (h, sector_info))
     {
       fprintf (stderr, "dmk_write_sector: can't find address mark\n");
       return (0);
@@ -1176,16 +4579,440 @@ int dmk_write_sector (dmk_handle h,
     count *= 2;
   advance_p (h, count);
   
-  if (! write_data_field (h, sector_info, 0, data))
+  if (! write_data_field (h, sector_info, 0, data, crc))
     {
       fprintf (stderr, "dmk_write_sector: can't write data field\n");
       return (0);
     }
 
+  /* replaying a sector write would recompute the CRC */
+  if (h->journal)
+    return (journal_written (h, crc ?
+			     journal_track (h, h->cur_cylinder, h->cur_head) :
+			     journal_sector (h, sector_info, data)));
+  return (1);
+}
+
+
+int dmk_write_sector (dmk_handle h,
+		      sector_info_t *sector_info,
+		      uint8_t *data)
+{
+  return (write_sector (h, sector_info, data, NULL));
+}
+
+
+int dmk_write_sector_with_crc (dmk_handle h,
+			       sector_info_t *sector_info,
+			       uint8_t *data,
+			       uint16_t crc)
+{
+  return (write_sector (h, sector_info, data, & crc));
+}
+
+
+uint16_t dmk_data_crc (sector_info_t *sector_info,
+		       uint8_t *data)
+{
+  uint16_t crc = 0xffff;
+  uint8_t mark;
+  int i, len;
+
+  mark = sector_info->data_mark;
+  if ((mark < 0xf8) || (mark > 0xfb))
+    mark = 0xfb;
+  if (sector_info->mode == DMK_MFM)
+    for (i = 0; i < 3; i++)
+      crc = (crc << 8) ^ crc_table [(crc >> 8) ^ 0xa1];
+  crc = (crc << 8) ^ crc_table [(crc >> 8) ^ mark];
+  len = si_sector_size (sector_info);
+  for (i = 0; i < len; i++)
+    crc = (crc << 8) ^ crc_table [(crc >> 8) ^ data [i]];
+  return (crc);
+}
+
+
+int dmk_raw_track_length (dmk_handle h)
+{
+  return (2 * DMK_MAX_SECTOR + h->track_length);
+}
+
+
+int dmk_read_track_raw (dmk_handle h,
+			uint8_t *raw)
+{
+  /* make sure we have a physical position */
+  if ((h->cur_cylinder < 0) || ! h->cur_track->buf)
+    return (0);
+
+  encode_idam_table (h->cur_track, raw);
+  memcpy (& raw [2 * DMK_MAX_SECTOR], h->cur_track->buf, h->track_length);
+  return (1);
+}
+
+
+int dmk_write_track_raw (dmk_handle h,
+			 uint8_t *raw)
+{
+  track_state_t *track = h->cur_track;
+
+  if ((h->cur_cylinder < 0) || (! track->buf) || (! h->writable))
+    return (0);
+
+  if (! unshare_track_buf (track, h->track_length))
+    {
+      fprintf (stderr, "out of memory copying shared track\n");
+      return (0);
+    }
+  memcpy (track->buf, & raw [2 * DMK_MAX_SECTOR], h->track_length);
+  if ((! decode_idam_table (h, track, raw)) ||
+      (! idam_table_valid (h, track)))
+    recover_idam_table (h, track, h->cur_cylinder, h->cur_head);
+  invalidate_sector_map (track);
+  track->dirty = 1;
+  track->version = ++h->clock;
+  h->read_id_index = 0;
+
+  if (h->journal)
+    return (journal_written (h, journal_track (h, h->cur_cylinder,
+					       h->cur_head)));
+  return (1);
+}
+
+
+int dmk_mark_track_clean (dmk_handle h)
+{
+  track_state_t *track = h->cur_track;
+  uint8_t idam_table [2 * DMK_MAX_SECTOR];
+
+  if ((h->cur_cylinder < 0) || (! track->buf) || h->new_image)
+    return (0);
+  track->dirty = 0;
+  if (h->watch)
+    {
+      encode_idam_table (track, idam_table);
+      watch_written (h, track - h->track, idam_table, track->buf);
+    }
+  return (1);
+}
+
+
+int dmk_track_sectors (dmk_handle h,
+		       dmk_sector_t *sectors)
+{
+  track_state_t *track;
+  sector_map_t *map;
+  int i;
+
+  /* make sure we have a physical position */
+  if (h->cur_cylinder < 0)
+    return (-1);
+
+  track = h->cur_track;
+  if ((! track->map) && (h->ids_only || ! build_sector_map (h, track)))
+    return (-1);
+
+  for (i = 0; i < track->map_count; i++)
+    {
+      map = & track->map [i];
+      sectors [i].id.cylinder  = map->cylinder;
+      sectors [i].id.head      = map->head;
+      sectors [i].id.sector    = map->sector;
+      sectors [i].id.size_code = map->size_code;
+      sectors [i].id.mode      = map->mode;
+      sectors [i].id_status    = map->id_status;
+      sectors [i].data_mark    = map->data_mark;
+      sectors [i].data_status  = map->data_status;
+      sectors [i].idam_offset  = map->idam;
+      sectors [i].data_offset  = map->data;
+      sectors [i].data_mark_offset = 0;
+      sectors [i].data_length  = 0;
+      if (map->data_status)
+	{
+	  sectors [i].data_mark_offset = map->data - byte_step (h, map->mode);
+	  sectors [i].data_length = (sector_size (map->mode, map->size_code) *
+				     ((map->mode == DMK_RX02) ? 1 : byte_step (h, map->mode)));
+	}
+      sectors [i].hash         = map->hash;
+    }
+  return (track->map_count);
+}
+
+
+/*
+ * Rotational timing.  Each track's ID fields are kept in a table in
+ * order of their offsets, with the first of them at or after every
+ * TIMING_BUCKET bytes of the track, so the next to pass the head is
+ * found by one lookup and at most a step or two; ID fields are longer
+ * than a bucket, so a bucket never starts more than one of them.
+ */
+
+#define TIMING_BUCKET_SHIFT 5
+
+#define TIMING_NONE 0xff
+
+typedef struct track_timing
+{
+  int count;                         /* ID fields */
+  uint8_t order [DMK_MAX_SECTOR];    /* sector map index of each, in
+					order of their offsets */
+  uint16_t offset [DMK_MAX_SECTOR];  /* of each, in the same order */
+  uint8_t by_number [256];           /* position in order of the first ID
+					with each sector number */
+  uint8_t bucket [];                 /* position in order of the first ID
+					at or after the start of each
+					bucket, count if none */
+} track_timing_t;
+
+
+static track_timing_t *build_track_timing (dmk_handle h,
+					   track_state_t *track)
+{
+  track_timing_t *tt;
+  int buckets = (h->track_length >> TIMING_BUCKET_SHIFT) + 1;
+  int i, j, b;
+
+  if ((! track->map) && (h->ids_only || ! build_sector_map (h, track)))
+    return (NULL);
+  tt = malloc (sizeof (track_timing_t) + buckets);
+  if (! tt)
+    return (NULL);
+
+  /* insertion sort by offset, the IDAM table usually being in order */
+  tt->count = track->map_count;
+  for (i = 0; i < tt->count; i++)
+    {
+      for (j = i; (j > 0) && (tt->offset [j - 1] > track->map [i].idam); j--)
+	{
+	  tt->order [j] = tt->order [j - 1];
+	  tt->offset [j] = tt->offset [j - 1];
+	}
+      tt->order [j] = i;
+      tt->offset [j] = track->map [i].idam;
+    }
+
+  memset (tt->by_number, TIMING_NONE, sizeof (tt->by_number));
+  for (i = tt->count - 1; i >= 0; i--)
+    tt->by_number [track->map [tt->order [i]].sector] = i;
+
+  for (b = 0, i = 0; b < buckets; b++)
+    {
+      while ((i < tt->count) && (tt->offset [i] < (b << TIMING_BUCKET_SHIFT)))
+	i++;
+      tt->bucket [b] = i;
+    }
+
+  track->timing = tt;
+  return (tt);
+}
+
+
+static track_timing_t *track_timing (dmk_handle h)
+{
+  /* make sure we have a physical position */
+  if (h->cur_cylinder < 0)
+    return (NULL);
+  if (h->cur_track->timing)
+    return (h->cur_track->timing);
+  return (build_track_timing (h, h->cur_track));
+}
+
+
+/* start of the revolution in progress at t */
+static double index_time (dmk_handle h, double t)
+{
+  return ((long long) (t / h->rev_time) * h->rev_time);
+}
+
+
+void dmk_get_timing (dmk_handle h,
+		     dmk_timing_t *timing)
+{
+  *timing = h->timing;
+}
+
+
+int dmk_set_timing (dmk_handle h,
+		    dmk_timing_t *timing)
+{
+  if ((timing->rpm <= 0.0) || (timing->rate < 0) ||
+      (timing->step_us < 0.0) || (timing->settle_us < 0.0))
+    return (0);
+  h->timing = *timing;
+  h->rev_time = 60.0e6 / timing->rpm;
+  h->byte_time = h->rev_time / h->track_length;
+  if (timing->rate && ((8000.0 / timing->rate) < h->byte_time))
+    h->byte_time = 8000.0 / timing->rate;
   return (1);
 }
 
 
+double dmk_offset_time (dmk_handle h,
+			int offset)
+{
+  return (offset * h->byte_time);
+}
+
+
+double dmk_seek_time (dmk_handle h,
+		      int from_cylinder,
+		      int to_cylinder)
+{
+  int distance = abs (to_cylinder - from_cylinder);
+
+  if (! distance)
+    return (0.0);
+  return (distance * h->timing.step_us + h->timing.settle_us);
+}
+
+
+int dmk_next_id_time (dmk_handle h,
+		      double t,
+		      double *start)
+{
+  track_timing_t *tt;
+  double base, p;
+  int pos, i;
+
+  tt = track_timing (h);
+  if ((! tt) || (! tt->count))
+    return (-1);
+
+  /* the first offset at or after t, allowing for rounding so that a
+     time returned earlier finds the same ID again */
+  base = index_time (h, t);
+  p = (t - base) / h->byte_time - 1e-6;
+  pos = (int) p;
+  if (pos < p)
+    pos++;
+
+  i = tt->count;
+  if (pos <= h->track_length)
+    for (i = tt->bucket [pos >> TIMING_BUCKET_SHIFT];
+	 (i < tt->count) && (tt->offset [i] < pos);
+	 i++)
+      ;
+  if (i == tt->count)
+    {
+      i = 0;
+      base += h->rev_time;
+    }
+  *start = base + tt->offset [i] * h->byte_time;
+  return (tt->order [i]);
+}
+
+
+double dmk_time_to_sector (dmk_handle h,
+			   double t,
+			   int sector)
+{
+  track_timing_t *tt;
+  double wait;
+
+  tt = track_timing (h);
+  if ((! tt) || (sector < 0) || (sector > 255) ||
+      (tt->by_number [sector] == TIMING_NONE))
+    return (-1.0);
+  wait = (tt->offset [tt->by_number [sector]] * h->byte_time -
+	  (t - index_time (h, t)));
+  if (wait < -1e-6 * h->byte_time)
+    wait += h->rev_time;
+  return (wait);
+}
+
+
+int dmk_track_class (dmk_handle h,
+		     uint8_t *fill)
+{
+  /* make sure we have a physical position */
+  if (h->cur_cylinder < 0)
+    return (-1);
+
+  if (! classify_track (h, h->cur_track))
+    return (-1);
+  if (fill)
+    *fill = h->cur_track->fill;
+  return (h->cur_track->track_class);
+}
+
+
+int dmk_search (dmk_handle h,
+		uint8_t *pattern,
+		int len,
+		int flags,
+		dmk_search_fn fn,
+		void *arg)
+{
+  int cylinder, head, i;
+  int step, size, offset;
+  int count = 0;
+  track_state_t *track;
+  sector_map_t *map;
+  sector_info_t sector_info;
+  uint8_t needle [MAX_SECTOR_SIZE];
+  uint8_t data [MAX_SECTOR_SIZE];
+  uint8_t fill;
+
+  if ((len <= 0) || (len > MAX_SECTOR_SIZE) || h->ids_only)
+    return (-1);
+  if (flags & DMK_SEARCH_NOCASE)
+    simd_fold_case (needle, pattern, len);
+  else
+    memcpy (needle, pattern, len);
+  memset (& sector_info, 0, sizeof (sector_info));
+
+  for (cylinder = 0; cylinder < h->cylinders; cylinder++)
+    for (head = 0; head <= h->ds; head++)
+      {
+	if (! dmk_seek (h, cylinder, head))
+	  return (-1);
+	track = h->cur_track;
+	if (! classify_track (h, track))
+	  return (-1);
+
+	/* every sector of a blank track holds only the fill byte, folded
+	   like the needle */
+	if (track->track_class == DMK_TRACK_BLANK)
+	  {
+	    fill = track->fill;
+	    if (flags & DMK_SEARCH_NOCASE)
+	      simd_fold_case (& fill, & track->fill, 1);
+	    if (! simd_uniform (needle, len, fill))
+	      continue;
+	  }
+
+	for (i = 0; i < track->map_count; i++)
+	  {
+	    map = & track->map [i];
+	    if (! map->data_status)
+	      continue;
+	    size = sector_size (map->mode, map->size_code);
+	    if (size < len)
+	      continue;
+	    step = (map->mode == DMK_RX02) ? 1 : byte_step (h, map->mode);
+	    copy_track_data (track, map->data, step, size, data);
+	    if (flags & DMK_SEARCH_NOCASE)
+	      simd_fold_case (data, data, size);
+
+	    offset = 0;
+	    while ((offset = simd_search (data, size, needle, len, offset)) >= 0)
+	      {
+		count++;
+		sector_info.cylinder  = map->cylinder;
+		sector_info.head      = map->head;
+		sector_info.sector    = map->sector;
+		sector_info.size_code = map->size_code;
+		sector_info.mode      = map->mode;
+		if (! fn (arg, cylinder, head, & sector_info, offset))
+		  return (count);
+		offset++;
+	      }
+	  }
+      }
+  return (count);
+}
+
+
 #ifdef ADDRESS_MARK_DEBUG
 int dmk_check_address_mark (dmk_handle h,
 			    sector_info_t *sector_info)
@@ -52,12 +52,52 @@ typedef struct
 		      fields */
   uint8_t data_value;  /* initial data value when
 		     formatting, normally 0xe5 */
+  uint8_t data_mark;  /* 0xf8 to 0xfb, set by reads, used by writes;
+			 0 (or any other value) writes 0xfb */
 } sector_info_t;
 
 
 typedef struct dmk_state *dmk_handle;
 
 
+/* decoded layout of one sector, see dmk_track_sectors() */
+typedef struct
+{
+  sector_info_t id;
+  int id_status;    /* 1 good, -1 bad CRC, 0 no ID field */
+  int data_mark;    /* 0xf8 to 0xfd, 0 if no data field */
+  int data_status;  /* 1 good, -1 bad CRC, 0 no data field */
+  /* offsets into the track data, not counting the IDAM pointer table */
+  int idam_offset;
+  int data_mark_offset;
+  int data_offset;
+  int data_length;  /* bytes of track data occupied by the sector data */
+  uint64_t hash;    /* dmk_hash of the sector data */
+} dmk_sector_t;
+
+
+/* track source for images that don't live in a DMK file */
+typedef struct
+{
+  /* fill in the IDAM pointer table and track data, in file format */
+  int (*read_track) (void *arg,
+		     int cylinder,
+		     int head,
+		     uint8_t *idam_table,
+		     uint8_t *data,
+		     int track_length);
+  void (*close) (void *arg);
+  /* if not NULL, the image is writable, and this is called from
+     dmk_close_image for each modified track */
+  int (*write_track) (void *arg,
+		      int cylinder,
+		      int head,
+		      uint8_t *idam_table,
+		      uint8_t *data,
+		      int track_length);
+} dmk_io_t;
+
+
 dmk_handle dmk_create_image (char *fn,
 			     int ds,    /* boolean */
 			     int cylinders,
@@ -83,8 +123,93 @@ dmk_handle dmk_open_image (char *fn,
 			   int *cylinders,
 			   int *dd);
 
+/*
+ * If a track's IDAM pointer table is empty, out of range, or doesn't
+ * point at address marks, the table is rebuilt by scanning the track
+ * data for ID fields with good CRCs when the track is first seeked to.
+ * The rebuilt table is written back only if the track is modified.
+ */
+
+dmk_handle dmk_open_image_ids (char *fn,
+			       int *ds,
+			       int *cylinders,
+			       int *dd);
+
+/*
+ * Open an image read-only for metadata access.  Only the header, the
+ * IDAM pointer tables and the ID fields are read from the file; no
+ * track data is loaded or retained.  dmk_seek and dmk_read_id work as
+ * usual, but sectors can't be read or written.  Tracks with broken IDAM
+ * tables are read in full to rebuild them, as is every track if all of
+ * the tables are empty.
+ */
+
+
+dmk_handle dmk_open_io (dmk_io_t *io,
+			void *arg,
+			uint8_t *dmk_header,
+			int *ds,
+			int *cylinders,
+			int *dd);
+
+/*
+ * Open an image whose tracks are supplied by callbacks.  The geometry
+ * is taken from the 16-byte DMK header.  The image is writable only if
+ * io->write_track isn't NULL.  io->close, if not NULL, is called by
+ * dmk_close_image.
+ */
+
+
+dmk_handle dmk_open_overlay (char *base_fn,
+			     char *delta_fn,
+			     int *ds,
+			     int *cylinders,
+			     int *dd);
+
+/*
+ * Open a writable view of a base image that is never modified.  Tracks
+ * written through the handle are saved, whole, in the delta file when
+ * the handle is closed, and are read back from there by later opens.
+ * Other tracks are read from the base.  The delta file is created if
+ * it doesn't exist, and is refused if the base image's header, size or
+ * modification time have changed since it was created.
+ *
+ * Changes are only in the delta once the handle has been closed
+ * cleanly.  If that is interrupted, a track saved for the first time
+ * reads back from the base, since its directory entry is written only
+ * after the track is synced; a track rewritten in place may be reported
+ * as bad.
+ */
+
+
+int dmk_overlay_modified (dmk_handle h,
+			  int cylinder,
+			  int head);
+
+/*
+ * True if the track of an overlay image comes from the delta file.
+ */
+
+
 int dmk_close_image (dmk_handle h);
 
+/*
+ * Write modified tracks back to the image file in place, and free the
+ * handle.  Use dmk_save_image first if a crash mustn't leave a
+ * partially written image.
+ */
+
+
+int dmk_save_image (dmk_handle h);
+
+/*
+ * Replace the image file with its current contents atomically.  A new
+ * file is built next to it, with unmodified tracks cloned from the old
+ * file (sharing blocks where the filesystem supports it) and modified
+ * tracks written, then synced and renamed over the old one.  The
+ * handle stays open on the new file.
+ */
+
 
 int dmk_seek (dmk_handle h,
 	      int cylinder,
@@ -119,8 +244,361 @@ int dmk_write_sector (dmk_handle h,
 		      sector_info_t *sector_info,
 		      uint8_t *data);
 
+int dmk_write_sector_with_crc (dmk_handle h,
+			       sector_info_t *sector_info,
+			       uint8_t *data,
+			       uint16_t crc);
+
+/*
+ * Like dmk_write_sector, but record crc after the data in place of the
+ * correct CRC, so that a sector read with a data error is preserved as
+ * such.
+ */
+
+uint16_t dmk_data_crc (sector_info_t *sector_info,
+		       uint8_t *data);
+
+/*
+ * The CRC recorded after a data field holding data: over the data
+ * address mark (sector_info->data_mark, 0xfb if not set), preceded by
+ * the three 0xa1 sync bytes in MFM, and the sector data.  Compare it
+ * with the actual_crc of dmk_read_sector_with_crcs, or with a CRC read
+ * from a disk, to check data reconstructed from damaged reads.
+ */
+
 int dmk_sector_size (sector_info_t *si);
 
+
+int dmk_raw_track_length (dmk_handle h);
+
+/*
+ * Length of a track in the image file, including the IDAM pointer table.
+ */
+
+
+int dmk_read_track_raw (dmk_handle h,
+			uint8_t *raw);
+
+/*
+ * Copy the current track, in image file format, to raw, which must hold
+ * dmk_raw_track_length() bytes.
+ */
+
+
+int dmk_write_track_raw (dmk_handle h,
+			 uint8_t *raw);
+
+/*
+ * Replace the current track with raw, in image file format as produced
+ * by dmk_read_track_raw for an image with the same track length.
+ */
+
+
+int dmk_mark_track_clean (dmk_handle h);
+
+/*
+ * Record that the current track has been written to the image file by
+ * the caller, typically from a copy taken with dmk_read_track_raw and
+ * written from another thread, so that it isn't written again.  Fails
+ * for new images, whose file isn't laid out until dmk_save_image.
+ */
+
+
+int dmk_track_sectors (dmk_handle h,
+		       dmk_sector_t *sectors);
+
+/*
+ * Decode the layout of all sectors on the current track into sectors,
+ * which must have room for DMK_MAX_SECTOR entries.  Returns the number
+ * of sectors, or -1 on error.
+ */
+
+
+typedef struct
+{
+  double rpm;
+  int rate;          /* Kbps, or 0 to spread the track over a revolution */
+  double step_us;    /* per cylinder stepped */
+  double settle_us;  /* after the last step of a seek */
+} dmk_timing_t;
+
+void dmk_get_timing (dmk_handle h,
+		     dmk_timing_t *timing);
+
+int dmk_set_timing (dmk_handle h,
+		    dmk_timing_t *timing);
+
+/*
+ * Rotational timing model, for emulators.  Times are in microseconds of
+ * drive time, with an index pulse at every multiple of the revolution
+ * time, 60e6 / rpm.  Positions are byte offsets into the track data,
+ * not counting the IDAM pointer table, with the index hole at offset 0.
+ * Each byte takes 8000 / rate us to pass the head, unless the track
+ * data wouldn't then fit in one revolution or rate is 0, in which case
+ * it is spread evenly over the revolution.  Created images start with
+ * the rpm and rate given to dmk_create_image; opened images, whose
+ * files don't record them, with 360 RPM for the 8-inch track lengths
+ * of the DMK spec and 300 otherwise, and rate 0.  Steps take 3 ms and
+ * settling 15 ms.  dmk_set_timing returns 0 for a zero or negative rpm
+ * or other negative values.
+ */
+
+
+double dmk_offset_time (dmk_handle h,
+			int offset);
+
+/*
+ * Time from the index pulse until offset passes under the head.
+ */
+
+
+double dmk_seek_time (dmk_handle h,
+		      int from_cylinder,
+		      int to_cylinder);
+
+/*
+ * Time to step the head between cylinders and settle, or 0 if it
+ * doesn't move.
+ */
+
+
+int dmk_next_id_time (dmk_handle h,
+		      double t,
+		      double *start);
+
+/*
+ * Find the ID field of the current track whose address mark is next
+ * to reach the head at or after time t, including IDs with bad CRCs,
+ * storing the time it does in start.  Returns its index in the array
+ * filled in by dmk_track_sectors, or -1 if the track has no IDs or on
+ * error.  The IDs' positions are tabulated on first use and kept until
+ * the track is written, so this takes constant time.  Pass start plus
+ * a byte's time to find the ID after it.
+ */
+
+
+double dmk_time_to_sector (dmk_handle h,
+			   double t,
+			   int sector);
+
+/*
+ * Time from t until the address mark of the ID field of the current
+ * track with the given sector number next reaches the head, less than
+ * a revolution.  If several IDs have that number, the one nearest the
+ * index hole is used.  Returns -1 if there's none, or on error.
+ */
+
+
+int dmk_write_index (dmk_handle h);
+
+/*
+ * Decode every track of an opened image and save the results in a
+ * sidecar index file (image.dmkidx for image.dmk).  Later opens of the
+ * unmodified image load the index instead of parsing the tracks.  The
+ * index is ignored once the image's size, modification time or header
+ * change.
+ */
+
+
+int dmk_merkle_root (dmk_handle h,
+		     uint64_t *root);
+
+/*
+ * Root of a hash tree whose leaves are the image's tracks as
+ * dmk_read_track_raw returns them, including writes not yet saved.
+ * The tree is built on first use, kept up to date as tracks are
+ * written, and saved in a sidecar file (image.dmktree for image.dmk)
+ * when an image opened for writing is closed, so that later opens of
+ * the unmodified image needn't read any tracks to rebuild it.
+ */
+
+
+int dmk_merkle_diff (dmk_handle a,
+		     dmk_handle b,
+		     int *tracks);
+
+/*
+ * Compare the hash trees of two images of the same geometry, storing
+ * the index (2 * cylinder + head for double-sided images, cylinder for
+ * single-sided) of each track that differs in tracks, which must have
+ * room for every track.  Returns the number of differing tracks, or -1
+ * on error.
+ */
+
+
+int dmk_watch (dmk_handle h);
+
+/*
+ * Watch the image file for changes made by other programs, whether
+ * written in place or renamed over it.  Changes are picked up by
+ * dmk_watch_check.
+ */
+
+
+int dmk_watch_fd (dmk_handle h);
+
+/*
+ * File descriptor that becomes readable when the image may have
+ * changed, for use with poll() or select(), or -1 if not watching.
+ */
+
+
+int dmk_watch_check (dmk_handle h);
+
+/*
+ * Without blocking, look for changes to a watched image.  Each track
+ * whose contents on disk differ from when it was last seen is dropped
+ * and read again when next used, unless it has been modified through
+ * this handle, in which case the modified track is kept.  Returns the
+ * number of tracks dropped, or -1 on error, including when the image's
+ * geometry has changed and it must be reopened.
+ */
+
+
+uint64_t dmk_generation (dmk_handle h);
+
+/*
+ * Count of dmk_watch_check calls that dropped changed tracks.  Data
+ * derived from the image and cached elsewhere is stale once this
+ * changes.
+ */
+
+
+typedef int (*dmk_search_fn) (void *arg,
+			      int cylinder,  /* physical track */
+			      int head,
+			      sector_info_t *sector_info,  /* logical ID */
+			      int offset);
+
+#define DMK_SEARCH_NOCASE 0x01  /* fold ASCII case before comparing */
+
+typedef enum
+{
+  DMK_TRACK_UNFORMATTED,  /* no ID fields */
+  DMK_TRACK_BLANK,        /* formatted, every sector filled with one value */
+  DMK_TRACK_USED
+} track_class_t;
+
+int dmk_track_class (dmk_handle h,
+		     uint8_t *fill);
+
+/*
+ * Classify the current track.  A blank track has good ID and data CRCs
+ * on every sector, and all of its sector data is the same byte
+ * (normally 0xe5), which is stored in *fill if fill isn't NULL.  The
+ * result is cached until the track is written.  Handles opened with
+ * dmk_open_image_ids report formatted tracks as used.  Returns -1 on
+ * error.
+ */
+
+
+int dmk_search (dmk_handle h,
+		uint8_t *pattern,
+		int len,
+		int flags,
+		dmk_search_fn fn,
+		void *arg);
+
+/*
+ * Search the data of every sector of the image for pattern, calling fn
+ * for each match with the track, sector ID and byte offset within the
+ * sector.  Matches don't span sectors.  Sectors with bad data CRCs are
+ * searched too.  If fn returns 0 the search stops early.  Returns the
+ * number of matches, or -1 on error.
+ */
+
+
+typedef struct dmk_snapshot *dmk_snapshot_t;
+
+dmk_snapshot_t dmk_snapshot (dmk_handle h);
+
+/*
+ * Capture the contents of every track.  Tracks not yet read are read
+ * first, so the first snapshot of an image costs a full read; after
+ * that a snapshot only takes a reference to each track's buffer, and a
+ * track written later gets its own copy.  Not available for handles
+ * opened with dmk_open_image_ids.  Returns NULL on error.
+ */
+
+
+int dmk_restore (dmk_handle h,
+		 dmk_snapshot_t snap);
+
+/*
+ * Put every track back the way it was when snap was taken.  The
+ * snapshot remains valid and can be restored again.  Tracks that
+ * differed from the image file when the snapshot was taken, or have
+ * changed since, are written when the image is closed.
+ */
+
+
+void dmk_snapshot_free (dmk_snapshot_t snap);
+
+
+int dmk_snapshot_write (dmk_snapshot_t snap,
+			dmk_snapshot_t parent,
+			char *fn);
+
+/*
+ * Save a snapshot to a file.  If parent isn't NULL, only the tracks
+ * written since parent was taken are saved, and the file can only be
+ * read back on top of parent.
+ */
+
+
+dmk_snapshot_t dmk_snapshot_read (dmk_handle h,
+				  char *fn,
+				  dmk_snapshot_t parent);
+
+/*
+ * Load a snapshot saved by dmk_snapshot_write, for use with h, which
+ * must have the same geometry as the image it was taken from.  parent
+ * must be the snapshot it was saved relative to, if any.  Returns NULL
+ * on error.
+ */
+
+
+#define DMK_JOURNAL_SYNC 0x01  /* each write waits until it is durable */
+
+int dmk_journal_open (dmk_handle h,
+		      char *fn,
+		      int flags);
+
+/*
+ * Log every later sector write, format and restore of an image opened
+ * for writing to the journal file fn (by default image.dmkjnl for
+ * image.dmk), so that they survive a crash.  Writes are appended in
+ * memory and made durable in batches by a background thread; with
+ * DMK_JOURNAL_SYNC each write waits for its batch.  If the journal
+ * already holds writes that never reached the image, they are replayed
+ * first.  When the journal grows large, modified tracks are written
+ * back to the image in the background, and the journal is emptied when
+ * the image is closed.
+ */
+
+
+int dmk_journal_sync (dmk_handle h);
+
+/*
+ * Wait until every write so far is durable in the journal.
+ */
+
+
+int dmk_journal_checkpoint (dmk_handle h);
+
+/*
+ * Start writing modified tracks back to the image in the background,
+ * after which the journal no longer needs to be replayed up to this
+ * point.
+ */
+
+
+uint64_t dmk_hash (const uint8_t *data, int len);
+
+/*
+ * 64-bit content hash (XXH64, seed zero), as used in index files.
+ */
+
 #undef ADDRESS_MARK_DEBUG
 #ifdef ADDRESS_MARK_DEBUG
 int dmk_check_address_mark (dmk_handle h,
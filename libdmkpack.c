@@ -0,0 +1,829 @@
+/*
+ * libdmkpack - deduplicating archives of DMK disk images
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dmk.h"
+#include "libdmk.h"
+#include "libdmkpack.h"
+
+
+#define PACK_MAGIC "DMKPACK\1"
+#define PACK_MAGIC_LENGTH 8
+
+/*
+ * Record layout: type byte, three reserved bytes, 32-bit payload
+ * length, payload, then the dmk_hash of the payload.  All integers are
+ * little endian.  A chunk record is identified by its payload hash and
+ * length.
+ */
+#define RECORD_HEADER_LENGTH  8
+#define RECORD_TRAILER_LENGTH 8
+
+#define RECORD_CHUNK    'C'
+#define RECORD_MANIFEST 'M'
+
+#define SEGMENT_LENGTH 12  /* hash, length */
+
+
+typedef struct
+{
+  uint64_t hash;
+  uint32_t length;
+  long offset;  /* of payload in pack file, 0 if slot unused */
+} chunk_t;
+
+typedef struct
+{
+  char *name;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  long offset;  /* of manifest payload in pack file */
+  uint32_t length;
+} member_t;
+
+struct dmkpack
+{
+  FILE *f;
+  int fd;
+  int writable;  /* boolean */
+  long end;      /* where the next record goes */
+
+  pthread_mutex_t lock;  /* protects everything below, and appends */
+
+  chunk_t *chunk;  /* open-addressed hash table */
+  long chunk_slots;
+  long chunk_count;
+  long stored_bytes;
+
+  member_t *member;
+  int member_count;
+  int member_slots;
+};
+
+/* a member image opened through the dmk_io_t interface */
+typedef struct
+{
+  dmkpack_handle pack;
+  int heads;
+  int track_count;
+  uint8_t *manifest;
+  uint8_t **track;  /* start of each track's segment list in manifest */
+} member_io_t;
+
+
+static inline void put_le16 (uint8_t *p, uint16_t v)
+{
+  p [0] = v & 0xff;
+  p [1] = v >> 8;
+}
+
+
+static inline void put_le32 (uint8_t *p, uint32_t v)
+{
+  put_le16 (p, v & 0xffff);
+  put_le16 (p + 2, v >> 16);
+}
+
+
+static inline void put_le64 (uint8_t *p, uint64_t v)
+{
+  put_le32 (p, v & 0xffffffff);
+  put_le32 (p + 4, v >> 32);
+}
+
+
+static inline uint16_t get_le16 (const uint8_t *p)
+{
+  return (p [0] | (p [1] << 8));
+}
+
+
+static inline uint32_t get_le32 (const uint8_t *p)
+{
+  return (p [0] | (p [1] << 8) | (p [2] << 16) | ((uint32_t) p [3] << 24));
+}
+
+
+static inline uint64_t get_le64 (const uint8_t *p)
+{
+  return (get_le32 (p) | ((uint64_t) get_le32 (p + 4) << 32));
+}
+
+
+static int header_track_count (uint8_t *dmk_header)
+{
+  return (dmk_header [1] * ((dmk_header [4] & DMK_FLAG_SS_MASK) ? 1 : 2));
+}
+
+
+static int header_raw_track_length (uint8_t *dmk_header)
+{
+  return (get_le16 (& dmk_header [2]));
+}
+
+
+static chunk_t *find_chunk (dmkpack_handle p, uint64_t hash, uint32_t length)
+{
+  long i;
+
+  for (i = hash & (p->chunk_slots - 1); p->chunk [i].offset;
+       i = (i + 1) & (p->chunk_slots - 1))
+    if ((p->chunk [i].hash == hash) && (p->chunk [i].length == length))
+      return (& p->chunk [i]);
+  return (& p->chunk [i]);  /* empty slot where it would go */
+}
+
+
+static int add_chunk (dmkpack_handle p, uint64_t hash, uint32_t length,
+		      long offset)
+{
+  chunk_t *c;
+
+  if ((p->chunk_count + 1) * 2 > p->chunk_slots)
+    {
+      chunk_t *old = p->chunk;
+      long old_slots = p->chunk_slots;
+      long i;
+
+      p->chunk_slots = old_slots * 2;
+      p->chunk = calloc (p->chunk_slots, sizeof (chunk_t));
+      if (! p->chunk)
+	{
+	  p->chunk = old;
+	  p->chunk_slots = old_slots;
+	  return (0);
+	}
+      for (i = 0; i < old_slots; i++)
+	if (old [i].offset)
+	  *find_chunk (p, old [i].hash, old [i].length) = old [i];
+      free (old);
+    }
+
+  c = find_chunk (p, hash, length);
+  if (! c->offset)
+    {
+      p->chunk_count++;
+      p->stored_bytes += length;
+    }
+  c->hash = hash;
+  c->length = length;
+  c->offset = offset;
+  return (1);
+}
+
+
+static member_t *find_member (dmkpack_handle p, char *name)
+{
+  int i;
+
+  for (i = 0; i < p->member_count; i++)
+    if (strcmp (p->member [i].name, name) == 0)
+      return (& p->member [i]);
+  return (NULL);
+}
+
+
+static int add_member (dmkpack_handle p, char *name, uint8_t *dmk_header,
+		       long offset, uint32_t length)
+{
+  member_t *m;
+
+  m = find_member (p, name);
+  if (! m)
+    {
+      if (p->member_count >= p->member_slots)
+	{
+	  int slots = p->member_slots ? p->member_slots * 2 : 64;
+	  member_t *new_member = realloc (p->member, slots * sizeof (member_t));
+	  if (! new_member)
+	    return (0);
+	  p->member = new_member;
+	  p->member_slots = slots;
+	}
+      m = & p->member [p->member_count];
+      m->name = strdup (name);
+      if (! m->name)
+	return (0);
+      p->member_count++;
+    }
+  memcpy (m->dmk_header, dmk_header, DMK_HEADER_LENGTH);
+  m->offset = offset;
+  m->length = length;
+  return (1);
+}
+
+
+/*
+ * Read the record index from an existing pack file.  It ends at the
+ * first record that is truncated, of unknown type, or a manifest that
+ * doesn't match its hash: what an interrupted append leaves behind,
+ * whether the file was cut short or its tail never reached the disk.
+ */
+static int scan_pack (dmkpack_handle p)
+{
+  uint8_t hdr [RECORD_HEADER_LENGTH];
+  uint8_t trailer [RECORD_TRAILER_LENGTH];
+  uint8_t *manifest;
+  char *name;
+  int name_len;
+  long pos = PACK_MAGIC_LENGTH;
+  uint32_t length;
+  int ok;
+  int valid = 1;
+
+  while (valid &&
+	 (RECORD_HEADER_LENGTH == pread (p->fd, hdr, RECORD_HEADER_LENGTH, pos)))
+    {
+      length = get_le32 (& hdr [4]);
+      if (RECORD_TRAILER_LENGTH != pread (p->fd, trailer, RECORD_TRAILER_LENGTH,
+					  pos + RECORD_HEADER_LENGTH + length))
+	break;  /* truncated record */
+
+      switch (hdr [0])
+	{
+	case RECORD_CHUNK:
+	  if (! add_chunk (p, get_le64 (trailer), length,
+			   pos + RECORD_HEADER_LENGTH))
+	    return (0);
+	  break;
+	case RECORD_MANIFEST:
+	  manifest = malloc (length ? length : 1);
+	  if (! manifest)
+	    return (0);
+	  if ((length < 2) ||
+	      (length != pread (p->fd, manifest, length,
+				pos + RECORD_HEADER_LENGTH)) ||
+	      (dmk_hash (manifest, length) != get_le64 (trailer)) ||
+	      (2 + get_le16 (manifest) + DMK_HEADER_LENGTH > length))
+	    {
+	      free (manifest);
+	      valid = 0;  /* torn manifest */
+	      break;
+	    }
+	  name_len = get_le16 (manifest);
+	  name = malloc (name_len + 1);
+	  ok = (name != NULL);
+	  if (ok)
+	    {
+	      memcpy (name, & manifest [2], name_len);
+	      name [name_len] = '\0';
+	      ok = add_member (p, name, & manifest [2 + name_len],
+			       pos + RECORD_HEADER_LENGTH, length);
+	    }
+	  free (name);
+	  free (manifest);
+	  if (! ok)
+	    return (0);
+	  break;
+	default:
+	  valid = 0;  /* unwritten tail, typically zeros */
+	  break;
+	}
+      if (valid)
+	pos += RECORD_HEADER_LENGTH + length + RECORD_TRAILER_LENGTH;
+    }
+
+  p->end = pos;
+  return (1);
+}
+
+
+dmkpack_handle dmkpack_open (char *fn,
+			     int writable)
+{
+  dmkpack_handle p;
+  uint8_t magic [PACK_MAGIC_LENGTH];
+
+  p = calloc (1, sizeof (struct dmkpack));
+  if (! p)
+    return (NULL);
+  pthread_mutex_init (& p->lock, NULL);
+  p->writable = writable;
+
+  p->f = fopen (fn, writable ? "r+b" : "rb");
+  if ((! p->f) && writable)
+    {
+      p->f = fopen (fn, "w+b");
+      if (p->f && (1 != fwrite (PACK_MAGIC, PACK_MAGIC_LENGTH, 1, p->f)))
+	goto fail;
+      if (p->f && fflush (p->f))
+	goto fail;
+    }
+  if (! p->f)
+    goto fail;
+  p->fd = fileno (p->f);
+
+  if ((PACK_MAGIC_LENGTH != pread (p->fd, magic, PACK_MAGIC_LENGTH, 0)) ||
+      (memcmp (magic, PACK_MAGIC, PACK_MAGIC_LENGTH) != 0))
+    {
+      fprintf (stderr, "dmkpack: %s is not a pack file\n", fn);
+      goto fail;
+    }
+
+  p->chunk_slots = 1024;
+  p->chunk = calloc (p->chunk_slots, sizeof (chunk_t));
+  if (! p->chunk)
+    goto fail;
+  if (! scan_pack (p))
+    goto fail;
+
+  /* drop any partial record left by an interrupted append */
+  if (writable && (0 > ftruncate (p->fd, p->end)))
+    goto fail;
+
+  return (p);
+
+ fail:
+  dmkpack_close (p);
+  return (NULL);
+}
+
+
+int dmkpack_close (dmkpack_handle p)
+{
+  int i;
+  int status = 1;
+
+  if (p->f)
+    {
+      if (p->writable && (fflush (p->f) || fsync (p->fd)))
+	status = 0;
+      fclose (p->f);
+    }
+  for (i = 0; i < p->member_count; i++)
+    free (p->member [i].name);
+  free (p->member);
+  free (p->chunk);
+  pthread_mutex_destroy (& p->lock);
+  free (p);
+  return (status);
+}
+
+
+/* append a record; caller must hold the lock */
+static long append_record (dmkpack_handle p, int type,
+			   uint8_t *payload, uint32_t length, uint64_t hash)
+{
+  uint8_t hdr [RECORD_HEADER_LENGTH];
+  uint8_t trailer [RECORD_TRAILER_LENGTH];
+  long offset = p->end + RECORD_HEADER_LENGTH;
+
+  memset (hdr, 0, sizeof (hdr));
+  hdr [0] = type;
+  put_le32 (& hdr [4], length);
+  put_le64 (trailer, hash);
+
+  if ((0 > fseek (p->f, p->end, SEEK_SET)) ||
+      (1 != fwrite (hdr, sizeof (hdr), 1, p->f)) ||
+      (length && (1 != fwrite (payload, length, 1, p->f))) ||
+      (1 != fwrite (trailer, sizeof (trailer), 1, p->f)) ||
+      fflush (p->f))
+    {
+      fprintf (stderr, "dmkpack: error writing pack file\n");
+      return (0);
+    }
+  p->end = offset + length + RECORD_TRAILER_LENGTH;
+  return (offset);
+}
+
+
+/* compare a stored chunk with candidate data of the same hash and length */
+static int same_chunk (dmkpack_handle p, chunk_t *c, uint8_t *data)
+{
+  uint8_t *buf;
+  int same;
+
+  buf = malloc (c->length);
+  if (! buf)
+    return (0);
+  same = ((c->length == pread (p->fd, buf, c->length, c->offset)) &&
+	  (memcmp (buf, data, c->length) == 0));
+  free (buf);
+  return (same);
+}
+
+
+static int cmp_int (const void *a, const void *b)
+{
+  return (*(const int *) a - *(const int *) b);
+}
+
+
+/*
+ * Split a raw track into segments: the IDAM pointer table, each sector's
+ * data, and the gaps and ID fields in between.  Returns the number of
+ * cut points written to cut, including both ends.
+ */
+static int cut_track (dmk_handle h, int raw_length, int *cut)
+{
+  dmk_sector_t sectors [DMK_MAX_SECTOR];
+  int count;
+  int i, n = 0;
+
+  cut [n++] = 0;
+  cut [n++] = 2 * DMK_MAX_SECTOR;
+  cut [n++] = raw_length;
+
+  count = dmk_track_sectors (h, sectors);
+  for (i = 0; i < count; i++)
+    if (sectors [i].data_status)
+      {
+	cut [n++] = 2 * DMK_MAX_SECTOR + sectors [i].data_offset;
+	cut [n++] = 2 * DMK_MAX_SECTOR + sectors [i].data_offset +
+	  sectors [i].data_length;
+      }
+
+  qsort (cut, n, sizeof (int), cmp_int);
+  for (count = 1, i = 1; i < n; i++)
+    if ((cut [i] != cut [count - 1]) && (cut [i] <= raw_length))
+      cut [count++] = cut [i];
+  return (count);
+}
+
+
+int dmkpack_add_image (dmkpack_handle p,
+		       char *name,
+		       char *image_fn)
+{
+  dmk_handle h = NULL;
+  FILE *f;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  int ds, dd, cylinders;
+  int cylinder, head;
+  int raw_length;
+  uint8_t *raw = NULL;
+  uint8_t *manifest = NULL, *m;
+  uint8_t *seg_count;
+  long manifest_length;
+  long offset;
+  int cut [2 * DMK_MAX_SECTOR + 3];
+  int cut_count;
+  int i;
+  uint64_t hash;
+  chunk_t *c;
+  int status = 0;
+
+  if ((! p->writable) || (strlen (name) > 65535))
+    return (0);
+
+  f = fopen (image_fn, "rb");
+  if (! f)
+    return (0);
+  i = fread (dmk_header, DMK_HEADER_LENGTH, 1, f);
+  fclose (f);
+  if (i != 1)
+    return (0);
+
+  h = dmk_open_image (image_fn, 0, & ds, & cylinders, & dd);
+  if (! h)
+    return (0);
+
+  raw_length = dmk_raw_track_length (h);
+  raw = malloc (raw_length);
+  manifest_length = (2 + strlen (name) + DMK_HEADER_LENGTH + 4 +
+		     cylinders * (ds + 1) * (2 + (2 * DMK_MAX_SECTOR + 2) *
+					     SEGMENT_LENGTH));
+  manifest = malloc (manifest_length);
+  if ((! raw) || (! manifest))
+    goto done;
+
+  m = manifest;
+  put_le16 (m, strlen (name));
+  m += 2;
+  memcpy (m, name, strlen (name));
+  m += strlen (name);
+  memcpy (m, dmk_header, DMK_HEADER_LENGTH);
+  m += DMK_HEADER_LENGTH;
+  put_le32 (m, cylinders * (ds + 1));
+  m += 4;
+
+  for (cylinder = 0; cylinder < cylinders; cylinder++)
+    for (head = 0; head <= ds; head++)
+      {
+	if ((! dmk_seek (h, cylinder, head)) ||
+	    (! dmk_read_track_raw (h, raw)))
+	  goto done;
+	cut_count = cut_track (h, raw_length, cut);
+
+	seg_count = m;
+	put_le16 (seg_count, cut_count - 1);
+	m += 2;
+	for (i = 0; i < cut_count - 1; i++)
+	  {
+	    put_le64 (m, dmk_hash (& raw [cut [i]], cut [i + 1] - cut [i]));
+	    put_le32 (m + 8, cut [i + 1] - cut [i]);
+	    m += SEGMENT_LENGTH;
+	  }
+
+	/* store any chunks the pack doesn't have yet */
+	pthread_mutex_lock (& p->lock);
+	for (i = 0; i < cut_count - 1; i++)
+	  {
+	    hash = get_le64 (seg_count + 2 + i * SEGMENT_LENGTH);
+	    c = find_chunk (p, hash, cut [i + 1] - cut [i]);
+	    if (c->offset)
+	      {
+		/* don't trust a 64-bit hash alone to say the bytes match */
+		if (! same_chunk (p, c, & raw [cut [i]]))
+		  {
+		    fprintf (stderr, "dmkpack: chunk at offset %ld doesn't "
+			     "match data with the same hash\n", c->offset);
+		    pthread_mutex_unlock (& p->lock);
+		    goto done;
+		  }
+		continue;
+	      }
+	    offset = append_record (p, RECORD_CHUNK, & raw [cut [i]],
+				    cut [i + 1] - cut [i], hash);
+	    if ((! offset) ||
+		(! add_chunk (p, hash, cut [i + 1] - cut [i], offset)))
+	      {
+		pthread_mutex_unlock (& p->lock);
+		goto done;
+	      }
+	  }
+	pthread_mutex_unlock (& p->lock);
+      }
+
+  /* the chunks must be on disk before a manifest that refers to them */
+  if (0 != fdatasync (p->fd))
+    {
+      fprintf (stderr, "dmkpack: error writing pack file\n");
+      goto done;
+    }
+
+  manifest_length = m - manifest;
+  pthread_mutex_lock (& p->lock);
+  offset = append_record (p, RECORD_MANIFEST, manifest, manifest_length,
+			  dmk_hash (manifest, manifest_length));
+  status = offset && add_member (p, name, dmk_header, offset, manifest_length);
+  pthread_mutex_unlock (& p->lock);
+
+ done:
+  if (h)
+    dmk_close_image (h);
+  free (raw);
+  free (manifest);
+  return (status);
+}
+
+
+int dmkpack_member_count (dmkpack_handle p)
+{
+  int count;
+
+  pthread_mutex_lock (& p->lock);
+  count = p->member_count;
+  pthread_mutex_unlock (& p->lock);
+  return (count);
+}
+
+
+char *dmkpack_member_name (dmkpack_handle p,
+			   int index)
+{
+  char *name = NULL;
+
+  /* add_member may move the array, but never frees a name */
+  pthread_mutex_lock (& p->lock);
+  if ((index >= 0) && (index < p->member_count))
+    name = p->member [index].name;
+  pthread_mutex_unlock (& p->lock);
+  return (name);
+}
+
+
+int dmkpack_read_header (dmkpack_handle p,
+			 char *name,
+			 uint8_t *dmk_header)
+{
+  member_t *m;
+
+  pthread_mutex_lock (& p->lock);
+  m = find_member (p, name);
+  if (m)
+    memcpy (dmk_header, m->dmk_header, DMK_HEADER_LENGTH);
+  pthread_mutex_unlock (& p->lock);
+  return (m != NULL);
+}
+
+
+void dmkpack_stats (dmkpack_handle p,
+		    long *chunk_count,
+		    long *stored_bytes,
+		    long *logical_bytes)
+{
+  int i;
+
+  pthread_mutex_lock (& p->lock);
+  *chunk_count = p->chunk_count;
+  *stored_bytes = p->stored_bytes;
+  *logical_bytes = 0;
+  for (i = 0; i < p->member_count; i++)
+    *logical_bytes += (DMK_HEADER_LENGTH +
+		       (long) header_track_count (p->member [i].dmk_header) *
+		       header_raw_track_length (p->member [i].dmk_header));
+  pthread_mutex_unlock (& p->lock);
+}
+
+
+static int member_read_track (void *arg,
+			      int cylinder,
+			      int head,
+			      uint8_t *idam_table,
+			      uint8_t *data,
+			      int track_length)
+{
+  member_io_t *mio = arg;
+  dmkpack_handle p = mio->pack;
+  int track = cylinder * mio->heads + head;
+  uint8_t *seg;
+  int count, i;
+  int pos = 0;
+  int raw_length = 2 * DMK_MAX_SECTOR + track_length;
+  uint32_t length;
+  chunk_t *c;
+  long offset;
+  int chunk_pos;
+  uint8_t *buf;
+  int status = 0;
+
+  if (track >= mio->track_count)
+    return (0);
+
+  buf = malloc (raw_length);
+  if (! buf)
+    return (0);
+
+  seg = mio->track [track];
+  count = get_le16 (seg);
+  seg += 2;
+  for (i = 0; i < count; i++, seg += SEGMENT_LENGTH)
+    {
+      length = get_le32 (seg + 8);
+      if (pos + length > raw_length)
+	goto done;
+
+      pthread_mutex_lock (& p->lock);
+      c = find_chunk (p, get_le64 (seg), length);
+      offset = c->offset;
+      pthread_mutex_unlock (& p->lock);
+      if (! offset)
+	{
+	  fprintf (stderr, "dmkpack: missing chunk\n");
+	  goto done;
+	}
+
+      /* the chunk's address is its hash, so check the content against it */
+      if ((length != pread (p->fd, buf, length, offset)) ||
+	  (dmk_hash (buf, length) != get_le64 (seg)))
+	{
+	  fprintf (stderr, "dmkpack: bad chunk at offset %ld\n", offset);
+	  goto done;
+	}
+
+      /* the segment may straddle the IDAM table and the track data */
+      for (chunk_pos = 0; chunk_pos < length; )
+	{
+	  uint8_t *dst;
+	  int n;
+
+	  if (pos < 2 * DMK_MAX_SECTOR)
+	    {
+	      dst = & idam_table [pos];
+	      n = 2 * DMK_MAX_SECTOR - pos;
+	    }
+	  else
+	    {
+	      dst = & data [pos - 2 * DMK_MAX_SECTOR];
+	      n = raw_length - pos;
+	    }
+	  if (n > length - chunk_pos)
+	    n = length - chunk_pos;
+	  memcpy (dst, & buf [chunk_pos], n);
+	  pos += n;
+	  chunk_pos += n;
+	}
+    }
+  status = (pos == raw_length);
+
+ done:
+  free (buf);
+  return (status);
+}
+
+
+static void member_close (void *arg)
+{
+  member_io_t *mio = arg;
+
+  free (mio->manifest);
+  free (mio->track);
+  free (mio);
+}
+
+
+static dmk_io_t member_io =
+{
+  member_read_track,
+  member_close
+};
+
+
+dmk_handle dmkpack_open_image (dmkpack_handle p,
+			       char *name,
+			       int *ds,
+			       int *cylinders,
+			       int *dd)
+{
+  member_t *m;
+  member_io_t *mio;
+  long offset;
+  uint32_t length;
+  uint8_t dmk_header [DMK_HEADER_LENGTH];
+  uint8_t trailer [RECORD_TRAILER_LENGTH];
+  uint8_t *pos, *end;
+  int i;
+  dmk_handle h;
+
+  pthread_mutex_lock (& p->lock);
+  m = find_member (p, name);
+  if (m)
+    {
+      offset = m->offset;
+      length = m->length;
+      memcpy (dmk_header, m->dmk_header, DMK_HEADER_LENGTH);
+    }
+  pthread_mutex_unlock (& p->lock);
+  if (! m)
+    return (NULL);
+
+  mio = calloc (1, sizeof (member_io_t));
+  if (! mio)
+    return (NULL);
+  mio->pack = p;
+  mio->heads = (dmk_header [4] & DMK_FLAG_SS_MASK) ? 1 : 2;
+  mio->manifest = malloc (length);
+  if ((! mio->manifest) ||
+      (length != pread (p->fd, mio->manifest, length, offset)) ||
+      (RECORD_TRAILER_LENGTH != pread (p->fd, trailer, RECORD_TRAILER_LENGTH,
+				       offset + length)) ||
+      (dmk_hash (mio->manifest, length) != get_le64 (trailer)))
+    {
+      fprintf (stderr, "dmkpack: bad manifest for %s\n", name);
+      goto fail;
+    }
+
+  /* skip name and header, then index the per-track segment lists */
+  pos = mio->manifest + 2 + get_le16 (mio->manifest) + DMK_HEADER_LENGTH;
+  end = mio->manifest + length;
+  mio->track_count = get_le32 (pos);
+  pos += 4;
+  if (mio->track_count != header_track_count (dmk_header))
+    goto fail;
+  mio->track = calloc (mio->track_count, sizeof (uint8_t *));
+  if (! mio->track)
+    goto fail;
+  for (i = 0; i < mio->track_count; i++)
+    {
+      if (pos + 2 > end)
+	goto fail;
+      mio->track [i] = pos;
+      pos += 2 + get_le16 (pos) * SEGMENT_LENGTH;
+      if (pos > end)
+	goto fail;
+    }
+
+  h = dmk_open_io (& member_io, mio, dmk_header, ds, cylinders, dd);
+  if (! h)
+    goto fail;
+  return (h);
+
+ fail:
+  member_close (mio);
+  return (NULL);
+}
@@ -0,0 +1,109 @@
+/*
+ * libdmkpack - deduplicating archives of DMK disk images
+ *
+ * Copyright 2002 Eric Smith.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.  Note that permission is
+ * not granted to redistribute this program under the terms of any
+ * other version of the General Public License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111  USA
+ */
+
+#ifndef DMKLIB_LIBDMKPACK_H
+#define DMKLIB_LIBDMKPACK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A pack file is an append-only sequence of records.  Chunk records
+ * hold pieces of raw tracks, and are stored only once per distinct
+ * content hash.  Manifest records describe a member image as its DMK
+ * header plus, for each track, the list of chunks that make it up.
+ * Tracks are cut into chunks at sector data field boundaries, so
+ * identical sectors and gaps are shared between tracks and images.
+ */
+
+
+typedef struct dmkpack *dmkpack_handle;
+
+
+dmkpack_handle dmkpack_open (char *fn,
+			     int writable);  /* boolean */
+
+/*
+ * Open a pack file.  If writable is true, the file is created if it
+ * doesn't exist.  Records after the first incomplete or damaged one,
+ * as left at the end of the file by an interrupted update, are
+ * ignored, and discarded if writable is true.
+ */
+
+
+int dmkpack_close (dmkpack_handle p);
+
+
+int dmkpack_add_image (dmkpack_handle p,
+		       char *name,
+		       char *image_fn);
+
+/*
+ * Add a DMK image file to the pack as member name, replacing any
+ * earlier member of the same name.  Safe to call from several threads
+ * at once on the same pack.
+ */
+
+
+int dmkpack_member_count (dmkpack_handle p);
+
+char *dmkpack_member_name (dmkpack_handle p,
+			   int index);
+
+/*
+ * Members are numbered in the order they were first added.  The name
+ * belongs to the pack and stays valid until it is closed, even while
+ * other threads add images.
+ */
+
+
+dmk_handle dmkpack_open_image (dmkpack_handle p,
+			       char *name,
+			       int *ds,
+			       int *cylinders,
+			       int *dd);
+
+/*
+ * Open a member image read-only.  Tracks are reassembled from their
+ * chunks as they are seeked to.
+ */
+
+
+int dmkpack_read_header (dmkpack_handle p,
+			 char *name,
+			 uint8_t *dmk_header);
+
+/*
+ * Copy the 16-byte DMK header of a member image.
+ */
+
+
+void dmkpack_stats (dmkpack_handle p,
+		    long *chunk_count,
+		    long *stored_bytes,
+		    long *logical_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
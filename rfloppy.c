@@ -27,18 +27,22 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
-
-#include <linux/fd.h>
-#include <linux/fdreg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
 
+#include "dmk.h"
 #include "libdmk.h"
+#include "floppy.h"
 
 
 #define MAX_CYLINDERS 85
 #define MAX_HEADS      2
+#define MAX_MERGE      8
+#define MAX_DRIVES     4
 
 
 typedef enum {
@@ -50,15 +54,7 @@ typedef enum {
 int verbose = 0;
 
 
-/* rate codes are unfortunately NOT defined in fdreg.h */
-/* these rates are for MFM.  effective FM rates are half the MFM rates */
-#define FD_RATE_NOT_SET 255  /* flag value only, don't use in ioctl() */
-#define FD_RATE_250_KBPS 2
-#define FD_RATE_300_KBPS 1
-#define FD_RATE_500_KBPS 0
-
-/* 8272 command codes which are NOT defined in fdreg.h */
-#define FD_READ_TRACK 0x42
+#define FD_RATE_NOT_SET 255  /* flag value only, don't pass to the drive */
 
 
 typedef enum
@@ -76,12 +72,40 @@ typedef struct
   uint8_t size_code;
   uint8_t min_sector;
   uint8_t max_sector;
+
+  /* rotational model, used to read sectors in the order they pass
+     under the head */
+  bool timed;              /* id_angle is known */
+  float id_angle [256];    /* position of the end of each sector's ID, in
+			      revolutions after the first ID timed, or
+			      negative if not seen */
 } track_info_t;
 
 
+/* how far a capture has got, stored by its device thread and read by
+   the progress reporter */
+typedef struct
+{
+  int cylinder;         /* of the track being read */
+  int head;
+  int pass;
+  int tracks;           /* read so far, counting re-reads */
+  bool done;
+} progress_t;
+
+
+/* what has been captured, as recorded in the checkpoint file */
+typedef struct
+{
+  bool captured;        /* the track is in the image */
+  uint8_t good [32];    /* bitmap, by sector number, of the sectors read
+			   with good CRCs */
+} track_status_t;
+
+
 typedef struct
 {
-  int floppy_dev;
+  floppy_t floppy;
 
   image_type_t image_type;
   dmk_handle dmk_h;
@@ -97,9 +121,295 @@ typedef struct
 				but user can specify to autodetect all
 				cylinders. */
   track_info_t track_info [MAX_CYLINDERS * MAX_HEADS];
+
+  bool multi_sector;  /* read each track with one command */
+  int rpm;            /* of the drive, 0 if unknown */
+  density_t density_first;  /* to try when autodetecting */
+  double rev_time;    /* seconds per revolution, measured if possible */
+  double margin;      /* revolutions needed to issue a read in time to
+			 catch the next ID, learned from missed sectors */
+  double revolutions; /* total spent reading tracks */
+  int track_count;
+
+  char *image_fn;
+  struct pipeline *pipeline;  /* while reading the disk */
+
+  const char *tag;    /* prefixed to messages, to tell drives apart when
+			 several are read at once */
+  bool concurrent;    /* leave progress to the reporter */
+  progress_t progress;
+
+  int reread_passes;  /* over the sectors still bad after a capture */
+  bool vote;          /* rebuild bad sectors from all of their reads */
+  int merge_count;
+  dmk_handle merge_h [MAX_MERGE];  /* earlier captures of the same disk */
+  char *checkpoint_fn;
+  int checkpoint_fd;
+  track_status_t track_status [MAX_CYLINDERS * MAX_HEADS];
 } disk_info_t;
 
 
+/*
+ * Capture runs as a pipeline of three stages, the device, the encoder
+ * and the writer, each passing tracks to the next through a bounded
+ * single-producer single-consumer ring.  The ring itself is lock-free:
+ * each index is only stored by one side, and published with release
+ * ordering after the slot it covers.  The semaphores only put a stage
+ * to sleep while it has nothing to do.
+ */
+
+#define QUEUE_SIZE 8  /* tracks */
+
+
+typedef struct
+{
+  int cylinder;
+  int head;
+  track_info_t *track_info;
+  uint8_t *buf;  /* sectors, in numerical order */
+  uint8_t *raw;  /* DMK track in image file format */
+  bool reread;   /* the track is already in the image, and only the
+		    sectors flagged in read are to be replaced */
+  bool *read;    /* sectors newly read with good CRCs */
+  bool *seen;    /* sectors whose data field was read at all */
+  uint16_t *crc; /* to record after the data of sectors that are bad */
+  uint8_t *data_mark;  /* each sector's data address mark, 0 for 0xfb */
+  track_status_t status;  /* to checkpoint once the track is written */
+} track_job_t;
+
+
+typedef struct
+{
+  track_job_t *slot [QUEUE_SIZE];
+  unsigned int head;  /* next to take, stored only by the consumer */
+  unsigned int tail;  /* next to fill, stored only by the producer */
+  sem_t items;
+  sem_t space;
+  int max_depth;
+  int stalls;         /* times the producer found the queue full */
+} queue_t;
+
+
+typedef enum
+{
+  STAGE_DEVICE,
+  STAGE_ENCODER,
+  STAGE_WRITER,
+  STAGE_COUNT
+} stage_t;
+
+
+typedef struct pipeline
+{
+  disk_info_t *disk_info;
+  queue_t encode_q;
+  queue_t write_q;
+  int fd;          /* DMK image, for the writer */
+  int raw_length;  /* of a DMK track */
+  double busy [STAGE_COUNT];  /* seconds */
+} pipeline_t;
+
+
+bool queue_init (queue_t *q)
+{
+  memset (q, 0, sizeof (queue_t));
+  return ((sem_init (& q->items, 0, 0) == 0) &&
+	  (sem_init (& q->space, 0, QUEUE_SIZE) == 0));
+}
+
+
+void queue_free (queue_t *q)
+{
+  sem_destroy (& q->items);
+  sem_destroy (& q->space);
+}
+
+
+int queue_depth (queue_t *q)
+{
+  return (__atomic_load_n (& q->tail, __ATOMIC_ACQUIRE) -
+	  __atomic_load_n (& q->head, __ATOMIC_ACQUIRE));
+}
+
+
+/* a NULL job marks the end of the disk */
+void queue_put (queue_t *q, track_job_t *job)
+{
+  unsigned int tail = q->tail;
+  int depth;
+
+  if (sem_trywait (& q->space) != 0)
+    {
+      q->stalls++;
+      while (sem_wait (& q->space) != 0)
+	;
+    }
+  q->slot [tail % QUEUE_SIZE] = job;
+  __atomic_store_n (& q->tail, tail + 1, __ATOMIC_RELEASE);
+  depth = queue_depth (q);
+  if (depth > q->max_depth)
+    q->max_depth = depth;
+  sem_post (& q->items);
+}
+
+
+track_job_t *queue_take (queue_t *q)
+{
+  unsigned int head = q->head;
+  track_job_t *job;
+
+  while (sem_wait (& q->items) != 0)
+    ;
+  job = q->slot [head % QUEUE_SIZE];
+  __atomic_store_n (& q->head, head + 1, __ATOMIC_RELEASE);
+  sem_post (& q->space);
+  return (job);
+}
+
+
+double stage_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, & ts);
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+
+/*
+ * A checkpoint file (image.ckpt for image) lets a capture that dies be
+ * resumed.  It holds the disk geometry, then a record for every track
+ * of whether it is in the image and which of its sectors were read
+ * with good CRCs.  Records are written by the writer stage after the
+ * track itself.  The file is removed once every sector has been read.
+ */
+
+#define CHECKPOINT_EXT ".ckpt"
+#define CHECKPOINT_MAGIC "RFCKPT\0\1"
+
+#define CHECKPOINT_TRACK_INFO_LENGTH 6
+#define CHECKPOINT_HEADER_LENGTH (16 + (MAX_CYLINDERS * MAX_HEADS * \
+					CHECKPOINT_TRACK_INFO_LENGTH))
+#define CHECKPOINT_RECORD_LENGTH (1 + 32)
+
+
+bool checkpoint_create (disk_info_t *disk_info)
+{
+  uint8_t header [CHECKPOINT_HEADER_LENGTH];
+  uint8_t *p;
+  track_info_t *track_info;
+  int i;
+
+  memset (header, 0, sizeof (header));
+  memcpy (header, CHECKPOINT_MAGIC, 8);
+  header [8]  = disk_info->image_type;
+  header [9]  = disk_info->cylinder_count;
+  header [10] = disk_info->head_count;
+  header [11] = disk_info->double_step;
+  header [12] = disk_info->data_rate;
+  header [13] = disk_info->track_info_cylinders;
+  header [14] = MAX_CYLINDERS;
+  header [15] = MAX_HEADS;
+  for (i = 0; i < MAX_CYLINDERS * MAX_HEADS; i++)
+    {
+      track_info = & disk_info->track_info [i];
+      p = & header [16 + i * CHECKPOINT_TRACK_INFO_LENGTH];
+      p [0] = track_info->density;
+      p [1] = track_info->log_cylinder;
+      p [2] = track_info->log_head;
+      p [3] = track_info->size_code;
+      p [4] = track_info->min_sector;
+      p [5] = track_info->max_sector;
+    }
+
+  disk_info->checkpoint_fd = open (disk_info->checkpoint_fn,
+				   O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (disk_info->checkpoint_fd < 0)
+    goto fail;
+  if ((pwrite (disk_info->checkpoint_fd, header, sizeof (header), 0) !=
+       sizeof (header)) ||
+      (ftruncate (disk_info->checkpoint_fd,
+		  CHECKPOINT_HEADER_LENGTH + (MAX_CYLINDERS * MAX_HEADS *
+					      CHECKPOINT_RECORD_LENGTH)) != 0) ||
+      (fsync (disk_info->checkpoint_fd) != 0))
+    goto fail;
+  return (true);
+
+ fail:
+  perror (disk_info->checkpoint_fn);
+  if (disk_info->checkpoint_fd >= 0)
+    close (disk_info->checkpoint_fd);
+  disk_info->checkpoint_fd = -1;
+  return (false);
+}
+
+
+/*
+ * Returns 1 if the checkpoint was loaded, 0 if there isn't one, or -1
+ * on error.
+ */
+int checkpoint_load (disk_info_t *disk_info)
+{
+  uint8_t header [CHECKPOINT_HEADER_LENGTH];
+  uint8_t record [CHECKPOINT_RECORD_LENGTH];
+  uint8_t *p;
+  track_info_t *track_info;
+  track_status_t *status;
+  int i;
+
+  disk_info->checkpoint_fd = open (disk_info->checkpoint_fn, O_RDWR);
+  if (disk_info->checkpoint_fd < 0)
+    {
+      if (errno == ENOENT)
+	return (0);
+      perror (disk_info->checkpoint_fn);
+      return (-1);
+    }
+  if (pread (disk_info->checkpoint_fd, header, sizeof (header), 0) !=
+      sizeof (header))
+    goto fail;
+  if ((memcmp (header, CHECKPOINT_MAGIC, 8) != 0) ||
+      (header [14] != MAX_CYLINDERS) || (header [15] != MAX_HEADS))
+    goto fail;
+  if (header [8] != disk_info->image_type)
+    {
+      fprintf (stderr, "%scheckpoint is for a %s image\n", disk_info->tag,
+	       (header [8] == DMK_IMAGE) ? "DMK" : "raw");
+      return (-1);
+    }
+  disk_info->cylinder_count       = header [9];
+  disk_info->head_count           = header [10];
+  disk_info->double_step          = header [11];
+  disk_info->data_rate            = header [12];
+  disk_info->track_info_cylinders = header [13];
+  for (i = 0; i < MAX_CYLINDERS * MAX_HEADS; i++)
+    {
+      track_info = & disk_info->track_info [i];
+      p = & header [16 + i * CHECKPOINT_TRACK_INFO_LENGTH];
+      track_info->density      = p [0];
+      track_info->log_cylinder = p [1];
+      track_info->log_head     = p [2];
+      track_info->size_code    = p [3];
+      track_info->min_sector   = p [4];
+      track_info->max_sector   = p [5];
+
+      status = & disk_info->track_status [i];
+      if (pread (disk_info->checkpoint_fd, record, sizeof (record),
+		 CHECKPOINT_HEADER_LENGTH + i * sizeof (record)) !=
+	  sizeof (record))
+	goto fail;
+      status->captured = record [0];
+      memcpy (status->good, & record [1], sizeof (status->good));
+    }
+  return (1);
+
+ fail:
+  fprintf (stderr, "%s%s isn't a valid checkpoint\n",
+	   disk_info->tag, disk_info->checkpoint_fn);
+  return (-1);
+}
+
+
 void print_track_info (FILE *f, track_info_t *track_info)
 {
   fprintf (f, "%s density, %d byte sectors numbered from %d to %d\n",
@@ -109,144 +419,109 @@ void print_track_info (FILE *f, track_info_t *track_info)
 }
 
 
-void print_fdc_status (FILE *f, struct floppy_raw_cmd *cmd)
+track_info_t *track_info_for (disk_info_t *disk_info, int cylinder, int head)
+{
+  /* if we don't have track info on all cylinders, assume that
+     all the cylinders past the last one we have info for are the
+     same as that one. */
+  if (cylinder > (disk_info->track_info_cylinders - 1))
+    cylinder = disk_info->track_info_cylinders - 1;
+  return (& disk_info->track_info [cylinder * MAX_HEADS + head]);
+}
+
+
+int track_data_length (track_info_t *track_info)
+{
+  return (((track_info->max_sector - track_info->min_sector) + 1) *
+	  (128 << track_info->size_code));
+}
+
+
+bool sector_good (track_status_t *status, int sector)
+{
+  return ((status->good [sector >> 3] >> (sector & 7)) & 1);
+}
+
+
+int bad_sector_count (disk_info_t *disk_info, int cylinder, int head)
+{
+  track_info_t *track_info = track_info_for (disk_info, cylinder, head);
+  track_status_t *status = & disk_info->track_status [cylinder * MAX_HEADS + head];
+  int sector, count = 0;
+
+  for (sector = track_info->min_sector;
+       sector <= track_info->max_sector;
+       sector++)
+    count += ! (status->captured && sector_good (status, sector));
+  return (count);
+}
+
+
+void print_fdc_status (FILE *f, const char *tag, uint8_t *reply)
 {
   int i;
 
-  fprintf (f, "read ID status:");
+  fprintf (f, "%sread ID status:", tag);
   for (i = 0; i < 3; i++)
-    fprintf (f, " %02x", cmd->reply [i]);
+    fprintf (f, " %02x", reply [i]);
   fprintf (f, "\n");
 }
 
 
 bool reset_drive (disk_info_t *disk_info)
 {
-  int reset_now = FD_RESET_IF_NEEDED; /* FD_RESET_ALWAYS */
-  if (0 > ioctl (disk_info->floppy_dev, FDRESET, & reset_now))
+  if (! floppy_reset (disk_info->floppy))
     {
-      fprintf (stderr, "can't reset drive\n");
+      fprintf (stderr, "%scan't reset drive\n", disk_info->tag);
       return (false);
     }
   if (verbose >= 2)
-    fprintf (stderr, "floppy reset\n");
+    fprintf (stderr, "%sfloppy reset\n", disk_info->tag);
   return (true);
 }
 
 
 bool recalibrate (disk_info_t *disk_info)
 {
-  struct floppy_raw_cmd cmd;
-  int i = 0;
-
-  cmd.data = NULL;
-  cmd.length = 0;
-  cmd.rate = disk_info->data_rate;
-  cmd.flags = FD_RAW_INTR;
-  cmd.cmd [i++] = FD_RECALIBRATE;
-  cmd.cmd [i++] = 0;
-  cmd.cmd_count = i;
-  return (0 <= ioctl (disk_info->floppy_dev, FDRAWCMD, & cmd));
+  return (0 < floppy_recalibrate (disk_info->floppy, disk_info->data_rate));
 }
 
 
 bool seek (disk_info_t *disk_info, int cylinder)
 {
-  struct floppy_raw_cmd cmd;
-  int i = 0;
-
-  cmd.data = NULL;
-  cmd.length = 0;
-  cmd.rate = disk_info->data_rate;
-  cmd.flags = FD_RAW_INTR;
-  cmd.cmd[i++] = FD_SEEK;
-  cmd.cmd[i++] = 0;
-  cmd.cmd[i++] = cylinder << disk_info->double_step;
-  cmd.cmd_count = i;
-
-  return (0 <= ioctl (disk_info->floppy_dev, FDRAWCMD, & cmd));
-}
-
-
-bool fd_read_track (int floppy_dev, int cylinder, int head,
-		    int fm, int data_rate, int size_code, uint8_t *buf)
-{
-  struct floppy_raw_cmd cmd;
-  int i = 0;
-  uint8_t mask = 0x5f;
-  int sector_size = 128 << size_code;
-
-  if (fm)
-    mask &= ~0x40;
-
-  cmd.data = buf;
-  cmd.length = 128 << size_code;
-  cmd.rate = data_rate;
-  cmd.flags = FD_RAW_INTR | FD_RAW_READ;
-  cmd.cmd[i++] = FD_READ_TRACK & mask;
-  cmd.cmd[i++] = head ? 4 : 0;
-  cmd.cmd[i++] = cylinder; /* Cylinder value (to check with header) */
-  cmd.cmd[i++] = head ? 1 : 0; /* Head value (to check with header) */
-  cmd.cmd[i++] = 0;
-  cmd.cmd[i++] = size_code; /* 256 byte MFM sectors */
-  cmd.cmd[i++] = 0xff; /* last sector number on a track */
-  cmd.cmd[i++] = 14; /* gap length */
-  cmd.cmd[i++] = (sector_size < 255) ? sector_size : 0xff;
-  cmd.cmd_count=i;
-  return ((0 <= ioctl (floppy_dev, FDRAWCMD, & cmd)) &&
-	  ! (cmd.reply[0] & 0xC0));
+  return (0 < floppy_seek (disk_info->floppy, disk_info->data_rate,
+			   cylinder << disk_info->double_step));
 }
 
 
-typedef struct
-{
-  int cylinder;
-  int head;
-  int sector;
-  int size_code;
-} id_info_t;
+typedef floppy_id_t id_info_t;
 
 
 int read_id (disk_info_t *disk_info, int fm, int seek_head, id_info_t *id_info)
 {
-  struct floppy_raw_cmd cmd;
-  uint8_t mask = 0x5f;
-  int i = 0;
-
-  if (fm)
-    mask &= ~0x40;
-
-  cmd.data = NULL;   /* No data to transfer */
-  cmd.length = 0;
-  cmd.rate = disk_info->data_rate;
-  cmd.flags = FD_RAW_INTR;
-  cmd.cmd[i++] = FD_READID & mask;
-  cmd.cmd[i++] = seek_head ? 4 : 0;
-  cmd.cmd_count = i;
+  int status;
 
-  if (0 > ioctl (disk_info->floppy_dev, FDRAWCMD, & cmd))
+  status = floppy_read_id (disk_info->floppy, disk_info->data_rate, fm,
+			   seek_head, id_info);
+  if (status < 0)
     {
       if (verbose >= 2)
 	{
-	  perror ("ioctl FDRAWCMD in read_id");
-	  fprintf (stderr, "error issuing FDRAWCMD ioctl\n");
+	  perror ("floppy_read_id");
+	  fprintf (stderr, "%serror issuing read ID command\n", disk_info->tag);
 	}
       reset_drive (disk_info);
       return (false);
     }
-  
-  if (cmd.reply [0] & 0xc0)
+
+  if (! status)
     {
       if (verbose >= 2)
-	print_fdc_status (stderr, & cmd);
+	print_fdc_status (stderr, disk_info->tag,
+			  floppy_status (disk_info->floppy));
       return (false);
     }
 
-  id_info->cylinder  = cmd.reply [3];
-  id_info->head      = cmd.reply [4];
-  id_info->sector    = cmd.reply [5];
-  id_info->size_code = cmd.reply [6];
-
   return (true);
 }
 
@@ -279,41 +554,43 @@ bool check_interleave_ids (track_info_t *track_info, id_info_t *id_info)
 				   
 
 void print_interleave (FILE *f,
+		       const char *tag,
 		       int cylinder,
 		       int head,
 		       track_info_t *track_info,
 		       id_info_t *id_info)
 {
   int i;
-  fprintf (f, "cyl %d head %d sector order:", cylinder, head);
+  fprintf (f, "%scyl %d head %d sector order:", tag, cylinder, head);
   for (i = 0; i <= track_info->max_sector - track_info->min_sector; i++)
     fprintf (f, " %d", id_info [i].sector);
   fprintf (f, "\n");
 }
 
 
-bool check_interleave (int cylinder,
+/*
+ * If the IDs read begin with one full revolution, print the physical
+ * sector order starting with the lowest numbered sector.
+ */
+bool check_interleave (const char *tag,
+		       int cylinder,
 		       int head,
 		       track_info_t *track_info,
 		       id_info_t *id_info, 
 		       int id_count)
 {
-  int i;
-  int status;
+  id_info_t order [256];
+  int count = (track_info->max_sector - track_info->min_sector) + 1;
+  int i, start;
 
-  for (i = 0;
-       i < id_count - ((track_info->max_sector - track_info->min_sector) + 1);
-       i++)
-    if (id_info [i].sector == track_info->min_sector)
-      {
-	status = check_interleave_ids (track_info, & id_info [i]);
-	if (status)
-	  {
-	    print_interleave (stdout, cylinder, head, track_info, & id_info [i]);
-	    return (true);
-	  }
-      }
-  return (false);
+  if ((id_count < count) || ! check_interleave_ids (track_info, id_info))
+    return (false);
+  for (start = 0; id_info [start].sector != track_info->min_sector; start++)
+    ;
+  for (i = 0; i < count; i++)
+    order [i] = id_info [(start + i) % count];
+  print_interleave (stdout, tag, cylinder, head, track_info, order);
+  return (true);
 }
 
 
@@ -341,7 +618,8 @@ void find_min_max_sector (track_info_t *track_info,
  * make sure all sectors have the same cylinder, head, and size,
  * and determine the minimum and maximum sector numbers
  */
-bool check_id_match (track_info_t *track_info,
+bool check_id_match (const char *tag,
+		     track_info_t *track_info,
 		     id_info_t *id_info,
 		     int id_count)
 {
@@ -352,17 +630,17 @@ bool check_id_match (track_info_t *track_info,
     {
       if (id_info [i].cylinder != id_info [0].cylinder)
 	{
-	  fprintf (stderr, "track contains a mix of cylinder numbers\n");
+	  fprintf (stderr, "%strack contains a mix of cylinder numbers\n", tag);
 	  status = 0;
 	}
       if (id_info [i].head != id_info [0].head)
 	{
-	  fprintf (stderr, "track contains a mix of head numbers\n");
+	  fprintf (stderr, "%strack contains a mix of head numbers\n", tag);
 	  status = 0;
 	}
       if (id_info [i].size_code != id_info [0].size_code)
 	{
-	  fprintf (stderr, "track contains a mix of sector sizes\n");
+	  fprintf (stderr, "%strack contains a mix of sector sizes\n", tag);
 	  status = 0;
 	}
       if (id_info [i].sector < track_info->min_sector)
@@ -401,6 +679,90 @@ bool all_sectors_present (track_info_t *track_info,
 #define MAX_ID_READ 100
 
 
+/* the command to read a sector must be issued before its ID starts to
+   pass under the head; the margin allowed for that starts at about the
+   length of an ID field and grows in steps of this much, in revolutions,
+   each time a sector is missed */
+#define MARGIN_STEP 0.005
+
+
+/*
+ * Record the rotational position of each sector's ID from the times
+ * at which consecutive read IDs completed.  A sector seen on several
+ * revolutions also gives the actual revolution time of the drive,
+ * which over a few revolutions is more accurate than its nominal rpm.
+ */
+void time_ids (disk_info_t *disk_info,
+	       track_info_t *track_info,
+	       id_info_t *id_info,
+	       double *id_time,
+	       int id_count)
+{
+  double first_time [256];
+  double revs;
+  int best_revs = 0;
+  int i, sector;
+
+  if (! disk_info->rev_time)
+    return;
+  for (i = 0; i < 256; i++)
+    track_info->id_angle [i] = -1.0;
+  for (i = 0; i < id_count; i++)
+    {
+      sector = id_info [i].sector;
+      if (track_info->id_angle [sector] < 0)
+	{
+	  first_time [sector] = id_time [i];
+	  track_info->id_angle [sector] = 0.0;
+	  continue;
+	}
+      revs = (id_time [i] - first_time [sector]) / disk_info->rev_time + 0.5;
+      if ((int) revs > best_revs)
+	{
+	  best_revs = (int) revs;
+	  disk_info->rev_time = (id_time [i] - first_time [sector]) / best_revs;
+	}
+    }
+
+  for (sector = 0; sector < 256; sector++)
+    if (track_info->id_angle [sector] >= 0)
+      {
+	revs = (first_time [sector] - id_time [0]) / disk_info->rev_time;
+	track_info->id_angle [sector] = revs - (int) revs;
+      }
+  track_info->timed = true;
+}
+
+
+/*
+ * Learn the rotational model of a track whose geometry was given
+ * rather than detected, by reading IDs for a revolution.
+ */
+void learn_track_timing (disk_info_t *disk_info,
+			 int head,
+			 track_info_t *track_info)
+{
+  id_info_t id_info [MAX_ID_READ];
+  double id_time [MAX_ID_READ];
+  bool seen [256];
+  int i;
+
+  memset (seen, 0, sizeof (seen));
+  for (i = 0; i < MAX_ID_READ; i++)
+    {
+      if (! read_id (disk_info, track_info->density == DENSITY_FM, head,
+		     & id_info [i]))
+	return;
+      id_time [i] = floppy_time (disk_info->floppy);
+      if (seen [id_info [i].sector])
+	break;
+      seen [id_info [i].sector] = true;
+    }
+  time_ids (disk_info, track_info, id_info, id_time,
+	    (i < MAX_ID_READ) ? i + 1 : i);
+}
+
+
 #define AUTO_TRY_DD 0x01
 #define AUTO_TRY_SD 0x02
 
@@ -408,90 +770,149 @@ bool all_sectors_present (track_info_t *track_info,
 #define AUTO_TRY_DS 0x08
 
 
+/*
+ * Check with a single read ID whether a track is formatted like the
+ * same side of the previous cylinder, as most are.  Returns 1 if so, 0
+ * if it has IDs of the same density that don't match, or -1 if it has
+ * no IDs of that density.
+ */
+int verify_track_hint (disk_info_t *disk_info,
+		       int head,
+		       track_info_t *hint,
+		       track_info_t *track_info)
+{
+  id_info_t id;
+
+  if (! read_id (disk_info, hint->density, head, & id))
+    return (-1);
+  if ((id.cylinder != hint->log_cylinder + 1) ||
+      (id.head != hint->log_head) ||
+      (id.size_code != hint->size_code) ||
+      (id.sector < hint->min_sector) ||
+      (id.sector > hint->max_sector))
+    return (0);
+  *track_info = *hint;
+  track_info->log_cylinder = id.cylinder;
+  return (1);
+}
+
+
 int try_track (int cylinder, int head,
 	       disk_info_t *disk_info,
 	       int auto_flags,
+	       track_info_t *hint,
 	       track_info_t *track_info)
 {
-  int i;
+  int i, k;
   density_t density;
-  int density_present [2];
+  density_t first = disk_info->density_first;
+  bool found = false;
+  int hint_status = 0;
   id_info_t id_info [MAX_ID_READ];
+  double id_time [MAX_ID_READ];
+  bool seen [256];
 
   if (! seek (disk_info, cylinder))
     {
-      fprintf (stderr, "error seeking to cylinder %d\n", cylinder);
+      fprintf (stderr, "%serror seeking to cylinder %d\n",
+	       disk_info->tag, cylinder);
       exit (2);
     }
 
-  for (density = DENSITY_MFM; density <= DENSITY_FM; density++)
+  if (hint)
+    {
+      hint_status = verify_track_hint (disk_info, head, hint, track_info);
+      if (hint_status > 0)
+	{
+	  if (verbose >= 2)
+	    printf ("%scyl %d head %d: same format as previous cylinder\n",
+		    disk_info->tag, cylinder, head);
+	  return (true);
+	}
+      first = hint->density;
+      if (hint_status < 0)
+	first = ! first;  /* already known not to be there */
+    }
+
+  /* try the density found last first, since a failed read ID takes two
+     revolutions to time out */
+  for (k = 0; (k < 2) && ! found; k++)
     {
-      density_present [density] = 0;
+      density = k ? ! first : first;
       if (! (auto_flags & ((density == DENSITY_FM) ? AUTO_TRY_SD : AUTO_TRY_DD)))
 	continue;
+      if (k && (hint_status < 0))
+	continue;
       if (verbose >= 2)
 	{
-	  fprintf (stderr, "checking for %s density\n",
+	  fprintf (stderr, "%schecking for %s density\n", disk_info->tag,
 		   (density == DENSITY_FM) ? "single" : "double");
 	  fflush (stderr);
 	}
-      density_present [density] = read_id (disk_info, density, head,
-					   & id_info [0]);
+      found = read_id (disk_info, density, head, & id_info [0]);
     }
-  if (density_present [DENSITY_MFM] && density_present [DENSITY_FM])
+  if (! found)
     {
-      fprintf (stderr, "both FM and MFM data on cylinder %d head %d\n",
-	       cylinder, head);
+      fprintf (stderr, "%sneither FM nor MFM data on cylinder %d head %d\n",
+	       disk_info->tag, cylinder, head);
       return (false);
     }
+  track_info->density = density;
+  disk_info->density_first = density;
 
-  if (density_present [DENSITY_MFM])
-    track_info->density = DENSITY_MFM;
-  else if (density_present [DENSITY_FM])
-    track_info->density = DENSITY_FM;
-  else
+  /* read IDs until the sequence wraps round with every sector seen */
+  memset (seen, 0, sizeof (seen));
+  for (i = 0; i < MAX_ID_READ; i++)
     {
-      fprintf (stderr, "neither FM nor MFM data on cylinder %d head %d\n",
-	       cylinder, head);
-      return (false);
+      if (! read_id (disk_info, track_info->density, head, & id_info [i]))
+	{
+	  fprintf (stderr, "%serror reading ID address mark on cylinder %d head %d\n",
+		   disk_info->tag, cylinder, head);
+	  return (false);
+	}
+      id_time [i] = floppy_time (disk_info->floppy);
+      if (seen [id_info [i].sector])
+	{
+	  find_min_max_sector (track_info, id_info, i + 1);
+	  if (all_sectors_present (track_info, id_info, i + 1))
+	    {
+	      i++;
+	      break;
+	    }
+	}
+      seen [id_info [i].sector] = true;
     }
 
-  for (i = 0; i < MAX_ID_READ; i++)
-    if (! read_id (disk_info, track_info->density, head, & id_info [i]))
-      {
-	fprintf (stderr, "error reading ID address mark on cylinder %d head %d\n",
-		 cylinder, head);
-	return (false);
-      }
-
   track_info->size_code = id_info [0].size_code;
 
   /* find the minimum and maximum sector numbers */
-  find_min_max_sector (track_info, id_info, MAX_ID_READ);
+  find_min_max_sector (track_info, id_info, i);
 
   /* make sure all the sector IDs have the same cylinder, head, and size
      code */
-  if (! check_id_match (track_info, id_info, MAX_ID_READ))
+  if (! check_id_match (disk_info->tag, track_info, id_info, i))
     return (false);
 
   /* now make sure all sector numbers from min_sector to max_sector are
      represented */
-  if (! all_sectors_present (track_info, id_info, MAX_ID_READ))
+  if (! all_sectors_present (track_info, id_info, i))
     {
-      fprintf (stderr, "track contains discontiguous sector numbers\n");
+      fprintf (stderr, "%strack contains discontiguous sector numbers\n",
+	       disk_info->tag);
       return (false);
     }
 
   if (verbose >= 2)
     {
-      printf ("ID fields are for cylinder %d head %d\n", id_info [0].cylinder,
-	      id_info [0].head);
+      printf ("%sID fields are for cylinder %d head %d\n",
+	      disk_info->tag, id_info [0].cylinder, id_info [0].head);
     }
 
   track_info->log_cylinder = id_info [0].cylinder;
   track_info->log_head = id_info [0].head;
 
-  check_interleave (cylinder, head, track_info, id_info, MAX_ID_READ);
+  check_interleave (disk_info->tag, cylinder, head, track_info, id_info, i);
+  time_ids (disk_info, track_info, id_info, id_time, i);
 
   return (true);
 }
@@ -503,6 +924,7 @@ int try_disk (disk_info_t *disk_info, int auto_flags)
   int max_head;
   int i;
   int result [MAX_CYLINDERS * MAX_HEADS];
+  track_info_t *hint;
 
   if (auto_flags & AUTO_TRY_DS)
     max_head = 2;
@@ -512,15 +934,26 @@ int try_disk (disk_info_t *disk_info, int auto_flags)
     for (head = 0; head < max_head; head++)
       {
 	i = cylinder * MAX_HEADS + head;
+	hint = NULL;
+	if (cylinder && result [i - MAX_HEADS])
+	  hint = & disk_info->track_info [i - MAX_HEADS];
+	else if (cylinder && head)
+	  {
+	    /* nothing on the second side of the previous cylinder */
+	    result [i] = false;
+	    continue;
+	  }
 	result [i] = try_track (cylinder, head,	disk_info, auto_flags,
-				& disk_info->track_info [i]);
+				hint, & disk_info->track_info [i]);
 	if (verbose && ! result [i])
-	  printf ("no data on cylinder %d, head %d\n", cylinder, head);
+	  printf ("%sno data on cylinder %d, head %d\n",
+		  disk_info->tag, cylinder, head);
       }
 
   if (! result [0])
     {
-      fprintf (stderr, "can't find data on cylinder 0, head 0\n");
+      fprintf (stderr, "%scan't find data on cylinder 0, head 0\n",
+	       disk_info->tag);
       return (false);
     }
 
@@ -538,42 +971,31 @@ bool read_sector (disk_info_t *disk_info,
 		  track_info_t *track_info,
 		  uint8_t *buf)
 {
-  struct floppy_raw_cmd cmd;
-  int i = 0;
-  uint8_t mask = 0x5f;
-  int sector_length = 128 << track_info->size_code;
+  floppy_id_t id;
+  int status;
+
+  id.cylinder = cylinder; /* Cylinder value (to check with header) */
+  id.head = track_info->log_head;  /* Head value (to check with header) */
+  id.sector = sector;
+  id.size_code = track_info->size_code;
 
-  if (track_info->density == DENSITY_FM)
-    mask &= ~0x40;
-
-  cmd.data = buf;
-  cmd.length = sector_length;
-  cmd.rate = disk_info->data_rate;
-  cmd.flags = FD_RAW_INTR | FD_RAW_READ;
-  cmd.cmd[i++] = FD_READ & mask;
-  cmd.cmd[i++] = head ? 4 : 0;
-  cmd.cmd[i++] = cylinder; /* Cylinder value (to check with header) */
-  cmd.cmd[i++] = track_info->log_head;  /* Head value (to check with header) */
-  cmd.cmd[i++] = sector;
-  cmd.cmd[i++] = track_info->size_code; /* sector length */
-  cmd.cmd[i++] = track_info->max_sector; /* last sector number on a track */
-  cmd.cmd[i++] = 14; /* gap length */
-  cmd.cmd[i++] = (sector_length < 255) ? sector_length : 0xff;
-  cmd.cmd_count=i;
-
-  if (0 > ioctl (disk_info->floppy_dev, FDRAWCMD, & cmd))
+  status = floppy_read_sector (disk_info->floppy, disk_info->data_rate,
+			       track_info->density == DENSITY_FM, head,
+			       & id, track_info->max_sector, buf);
+  if (status < 0)
     {
       if (verbose >= 2)
 	{
-	  perror ("ioctl FDRAWCMD in read_sector");
+	  perror ("floppy_read_sector");
 	}
       reset_drive (disk_info);
       return (false);
     }
 
-  if (cmd.reply [0] & 0xc0)
+  if (! status)
     {
-      print_fdc_status (stderr, & cmd);
+      print_fdc_status (stderr, disk_info->tag,
+			floppy_status (disk_info->floppy));
       return (false);
     }
 
@@ -587,8 +1009,11 @@ char *progname;
 void usage (void)
 {
   fprintf (stderr, "usage:\n"
-	   "%s [options] <image-file>\n"
-	   "    -d <drive>            drive (default /dev/fd0)\n"
+	   "%s [options] <image-file>...\n"
+	   "    -d <drive>            drive (default /dev/fd0), or emu:<image.dmk>\n"
+	   "                          to read an image through an emulated drive;\n"
+	   "                          repeat to read up to %d drives at once, each\n"
+	   "                          to the image file in the same position\n"
 	   "    -raw                  output raw image\n"
 	   "    -dmk                  output DMK image\n"
 	   "    -aa                   autodetect all cylinders\n"
@@ -602,8 +1027,17 @@ void usage (void)
 	   "    -cc <cylinder-count>  cylinder count (default 77)\n"
 	   "    -dc                   double-step between cylinders, used to read 35 or 40\n"
 	   "                          cylinder disks in an 80 cylinder drive\n"
-	   "    -mr <retry-count>     maximum retries (default 5)\n",
-	   progname);
+	   "    -mr <retry-count>     maximum retries (default 5)\n"
+	   "    -ms                   read each track with a multi-sector command,\n"
+	   "                          retrying failed sectors one at a time\n"
+	   "    -rp <passes>          re-read passes over sectors still bad (default 0)\n"
+	   "    -resume               continue an interrupted capture from its\n"
+	   "                          checkpoint, retrying only sectors still bad\n"
+	   "    -vote                 recover bad sectors by voting across all of\n"
+	   "                          their reads until one matches its CRC\n"
+	   "    -merge <image-file>   take sectors from an earlier DMK capture of the\n"
+	   "                          same disk, and with -vote its bad reads too\n",
+	   progname, MAX_DRIVES);
   fprintf (stderr, "If no disk characteristics are specified, the program will attempt\n"
 	   "to automatically determine them.\n");
   fprintf (stderr, "The data rate for the -dr option should specified for double density.  When\n"
@@ -650,178 +1084,985 @@ bool dmk_image_seek_and_format (disk_info_t *disk_info,
 }
 
 
-void read_track (disk_info_t *disk_info,
-		 int cylinder,
-		 int head,
-		 track_info_t *track_info)
+/*
+ * A sector read with errors is written with the CRC given by crc.
+ * data_mark is the data address mark to write, 0 for 0xfb.
+ */
+void write_sector (disk_info_t *disk_info,
+		   int cylinder,
+		   int head,
+		   int sector,
+		   track_info_t *track_info,
+		   uint8_t *buf,
+		   uint8_t data_mark,
+		   uint16_t *crc)
 {
-  int retry_count;
-  bool status;
-  int sector;
   sector_info_t sector_info;
-  uint8_t buf [1024];
+  int status;
 
-  if (disk_info->image_type == DMK_IMAGE)
+  sector_info.cylinder  = cylinder;
+  sector_info.head      = head;
+  sector_info.sector    = sector;
+  sector_info.size_code = track_info->size_code;
+  sector_info.mode      = (track_info->density == DENSITY_FM) ? DMK_FM : DMK_MFM;
+  sector_info.data_mark = data_mark ? data_mark : 0xfb;
+  if (crc)
+    status = dmk_write_sector_with_crc (disk_info->dmk_h, & sector_info,
+					buf, *crc);
+  else
+    status = dmk_write_sector (disk_info->dmk_h, & sector_info, buf);
+  if (! status)
     {
-      if (! dmk_image_seek_and_format (disk_info, track_info, cylinder, head))
-	{
-	  fprintf (stderr, "error seeking or formatting cyl %d head %d in DMK image\n",
-		   cylinder, head);
-	  exit (2);
-	}
+      fprintf (stderr, "%serror writing sector %d/%d/%d to DMK image file\n",
+	       disk_info->tag, cylinder, head, sector);
+      /* exit (2); */
     }
+}
+
+
+/*
+ * Read the whole track with as few multi-sector commands as possible.
+ * Each command runs until a sector fails, and the next one starts with
+ * the sector after it, so every sector is attempted once in what is
+ * normally a single revolution.
+ */
+void read_track_multi (disk_info_t *disk_info,
+		       int cylinder,
+		       int head,
+		       track_info_t *track_info,
+		       uint8_t *buf,
+		       bool *good,
+		       bool *seen)
+{
+  int sector_length = 128 << track_info->size_code;
+  floppy_id_t id;
+  int sector;
+  int status, done, i;
 
-  if (verbose == 1)
+  for (sector = track_info->min_sector;
+       sector <= track_info->max_sector;
+       sector += done + 1)
     {
-      printf ("%02d %d\r", cylinder, head);
-      fflush (stdout);
+      id.cylinder = cylinder;
+      id.head = track_info->log_head;
+      id.sector = sector;
+      id.size_code = track_info->size_code;
+      done = 0;
+      status = floppy_read_sectors (disk_info->floppy, disk_info->data_rate,
+				    track_info->density == DENSITY_FM, head,
+				    & id, track_info->max_sector,
+				    (track_info->max_sector - sector) + 1,
+				    buf + (sector - track_info->min_sector) * sector_length,
+				    & done);
+      for (i = 0; i < done; i++)
+	good [(sector - track_info->min_sector) + i] = true;
+      if (status > 0)
+	break;
+      if (status < 0)
+	reset_drive (disk_info);
+      else
+	{
+	  if (floppy_status (disk_info->floppy) [2] & ST2_DATA_ERROR)
+	    seen [(sector - track_info->min_sector) + done] = true;
+	  if (verbose >= 2)
+	    print_fdc_status (stderr, disk_info->tag,
+			      floppy_status (disk_info->floppy));
+	}
     }
+}
+
+
+/*
+ * Pick the sector still to be read whose ID will be the first to pass
+ * under the head, allowing the time needed to issue the command, given
+ * the head's current position in revolutions from the track's first
+ * timed ID.  Failed sectors stay eligible while they have tries left,
+ * so a retry goes to whichever of them comes round first.  Returns -1
+ * if there is nothing left to read.
+ */
+int next_sector (disk_info_t *disk_info,
+		 track_info_t *track_info,
+		 int *tries,
+		 double head_angle,
+		 double *wait)
+{
+  int sector, best = -1;
+  double start = head_angle + disk_info->margin;
+  double w;
+
   for (sector = track_info->min_sector;
        sector <= track_info->max_sector;
        sector++)
     {
-      if (verbose == 2)
+      if (! tries [sector - track_info->min_sector])
+	continue;
+      w = track_info->id_angle [sector] - start;
+      if (track_info->id_angle [sector] < 0)
+	w = 1.0;  /* never seen, try it last */
+      else
+	w -= (int) w - (w < 0);  /* to 0..1 */
+      w += disk_info->margin;
+      if ((best < 0) || (w < *wait))
 	{
-	  printf ("%02d %d %02d\r", cylinder, head, sector);
-	  fflush (stdout);
+	  best = sector;
+	  *wait = w;
 	}
-      else if (verbose == 3)
+    }
+  return (best);
+}
+
+
+/*
+ * In recovery mode every read of a bad sector is kept, with the CRC
+ * recorded after it, and the reads are voted on byte by byte.  Where
+ * they disagree, the less popular values are tried as well, least
+ * certain bytes first, until the data matches the CRC.
+ */
+
+#define VOTE_MAX_CANDIDATES 3     /* values tried for each byte */
+#define VOTE_MAX_TRIES      4096  /* reconstructions checked per vote */
+
+
+typedef struct
+{
+  int count;
+  uint8_t *reads;  /* count of sector length + 2 bytes, the CRC last */
+  uint8_t data_mark;  /* that the CRC matched with, once it has */
+} sector_votes_t;
+
+
+void add_vote (sector_votes_t *votes, int length, uint8_t *data, uint16_t crc)
+{
+  uint8_t *p;
+
+  votes->reads = realloc (votes->reads, (votes->count + 1) * (length + 2));
+  if (! votes->reads)
+    {
+      fprintf (stderr, "out of memory\n");
+      exit (2);
+    }
+  p = votes->reads + votes->count++ * (length + 2);
+  memcpy (p, data, length);
+  p [length] = crc >> 8;
+  p [length + 1] = crc & 0xff;
+}
+
+
+/* the CRC may cover any of the four data marks, normal data first */
+bool vote_crc_ok (sector_info_t *sector_info, uint8_t *field, int length)
+{
+  uint16_t crc = (field [length] << 8) | field [length + 1];
+  int mark;
+
+  for (mark = 0xfb; mark >= 0xf8; mark--)
+    {
+      sector_info->data_mark = mark;
+      if (dmk_data_crc (sector_info, field) == crc)
+	return (true);
+    }
+  return (false);
+}
+
+
+/*
+ * Vote on the reads of a sector.  Returns true, with the data in buf
+ * and the data address mark it matched with in votes->data_mark, if a
+ * reconstruction matching its CRC was found; otherwise buf and *crc
+ * get the majority of each byte.
+ */
+bool vote_sector (sector_votes_t *votes,
+		  int cylinder,
+		  int head,
+		  int sector,
+		  track_info_t *track_info,
+		  uint8_t *buf,
+		  uint16_t *crc)
+{
+  int length = 128 << track_info->size_code;
+  int field_length = length + 2;
+  sector_info_t sector_info;
+  uint8_t (*candidate) [VOTE_MAX_CANDIDATES];
+  uint8_t *candidates, *margin, *field;
+  int *uncertain, *choice;
+  int uncertain_count = 0, tries = 1;
+  int count [VOTE_MAX_CANDIDATES];
+  int pos, i, j, k, t;
+  uint8_t v;
+  bool ok = false;
+
+  candidate = malloc (field_length * sizeof (*candidate));
+  candidates = malloc (field_length);
+  margin = malloc (field_length);
+  field = malloc (field_length);
+  uncertain = malloc (field_length * sizeof (int));
+  choice = calloc (field_length, sizeof (int));
+  if ((! candidate) || (! candidates) || (! margin) || (! field) ||
+      (! uncertain) || (! choice))
+    {
+      fprintf (stderr, "out of memory\n");
+      exit (2);
+    }
+
+  /* the most common values of each byte, most common first */
+  for (pos = 0; pos < field_length; pos++)
+    {
+      candidates [pos] = 0;
+      for (i = 0; i < votes->count; i++)
+	{
+	  v = votes->reads [i * field_length + pos];
+	  for (j = 0; (j < candidates [pos]) && (candidate [pos][j] != v); j++)
+	    ;
+	  if (j < candidates [pos])
+	    count [j]++;
+	  else if (j < VOTE_MAX_CANDIDATES)
+	    {
+	      candidate [pos][j] = v;
+	      count [j] = 1;
+	      candidates [pos]++;
+	    }
+	  /* keep them in order of count */
+	  for (k = (j < candidates [pos]) ? j : candidates [pos] - 1;
+	       (k > 0) && (count [k] > count [k - 1]);
+	       k--)
+	    {
+	      t = count [k];  count [k] = count [k - 1];  count [k - 1] = t;
+	      v = candidate [pos][k];
+	      candidate [pos][k] = candidate [pos][k - 1];
+	      candidate [pos][k - 1] = v;
+	    }
+	}
+      margin [pos] = (candidates [pos] > 1) ? count [0] - count [1] : 255;
+      if (candidates [pos] > 1)
+	uncertain [uncertain_count++] = pos;
+    }
+
+  /* try the alternatives for the least certain bytes that fit in the
+     budget */
+  for (i = 1; i < uncertain_count; i++)
+    for (j = i; (j > 0) && (margin [uncertain [j]] < margin [uncertain [j - 1]]); j--)
+      {
+	t = uncertain [j];  uncertain [j] = uncertain [j - 1];  uncertain [j - 1] = t;
+      }
+  for (i = 0;
+       (i < uncertain_count) &&
+	 (tries * candidates [uncertain [i]] <= VOTE_MAX_TRIES);
+       i++)
+    tries *= candidates [uncertain [i]];
+  uncertain_count = i;
+
+  sector_info.cylinder  = cylinder;
+  sector_info.head      = head;
+  sector_info.sector    = sector;
+  sector_info.size_code = track_info->size_code;
+  sector_info.mode      = (track_info->density == DENSITY_FM) ? DMK_FM : DMK_MFM;
+  for (t = 0; t < tries; t++)
+    {
+      for (pos = 0; pos < field_length; pos++)
+	field [pos] = candidate [pos][0];
+      for (i = 0; i < uncertain_count; i++)
+	field [uncertain [i]] = candidate [uncertain [i]][choice [uncertain [i]]];
+      if (vote_crc_ok (& sector_info, field, length))
+	{
+	  ok = true;
+	  votes->data_mark = sector_info.data_mark;
+	  break;
+	}
+      /* next combination */
+      for (i = 0; i < uncertain_count; i++)
+	{
+	  if (++choice [uncertain [i]] < candidates [uncertain [i]])
+	    break;
+	  choice [uncertain [i]] = 0;
+	}
+    }
+
+  if (! ok)
+    for (pos = 0; pos < field_length; pos++)
+      field [pos] = candidate [pos][0];
+  memcpy (buf, field, length);
+  *crc = (field [length] << 8) | field [length + 1];
+
+  free (choice);
+  free (uncertain);
+  free (field);
+  free (margin);
+  free (candidates);
+  free (candidate);
+  return (ok);
+}
+
+
+/*
+ * Read a sector with its CRC, keeping the read for the vote if it's
+ * bad.  Returns true once the sector's data is known.
+ */
+bool read_sector_vote (disk_info_t *disk_info,
+		       int cylinder, int head, int sector,
+		       track_info_t *track_info,
+		       sector_votes_t *votes,
+		       uint8_t *buf)
+{
+  int length = 128 << track_info->size_code;
+  floppy_id_t id;
+  uint16_t crc;
+  int status;
+
+  id.cylinder = cylinder;
+  id.head = track_info->log_head;
+  id.sector = sector;
+  id.size_code = track_info->size_code;
+
+  status = floppy_read_sector_crc (disk_info->floppy, disk_info->data_rate,
+				   track_info->density == DENSITY_FM, head,
+				   & id, buf, & crc);
+  if (status < 0)
+    {
+      if (verbose >= 2)
+	perror ("floppy_read_sector_crc");
+      reset_drive (disk_info);
+      return (false);
+    }
+  if (! status)
+    {
+      print_fdc_status (stderr, disk_info->tag,
+			floppy_status (disk_info->floppy));
+      return (false);
+    }
+
+  /* a good read is a vote of one */
+  add_vote (votes, length, buf, crc);
+  if (vote_sector (votes, cylinder, head, sector, track_info, buf, & crc))
+    {
+      if ((verbose >= 2) && (votes->count > 1))
+	printf ("%scyl %d head %d sect %d recovered from %d reads\n",
+		disk_info->tag, cylinder, head, sector, votes->count);
+      return (true);
+    }
+  return (false);
+}
+
+
+/*
+ * Read a track into buf, its sectors in numerical order, for the
+ * encoder stage to turn into the image.  Sectors already flagged in
+ * good aren't read again; on return good flags every sector that has
+ * been read correctly, and seen those whose data was read with errors.
+ * If votes isn't NULL, bad sectors are recovered by voting (see
+ * read_sector_vote).
+ */
+void read_track (disk_info_t *disk_info,
+		 int cylinder,
+		 int head,
+		 track_info_t *track_info,
+		 uint8_t *buf,
+		 bool *good,
+		 bool *seen,
+		 sector_votes_t *votes)
+{
+  bool status;
+  int sector;
+  int sector_count = (track_info->max_sector - track_info->min_sector) + 1;
+  int sector_length = 128 << track_info->size_code;
+  bool partial = false;
+  int tries [256];
+  id_info_t id;
+  bool synced;
+  int late = 0;
+  double sync_time = 0.0, sync_angle = 0.0, now, wait = 0.0;
+  double start_time, revolutions;
+
+  for (sector = 0; sector < sector_count; sector++)
+    partial |= good [sector];
+
+  if ((verbose == 1) && ! disk_info->concurrent)
+    {
+      printf ("%02d %d  queued %d %d\r", cylinder, head,
+	      queue_depth (& disk_info->pipeline->encode_q),
+	      queue_depth (& disk_info->pipeline->write_q));
+      fflush (stdout);
+    }
+  start_time = floppy_time (disk_info->floppy);
+  if (disk_info->multi_sector && ! partial)
+    read_track_multi (disk_info, cylinder, head, track_info, buf, good, seen);
+
+  /* fall back to single sector reads for sectors that failed */
+  for (sector = track_info->min_sector;
+       sector <= track_info->max_sector;
+       sector++)
+    tries [sector - track_info->min_sector] =
+      good [sector - track_info->min_sector] ? 0 : disk_info->max_retry;
+  if (disk_info->rev_time && ! track_info->timed)
+    learn_track_timing (disk_info, head, track_info);
+  synced = (track_info->timed &&
+	    read_id (disk_info, track_info->density == DENSITY_FM, head, & id));
+  if (synced)
+    {
+      sync_time = floppy_time (disk_info->floppy);
+      sync_angle = track_info->id_angle [id.sector];
+      synced = (sync_angle >= 0);
+    }
+
+  while (true)
+    {
+      now = floppy_time (disk_info->floppy);
+      if (synced)
+	sector = next_sector (disk_info, track_info, tries,
+			      sync_angle + (now - sync_time) / disk_info->rev_time,
+			      & wait);
+      else
+	for (sector = track_info->min_sector;
+	     (sector <= track_info->max_sector) &&
+	       ! tries [sector - track_info->min_sector];
+	     sector++)
+	  ;
+      if ((sector < 0) || (sector > track_info->max_sector))
+	break;
+
+      if (verbose == 2)
+	{
+	  printf ("%s%02d %d %02d\r", disk_info->tag, cylinder, head, sector);
+	  fflush (stdout);
+	}
+      else if (verbose == 3)
 	{
-	  printf ("%02d %d %02d: ", cylinder, head, sector);
+	  printf ("%s%02d %d %02d: ", disk_info->tag, cylinder, head, sector);
 	  fflush (stdout);
 	}
-      retry_count = disk_info->max_retry;
-      status = 0;
-      while ((! status) && (retry_count-- > 0))
+      tries [sector - track_info->min_sector]--;
+      if (votes)
+	status = read_sector_vote (disk_info, cylinder, head, sector,
+				   track_info,
+				   & votes [sector - track_info->min_sector],
+				   buf + (sector - track_info->min_sector) * sector_length);
+      else
 	status = read_sector (disk_info, cylinder, head, sector,
-			      track_info, buf);
+			      track_info,
+			      buf + (sector - track_info->min_sector) * sector_length);
+      if (status)
+	{
+	  tries [sector - track_info->min_sector] = 0;
+	  good [sector - track_info->min_sector] = true;
+	}
+      else if (votes ?
+	       (votes [sector - track_info->min_sector].count > 0) :
+	       (floppy_status (disk_info->floppy) [2] & ST2_DATA_ERROR))
+	seen [sector - track_info->min_sector] = true;
+
+      /* reads that take most of an extra revolution were issued too late
+	 to catch their IDs, so allow more time from now on.  A bad ID
+	 looks the same, but seldom twice running, and the margin creeps
+	 back down while reads are on time. */
+      if (! synced)
+	;
+      else if ((floppy_time (disk_info->floppy) - now) / disk_info->rev_time >
+	       wait + 0.5)
+	{
+	  if (late++ && (disk_info->margin < 0.5))
+	    disk_info->margin += MARGIN_STEP;
+	}
+      else
+	{
+	  late = 0;
+	  if (disk_info->margin > MARGIN_STEP)
+	    disk_info->margin -= MARGIN_STEP / 256;
+	}
+
       if (verbose == 3)
 	{
 	  printf ("%s\n", status ? "ok" : "err");
 	  fflush (stdout);
 	}
-      if (! status)
+      if ((! status) && ! tries [sector - track_info->min_sector])
 	{
 	  if (verbose)
 	    {
 	      printf ("\n");
 	      fflush (stdout);
 	    }
-	  fprintf (stderr, "error reading cyl %d head %d sect %d\n",
-		   cylinder, head, sector);
+	  fprintf (stderr, "%serror reading cyl %d head %d sect %d\n",
+		   disk_info->tag, cylinder, head, sector);
 #if 0
 	  exit (2);
 #endif
 	}
+    }
+
+  if (disk_info->rpm)
+    {
+      revolutions = ((floppy_time (disk_info->floppy) - start_time) *
+		     disk_info->rpm / 60.0);
+      disk_info->revolutions += revolutions;
+      disk_info->track_count++;
+      if (verbose >= 2)
+	printf ("%scyl %d head %d: %.2f revolutions\n",
+		disk_info->tag, cylinder, head,
+		revolutions);
+    }
+}
 
+
+/*
+ * The encoder stage formats each track in the DMK image, fills in its
+ * sectors and takes a copy of it in image file format for the writer.
+ * Raw images need no encoding, the sectors are already in file order.
+ */
+void *encoder_thread (void *arg)
+{
+  pipeline_t *pipeline = arg;
+  disk_info_t *disk_info = pipeline->disk_info;
+  track_job_t *job;
+  track_info_t *track_info;
+  int sector_length;
+  int sector;
+  double start;
+
+  do
+    {
+      job = queue_take (& pipeline->encode_q);
+      start = stage_time ();
+      if (job && (disk_info->image_type == DMK_IMAGE))
+	{
+	  track_info = job->track_info;
+	  sector_length = 128 << track_info->size_code;
+	  if (job->reread ?
+	      (! dmk_seek (disk_info->dmk_h, job->cylinder, job->head)) :
+	      (! dmk_image_seek_and_format (disk_info, track_info,
+					    job->cylinder, job->head)))
+	    {
+	      fprintf (stderr, "%serror seeking or formatting cyl %d head %d in DMK image\n",
+		       disk_info->tag, job->cylinder, job->head);
+	      exit (2);
+	    }
+	  for (sector = track_info->min_sector;
+	       sector <= track_info->max_sector;
+	       sector++)
+	    if (job->reread ?
+		job->read [sector - track_info->min_sector] :
+		(sector_good (& job->status, sector) ||
+		 job->seen [sector - track_info->min_sector]))
+	      write_sector (disk_info, job->cylinder, job->head, sector,
+			    track_info,
+			    job->buf + (sector - track_info->min_sector) * sector_length,
+			    job->data_mark [sector - track_info->min_sector],
+			    sector_good (& job->status, sector) ?
+			    NULL : & job->crc [sector - track_info->min_sector]);
+	  job->raw = malloc (pipeline->raw_length);
+	  if ((! job->raw) ||
+	      (! dmk_read_track_raw (disk_info->dmk_h, job->raw)))
+	    {
+	      fprintf (stderr, "%serror encoding cyl %d head %d\n",
+		       disk_info->tag, job->cylinder, job->head);
+	      exit (2);
+	    }
+	  /* the writer owns the track in the file from here on */
+	  dmk_mark_track_clean (disk_info->dmk_h);
+	}
+      pipeline->busy [STAGE_ENCODER] += stage_time () - start;
+      queue_put (& pipeline->write_q, job);
+    }
+  while (job);
+  return (NULL);
+}
+
+
+off_t raw_track_offset (disk_info_t *disk_info, int cylinder, int head)
+{
+  off_t offset = 0;
+  int i;
+
+  for (i = 0; i < cylinder * disk_info->head_count + head; i++)
+    offset += track_data_length (track_info_for (disk_info,
+						 i / disk_info->head_count,
+						 i % disk_info->head_count));
+  return (offset);
+}
+
+
+/*
+ * Record a track as captured once its data is safely in the image, so
+ * that a capture that dies later can be resumed after it.
+ */
+void checkpoint_track (pipeline_t *pipeline, track_job_t *job)
+{
+  disk_info_t *disk_info = pipeline->disk_info;
+  uint8_t record [CHECKPOINT_RECORD_LENGTH];
+
+  if (disk_info->checkpoint_fd < 0)
+    return;
+  record [0] = job->status.captured;
+  memcpy (& record [1], job->status.good, sizeof (job->status.good));
+  if ((fdatasync (pipeline->fd) != 0) ||
+      (pwrite (disk_info->checkpoint_fd, record, sizeof (record),
+	       CHECKPOINT_HEADER_LENGTH +
+	       (job->cylinder * MAX_HEADS + job->head) * sizeof (record)) !=
+       sizeof (record)))
+    fprintf (stderr, "%swarning: can't checkpoint cyl %d head %d\n",
+	     disk_info->tag, job->cylinder, job->head);
+}
+
+
+void *writer_thread (void *arg)
+{
+  pipeline_t *pipeline = arg;
+  disk_info_t *disk_info = pipeline->disk_info;
+  track_job_t *job;
+  track_info_t *track_info;
+  int sector_length;
+  int sector;
+  off_t offset;
+  double start;
+
+  while ((job = queue_take (& pipeline->write_q)))
+    {
+      start = stage_time ();
+      track_info = job->track_info;
       switch (disk_info->image_type)
 	{
 	case DMK_IMAGE:
+	  offset = (DMK_HEADER_LENGTH +
+		    ((off_t) job->cylinder * disk_info->head_count + job->head) *
+		    pipeline->raw_length);
+	  if (pwrite (pipeline->fd, job->raw, pipeline->raw_length, offset) !=
+	      pipeline->raw_length)
+	    {
+	      fprintf (stderr, "%serror writing image file\n", disk_info->tag);
+	      exit (2);
+	    }
+	  break;
+	case RAW_IMAGE:
+	  offset = raw_track_offset (disk_info, job->cylinder, job->head);
+	  sector_length = 128 << track_info->size_code;
+	  for (sector = 0;
+	       sector <= track_info->max_sector - track_info->min_sector;
+	       sector++)
+	    if (((! job->reread) || job->read [sector]) &&
+		(pwrite (pipeline->fd, job->buf + sector * sector_length,
+			 sector_length, offset + sector * sector_length) !=
+		 sector_length))
+	      {
+		fprintf (stderr, "%serror writing image file\n",
+			 disk_info->tag);
+		exit (2);
+	      }
+	  break;
+	}
+      checkpoint_track (pipeline, job);
+      free (job->seen);
+      free (job->crc);
+      free (job->data_mark);
+      free (job->read);
+      free (job->raw);
+      free (job->buf);
+      free (job);
+      pipeline->busy [STAGE_WRITER] += stage_time () - start;
+    }
+  return (NULL);
+}
+
+
+/*
+ * Read whatever of a track is still missing from the image, and queue
+ * it for the encoder.
+ */
+void capture_track (disk_info_t *disk_info, int cylinder, int head)
+{
+  pipeline_t *pipeline = disk_info->pipeline;
+  track_info_t *track_info = track_info_for (disk_info, cylinder, head);
+  track_status_t *status = & disk_info->track_status [cylinder * MAX_HEADS + head];
+  int sector_count = (track_info->max_sector - track_info->min_sector) + 1;
+  int sector_length = 128 << track_info->size_code;
+  track_job_t *job;
+  bool *good;
+  sector_votes_t *votes = NULL;
+  sector_info_t sector_info;
+  uint8_t *data;
+  uint16_t crc;
+  int sector, i;
+  double start;
+
+  start = stage_time ();
+  job = calloc (1, sizeof (track_job_t));
+  good = calloc (sector_count, sizeof (bool));
+  if (job)
+    {
+      job->buf = calloc (sector_count, sector_length);
+      job->read = calloc (sector_count, sizeof (bool));
+      job->crc = calloc (sector_count, sizeof (uint16_t));
+      job->data_mark = calloc (sector_count, sizeof (uint8_t));
+      job->seen = calloc (sector_count, sizeof (bool));
+    }
+  if (disk_info->vote)
+    votes = calloc (sector_count, sizeof (sector_votes_t));
+  if ((! job) || (! good) || (! job->buf) || (! job->read) || (! job->crc) ||
+      (! job->data_mark) || (! job->seen) || (disk_info->vote && ! votes))
+    {
+      fprintf (stderr, "%sout of memory\n", disk_info->tag);
+      exit (2);
+    }
+  for (sector = track_info->min_sector;
+       sector <= track_info->max_sector;
+       sector++)
+    good [sector - track_info->min_sector] = (status->captured &&
+					      sector_good (status, sector));
+
+  /* take sectors that earlier captures read correctly, and in recovery
+     mode count their bad reads as votes */
+  for (i = 0; i < disk_info->merge_count; i++)
+    {
+      if (! dmk_seek (disk_info->merge_h [i], cylinder, head))
+	continue;
+      for (sector = track_info->min_sector;
+	   sector <= track_info->max_sector;
+	   sector++)
+	{
+	  if (good [sector - track_info->min_sector])
+	    continue;
+	  data = job->buf + (sector - track_info->min_sector) * sector_length;
 	  sector_info.cylinder  = cylinder;
 	  sector_info.head      = head;
 	  sector_info.sector    = sector;
 	  sector_info.size_code = track_info->size_code;
 	  sector_info.mode      = (track_info->density == DENSITY_FM) ? DMK_FM : DMK_MFM;
-	  if (! dmk_write_sector (disk_info->dmk_h,
-				  & sector_info,
-				  buf))
-	    {
-	      fprintf (stderr, "error writing sector %d/%d/%d to DMK image file\n",
-		       cylinder, head, sector);
-	      /* exit (2); */
-	    }
-	  break;
-	case RAW_IMAGE:
-	  if (1 != fwrite (buf, 128 << track_info->size_code, 1,
-			   disk_info->image_f))
+	  switch (dmk_read_sector_with_crcs (disk_info->merge_h [i],
+					     & sector_info, data, & crc, NULL))
 	    {
-	      fprintf (stderr, "error writing image file\n");
-	      exit (2);
+	    case 1:
+	      good [sector - track_info->min_sector] = true;
+	      job->data_mark [sector - track_info->min_sector] =
+		sector_info.data_mark;
+	      break;
+	    case -1:
+	      job->seen [sector - track_info->min_sector] = true;
+	      if (votes)
+		add_vote (& votes [sector - track_info->min_sector],
+			  sector_length, data, crc);
+	      break;
 	    }
-	  break;
 	}
     }
+  if (votes)
+    for (sector = track_info->min_sector;
+	 sector <= track_info->max_sector;
+	 sector++)
+      {
+	i = sector - track_info->min_sector;
+	if ((! good [i]) && votes [i].count &&
+	    vote_sector (& votes [i], cylinder, head, sector, track_info,
+			 job->buf + i * sector_length, & crc))
+	  good [i] = true;
+      }
+
+  job->cylinder = cylinder;
+  job->head = head;
+  job->track_info = track_info;
+  job->reread = status->captured;
+  read_track (disk_info, cylinder, head, track_info, job->buf, good,
+	      job->seen, votes);
+
+  /* bad sectors that were read at all are kept with a CRC that doesn't
+     match, voted on if possible; the others are left without a data
+     field */
+  for (sector = track_info->min_sector;
+       sector <= track_info->max_sector;
+       sector++)
+    {
+      i = sector - track_info->min_sector;
+      if (good [i] || ! job->seen [i])
+	continue;
+      data = job->buf + i * sector_length;
+      if (votes && votes [i].count)
+	good [i] = vote_sector (& votes [i], cylinder, head, sector,
+				track_info, data, & job->crc [i]);
+      else
+	{
+	  sector_info.cylinder  = cylinder;
+	  sector_info.head      = head;
+	  sector_info.sector    = sector;
+	  sector_info.size_code = track_info->size_code;
+	  sector_info.mode      = (track_info->density == DENSITY_FM) ? DMK_FM : DMK_MFM;
+	  sector_info.data_mark = 0xfb;
+	  job->crc [i] = ~ dmk_data_crc (& sector_info, data);
+	}
+    }
+  if (votes)
+    {
+      for (i = 0; i < sector_count; i++)
+	{
+	  if (votes [i].data_mark)
+	    job->data_mark [i] = votes [i].data_mark;
+	  free (votes [i].reads);
+	}
+      free (votes);
+    }
+
+  for (sector = track_info->min_sector;
+       sector <= track_info->max_sector;
+       sector++)
+    if (good [sector - track_info->min_sector] &&
+	! (status->captured && sector_good (status, sector)))
+      {
+	job->read [sector - track_info->min_sector] = true;
+	status->good [sector >> 3] |= 1 << (sector & 7);
+      }
+  status->captured = true;
+  job->status = *status;
+  free (good);
+
+  pipeline->busy [STAGE_DEVICE] += stage_time () - start;
+  queue_put (& pipeline->encode_q, job);
 }
 
 
+/*
+ * The calling thread is the device stage: it only reads tracks, handing
+ * each to the encoder as soon as it's read, so that the drive goes
+ * straight on to the next track while earlier ones are encoded and
+ * written.
+ */
 void read_disk (disk_info_t *disk_info)
 {
   int cylinder, head;
-  int track_info_cylinder;
-  track_info_t *track_info;
-
-  for (cylinder = 0; cylinder < disk_info->cylinder_count; cylinder++)
+  int pass, bad;
+  bool sought;
+  pipeline_t pipeline;
+  pthread_t encoder, writer;
+
+  memset (& pipeline, 0, sizeof (pipeline));
+  pipeline.disk_info = disk_info;
+  pipeline.fd = -1;
+  disk_info->pipeline = & pipeline;
+  if (disk_info->image_type == DMK_IMAGE)
+    pipeline.raw_length = dmk_raw_track_length (disk_info->dmk_h);
+  pipeline.fd = open (disk_info->image_fn, O_WRONLY);
+  if (pipeline.fd < 0)
     {
-      /* if we don't have track info on all cylinders, assume that
-	 all the cylinders past the last one we have info for are the
-	 same as that one. */
-      track_info_cylinder = cylinder;
-      if (track_info_cylinder > (disk_info->track_info_cylinders - 1))
-	track_info_cylinder = disk_info->track_info_cylinders - 1;
+      perror (disk_info->image_fn);
+      exit (2);
+    }
+  if ((! queue_init (& pipeline.encode_q)) ||
+      (! queue_init (& pipeline.write_q)) ||
+      pthread_create (& encoder, NULL, encoder_thread, & pipeline) ||
+      pthread_create (& writer, NULL, writer_thread, & pipeline))
+    {
+      fprintf (stderr, "%scan't start pipeline\n", disk_info->tag);
+      exit (2);
+    }
 
-      if (! seek (disk_info, cylinder))
-	{
-	  fprintf (stderr, "error seeking\n");
-	  exit (2);
-	}
-      for (head = 0; head < disk_info->head_count; head++)
+  /* the first pass reads every track not yet captured, and on resuming
+     retries the bad sectors of those that were; any later passes only
+     retry bad sectors */
+  for (pass = 0; pass <= disk_info->reread_passes; pass++)
+    {
+      bad = 0;
+      for (cylinder = 0; cylinder < disk_info->cylinder_count; cylinder++)
+	for (head = 0; head < disk_info->head_count; head++)
+	  bad += bad_sector_count (disk_info, cylinder, head);
+      if (! bad)
+	break;
+      if (pass && verbose)
+	printf ("\n%sre-read pass %d, %d bad sectors\n", disk_info->tag,
+		pass, bad);
+      __atomic_store_n (& disk_info->progress.pass, pass, __ATOMIC_RELAXED);
+
+      for (cylinder = 0; cylinder < disk_info->cylinder_count; cylinder++)
 	{
-	  track_info = & disk_info->track_info [(cylinder != 0) * MAX_HEADS + head];
-	  read_track (disk_info, cylinder, head, track_info);
+	  sought = false;
+	  for (head = 0; head < disk_info->head_count; head++)
+	    {
+	      if (! bad_sector_count (disk_info, cylinder, head))
+		continue;
+	      if ((! sought) && ! seek (disk_info, cylinder))
+		{
+		  fprintf (stderr, "%serror seeking\n", disk_info->tag);
+		  exit (2);
+		}
+	      sought = true;
+	      __atomic_store_n (& disk_info->progress.cylinder, cylinder,
+				__ATOMIC_RELAXED);
+	      __atomic_store_n (& disk_info->progress.head, head,
+				__ATOMIC_RELAXED);
+	      capture_track (disk_info, cylinder, head);
+	      __atomic_add_fetch (& disk_info->progress.tracks, 1,
+				  __ATOMIC_RELAXED);
+	    }
 	}
     }
 
   if (! recalibrate (disk_info))
     {
-      fprintf (stderr, "error recalibrating drive\n");
+      fprintf (stderr, "%serror recalibrating drive\n", disk_info->tag);
     }
 
+  queue_put (& pipeline.encode_q, NULL);
+  pthread_join (encoder, NULL);
+  pthread_join (writer, NULL);
+  if ((pipeline.fd >= 0) && (close (pipeline.fd) != 0))
+    {
+      perror (disk_info->image_fn);
+      exit (2);
+    }
+  queue_free (& pipeline.encode_q);
+  queue_free (& pipeline.write_q);
+  disk_info->pipeline = NULL;
+
   if (verbose)
-    printf ("\n");
+    {
+      /* one block per drive, however many are running */
+      flockfile (stdout);
+      if (! disk_info->concurrent)
+	printf ("\n");
+      if (disk_info->track_count)
+	printf ("%s%.2f revolutions per track\n", disk_info->tag,
+		disk_info->revolutions / disk_info->track_count);
+      printf ("%sbusy: device %.2f s, encoder %.2f s, writer %.2f s\n",
+	      disk_info->tag, pipeline.busy [STAGE_DEVICE],
+	      pipeline.busy [STAGE_ENCODER], pipeline.busy [STAGE_WRITER]);
+      printf ("%squeue depth: encoder max %d, writer max %d; device stalled %d times\n",
+	      disk_info->tag, pipeline.encode_q.max_depth,
+	      pipeline.write_q.max_depth, pipeline.encode_q.stalls);
+      funlockfile (stdout);
+    }
 }
 
 
 int open_drive (disk_info_t *disk_info, char *fn)
 {
-  struct floppy_drive_params fdp;
+  int cmos = 0, tracks = 0, rpm = 0;
 
-  disk_info->floppy_dev = open (fn, O_RDONLY | O_NDELAY, 0);
-  if (! disk_info->floppy_dev)
+  disk_info->floppy = floppy_open (fn);
+  if (! disk_info->floppy)
     return (false);
 
-#if 0
-  if (0 > ioctl (disk_info->floppy_dev, FDMSGON, NULL))
-    {
-      fprintf (stderr, "can't enable floppy driver debug messages\n");
-      return (false);
-    }
-#endif
-
   if (! reset_drive (disk_info))
     {
-      fprintf (stderr, "can't reset drive\n");
+      fprintf (stderr, "%scan't reset drive\n", disk_info->tag);
       return (false);
     }
 
-  if (0 > ioctl (disk_info->floppy_dev, FDGETDRVPRM, & fdp))
-    fprintf (stderr, "can't get drive parameters\n");
+  if (! floppy_drive_params (disk_info->floppy, & cmos, & tracks, & rpm))
+    fprintf (stderr, "%scan't get drive parameters\n", disk_info->tag);
+  disk_info->rpm = rpm;
+  if (rpm)
+    disk_info->rev_time = 60.0 / rpm;
+  disk_info->margin = MARGIN_STEP;
 
   if (verbose >= 2)
     {
-      printf ("drive parameters:\n");
-      printf ("cmos: %d\n", fdp.cmos);
-      printf ("tracks: %d\n", fdp.tracks);
-      printf ("rpm: %d\n", fdp.rps * 60);
+      printf ("%sdrive parameters:\n", disk_info->tag);
+      printf ("%scmos: %d\n", disk_info->tag, cmos);
+      printf ("%stracks: %d\n", disk_info->tag, tracks);
+      printf ("%srpm: %d\n", disk_info->tag, rpm);
     }
 
   if (disk_info->data_rate == FD_RATE_NOT_SET)
     {
-      switch (fdp.rps)
+      switch (rpm)
 	{
-	case 6:	disk_info->data_rate = FD_RATE_300_KBPS; break;
-	case 5:	disk_info->data_rate = FD_RATE_250_KBPS; break;
+	case 360: disk_info->data_rate = FD_RATE_300_KBPS; break;
+	case 300: disk_info->data_rate = FD_RATE_250_KBPS; break;
 	default:
-	  fprintf (stderr, "unknown drive type, data rate must be specified\n");
+	  fprintf (stderr, "%sunknown drive type, data rate must be specified\n",
+		   disk_info->tag);
 	  return (false);
 	}
       
@@ -829,7 +2070,7 @@ int open_drive (disk_info_t *disk_info, char *fn)
 
   if (! recalibrate (disk_info))
     {
-      fprintf (stderr, "error recalibrating drive\n");
+      fprintf (stderr, "%serror recalibrating drive\n", disk_info->tag);
       return (false);
     }
 
@@ -841,11 +2082,12 @@ void print_disk_info (FILE *f, disk_info_t *disk_info)
 {
   int cylinder, head;
 
-  fprintf (f, "%s sided\n", (disk_info->head_count - 1) ? "double" : "single");
+  fprintf (f, "%s%s sided\n",
+	   disk_info->tag, (disk_info->head_count - 1) ? "double" : "single");
   for (cylinder = 0; cylinder < disk_info->track_info_cylinders; cylinder++)
     for (head = 0; head < disk_info->head_count; head++)
       {
-	fprintf (f, "cylinder %d head %d: ", cylinder, head);
+	fprintf (f, "%scylinder %d head %d: ", disk_info->tag, cylinder, head);
 	print_track_info (f, & disk_info->track_info [cylinder * MAX_HEADS + head]);
       }
 }
@@ -866,22 +2108,314 @@ int sector_length_to_size_code (int sector_length)
 }
 
 
+/*
+ * One drive's capture, with the options it was given.  When several
+ * drives are read at once each capture runs on its own thread, with its
+ * own device, pipeline and image; they share nothing that any of them
+ * writes, so none waits on another.
+ */
+typedef struct
+{
+  disk_info_t disk_info;
+  char *drive_fn;
+  bool manual;
+  int sector_length;
+  int auto_flags;
+  bool auto_all_cylinders;
+  bool resume;
+  int bad;            /* sectors not read */
+  int status;         /* to exit with */
+  pthread_t thread;
+} capture_t;
+
+
+/* "name: ", to prefix a drive's messages with its image file name */
+char *tag_name (char *image_fn)
+{
+  char *tag;
+
+  tag = malloc (strlen (image_fn) + 3);
+  if (tag)
+    sprintf (tag, "%s: ", image_fn);
+  return (tag);
+}
+
+
+/* returns the exit status */
+int capture_disk (capture_t *c)
+{
+  disk_info_t *disk_info = & c->disk_info;
+  density_t density;
+  int ds, cylinders, dd;
+  int cylinder, head;
+  int i;
+
+  disk_info->checkpoint_fn = malloc (strlen (disk_info->image_fn) +
+				     sizeof (CHECKPOINT_EXT));
+  if (! disk_info->checkpoint_fn)
+    {
+      fprintf (stderr, "%sout of memory\n", disk_info->tag);
+      return (2);
+    }
+  sprintf (disk_info->checkpoint_fn, "%s" CHECKPOINT_EXT, disk_info->image_fn);
+  if (c->resume)
+    {
+      switch (checkpoint_load (disk_info))
+	{
+	case 1:
+	  printf ("%sresuming capture from %s\n", disk_info->tag,
+		  disk_info->checkpoint_fn);
+	  break;
+	case 0:
+	  printf ("%sno checkpoint, starting from the beginning\n",
+		  disk_info->tag);
+	  c->resume = false;
+	  break;
+	default:
+	  return (2);
+	}
+    }
+
+  if (! open_drive (disk_info, c->drive_fn))
+    {
+      fprintf (stderr, "%serror opening drive\n", disk_info->tag);
+      return (2);
+    }
+
+  /* on resume, how many cylinders were autodetected comes from the
+     checkpoint along with the rest of the geometry */
+  if (c->auto_all_cylinders && ! c->resume)
+    disk_info->track_info_cylinders = disk_info->cylinder_count;
+  else if (c->auto_all_cylinders &&
+	   (disk_info->track_info_cylinders != disk_info->cylinder_count))
+    fprintf (stderr, "%s-aa ignored, resuming with the checkpoint's "
+	     "geometry\n", disk_info->tag);
+
+  if (c->resume)
+    ;  /* the geometry comes from the checkpoint */
+  else if (c->manual)
+    {
+      if (c->sector_length == 0)
+	c->sector_length =
+	  (disk_info->track_info [0].density == DENSITY_FM) ? 128 : 256;
+
+      disk_info->track_info [0].size_code =
+	sector_length_to_size_code (c->sector_length);
+      disk_info->track_info [0].log_head = 0;
+
+      for (i = 1; i < (disk_info->track_info_cylinders * MAX_HEADS); i++)
+	{
+	  memcpy (& disk_info->track_info [i],
+		  & disk_info->track_info [0],
+		  sizeof (track_info_t));
+	  disk_info->track_info [i].log_head = (i & 1);
+	}
+    }
+  else
+    {
+      printf ("%sAttempting automatic disk characteristics discovery.\n",
+	      disk_info->tag);
+      fflush (stdout);
+      if (! try_disk (disk_info, c->auto_flags))
+	{
+	  fprintf (stderr, "%sauto detect failed\n", disk_info->tag);
+	  return (2);
+	}
+      if (!(c->auto_flags & AUTO_TRY_SS) && (disk_info->cylinder_count == 1))
+	{
+	  fprintf (stderr, "%sauto detected single side only\n",
+		   disk_info->tag);
+	  return (2);
+	}
+    }
+
+  if (c->manual && ! c->resume)
+    {
+      if ((c->auto_flags & AUTO_TRY_SD) && ! (c->auto_flags & AUTO_TRY_DD))
+	density = DENSITY_FM;
+      else if ((c->auto_flags & AUTO_TRY_DD) &&
+	       ! (c->auto_flags & AUTO_TRY_SD))
+	density = DENSITY_MFM;
+      else
+	{
+	  fprintf (stderr, "%sdensity not specified?\n", disk_info->tag);
+	  return (2);
+	}
+      for (i = 0; i < (disk_info->track_info_cylinders * MAX_HEADS); i++)
+	{
+	  disk_info->track_info [i].density = density;
+	}
+    }
+  else
+    {
+      density = DENSITY_FM;
+      for (i = 0; i < (disk_info->track_info_cylinders * MAX_HEADS); i++)
+	{
+	  /* don't check density of head 1 if it isn't used */
+	  if ((i & 1) && (disk_info->head_count != 2))
+	    continue;
+	  if (disk_info->track_info [i].density != DENSITY_FM)
+	    density = DENSITY_MFM;
+	}
+    }
+
+  /* following is only for debugging the command parsing */
+  flockfile (stdout);
+  print_disk_info (stdout, disk_info);
+  funlockfile (stdout);
+
+  switch (disk_info->image_type)
+    {
+    case DMK_IMAGE:
+      if (c->resume)
+	{
+	  disk_info->dmk_h = dmk_open_image (disk_info->image_fn, 1,
+					     & ds, & cylinders, & dd);
+	  if (! disk_info->dmk_h)
+	    {
+	      fprintf (stderr, "%serror opening output file\n",
+		       disk_info->tag);
+	      return (2);
+	    }
+	  if ((ds != (disk_info->head_count == 2)) ||
+	      (cylinders != disk_info->cylinder_count))
+	    {
+	      fprintf (stderr, "%simage doesn't match the checkpoint\n",
+		       disk_info->tag);
+	      return (2);
+	    }
+	  break;
+	}
+      disk_info->dmk_h = dmk_create_image (disk_info->image_fn,
+					   disk_info->head_count == 2,
+					   disk_info->cylinder_count,
+					   density == DENSITY_MFM, /* dd */
+					   360, /* RPM */
+					   (density == DENSITY_MFM) ? 500 : 250); /* rate */
+      /* lay out the file now, so the writer can fill in each track as
+	 it is read */
+      if ((! disk_info->dmk_h) || (! dmk_save_image (disk_info->dmk_h)))
+	{
+	  fprintf (stderr, "%serror opening output file\n", disk_info->tag);
+	  return (2);
+	}
+      break;
+    case RAW_IMAGE:
+      disk_info->image_f = fopen (disk_info->image_fn,
+				  c->resume ? "r+b" : "wb");
+      if (! disk_info->image_f)
+	{
+	  fprintf (stderr, "%serror opening output file\n", disk_info->tag);
+	  return (2);
+	}
+      break;
+    }
+
+  if ((! c->resume) && ! checkpoint_create (disk_info))
+    fprintf (stderr, "%swarning: capture can't be resumed\n", disk_info->tag);
+
+  read_disk (disk_info);
+
+  if (verbose)
+    printf ("%sdrive time %.2f s\n", disk_info->tag,
+	    floppy_time (disk_info->floppy));
+  floppy_close (disk_info->floppy);
+
+  switch (disk_info->image_type)
+    {
+    case DMK_IMAGE:
+      dmk_close_image (disk_info->dmk_h);
+      break;
+    case RAW_IMAGE:
+      fclose (disk_info->image_f);
+      break;
+    }
+
+
+  c->bad = 0;
+  for (cylinder = 0; cylinder < disk_info->cylinder_count; cylinder++)
+    for (head = 0; head < disk_info->head_count; head++)
+      c->bad += bad_sector_count (disk_info, cylinder, head);
+  if (disk_info->checkpoint_fd >= 0)
+    {
+      close (disk_info->checkpoint_fd);
+      if (! c->bad)
+	unlink (disk_info->checkpoint_fn);
+    }
+
+  return (0);
+}
+
+
+void *capture_thread (void *arg)
+{
+  capture_t *c = arg;
+
+  c->status = capture_disk (c);
+  __atomic_store_n (& c->disk_info.progress.done, true, __ATOMIC_RELEASE);
+  return (NULL);
+}
+
+
+/*
+ * Show the track each drive has got to, on one line, until all are
+ * done.  Only reads the captures' progress, so never holds them up.
+ */
+void report_progress (capture_t **captures, int count)
+{
+  struct timespec delay = { 0, 250000000 };
+  progress_t *p;
+  bool done;
+  int i;
+
+  for (;;)
+    {
+      done = true;
+      for (i = 0; i < count; i++)
+	{
+	  p = & captures [i]->disk_info.progress;
+	  if (! __atomic_load_n (& p->done, __ATOMIC_ACQUIRE))
+	    done = false;
+	  printf ("%s%02d %d", captures [i]->disk_info.tag,
+		  __atomic_load_n (& p->cylinder, __ATOMIC_RELAXED),
+		  __atomic_load_n (& p->head, __ATOMIC_RELAXED));
+	  if (__atomic_load_n (& p->pass, __ATOMIC_RELAXED))
+	    printf (" re-read %d", __atomic_load_n (& p->pass,
+						  __ATOMIC_RELAXED));
+	  printf ("   ");
+	}
+      printf ("\r");
+      fflush (stdout);
+      if (done)
+	break;
+      nanosleep (& delay, NULL);
+    }
+  printf ("\n");
+}
+
+
 int main (int argc, char *argv[])
 {
-  char *drive_fn = NULL;
-  char *image_fn = NULL;
+  char *drive_fn [MAX_DRIVES];
+  char *image_fn [MAX_DRIVES];
+  int drive_count = 0, image_count = 0;
 
   bool manual = 0;
   int sector_length = 0;
-  density_t density;
   int auto_flags = AUTO_TRY_SS | AUTO_TRY_DS | AUTO_TRY_SD | AUTO_TRY_DD;
   bool auto_all_cylinders = 0;
+  bool resume = false;
+  int ds, cylinders, dd;
+  capture_t *captures [MAX_DRIVES];
+  capture_t *c;
+  double start;
+  int tracks, status;
 
   int i;
 
   disk_info_t disk_info =
   {
-    0,    /* floppy_dev */
+    NULL, /* floppy */
 
     DMK_IMAGE,  /* image_type */
     NULL,       /* dmk_h */
@@ -903,6 +2437,7 @@ int main (int argc, char *argv[])
   };
 
   progname = argv [0];
+  disk_info.checkpoint_fd = -1;
 
   printf ("%s version $Rev$\n", progname);
   printf ("Copyright 2002, 2003 Eric Smith <eric@brouhaha.com>\n");
@@ -917,9 +2452,9 @@ int main (int argc, char *argv[])
 	    disk_info.image_type = DMK_IMAGE;
 	  else if (strcmp (argv [1], "-d") == 0)
 	    {
-	      if ((drive_fn) || (argc < 3))
+	      if ((drive_count >= MAX_DRIVES) || (argc < 3))
 		usage ();
-	      drive_fn = argv [2];
+	      drive_fn [drive_count++] = argv [2];
 	      argc--;
 	      argv++;
 	    }
@@ -985,6 +2520,35 @@ int main (int argc, char *argv[])
 	      argc--;
 	      argv++;
 	    }
+	  else if (strcmp (argv [1], "-ms") == 0)
+	    disk_info.multi_sector = true;
+	  else if (strcmp (argv [1], "-rp") == 0)
+	    {
+	      if (argc < 3)
+		usage ();
+	      disk_info.reread_passes = atoi (argv [2]);
+	      argc--;
+	      argv++;
+	    }
+	  else if (strcmp (argv [1], "-resume") == 0)
+	    resume = true;
+	  else if (strcmp (argv [1], "-vote") == 0)
+	    disk_info.vote = true;
+	  else if (strcmp (argv [1], "-merge") == 0)
+	    {
+	      if ((argc < 3) || (disk_info.merge_count >= MAX_MERGE))
+		usage ();
+	      disk_info.merge_h [disk_info.merge_count] =
+		dmk_open_image (argv [2], 0, & ds, & cylinders, & dd);
+	      if (! disk_info.merge_h [disk_info.merge_count])
+		{
+		  fprintf (stderr, "error opening %s\n", argv [2]);
+		  exit (2);
+		}
+	      disk_info.merge_count++;
+	      argc--;
+	      argv++;
+	    }
 	  else if (strcmp (argv [1], "-v") == 0)
 	    {
 	      verbose++;
@@ -995,8 +2559,8 @@ int main (int argc, char *argv[])
 	      usage ();
 	    }
 	}
-      else if (! image_fn)
-	image_fn = argv [1];
+      else if (image_count < MAX_DRIVES)
+	image_fn [image_count++] = argv [1];
       else
 	{
 	  fprintf (stderr, "unrecognized argument '%s'\n", argv [1]);
@@ -1006,126 +2570,100 @@ int main (int argc, char *argv[])
       argv++;
     }
 
-  if (! drive_fn)
-    drive_fn = "/dev/fd0";
+  if (! drive_count)
+    drive_fn [drive_count++] = "/dev/fd0";
 
-  if (! image_fn)
+  if (! image_count)
     {
       fprintf (stderr, "must specify image file name\n");
       usage ();
     }
-
-  if (! open_drive (& disk_info, drive_fn))
+  if (image_count != drive_count)
     {
-      fprintf (stderr, "error opening drive\n");
-      exit (2);
+      fprintf (stderr, "must specify one image file per drive\n");
+      usage ();
     }
-
-  if (auto_all_cylinders)
-    disk_info.track_info_cylinders = disk_info.cylinder_count;
-
-  if (manual)
+  if ((drive_count > 1) && disk_info.merge_count)
     {
-      if (sector_length == 0)
-	sector_length = (disk_info.track_info [0].density == DENSITY_FM) ? 128 : 256;
-
-      disk_info.track_info [0].size_code = sector_length_to_size_code (sector_length);
-      disk_info.track_info [0].log_head = 0;
-
-      for (i = 1; i < (disk_info.track_info_cylinders * MAX_HEADS); i++)
-	{
-	  memcpy (& disk_info.track_info [i],
-		  & disk_info.track_info [0],
-		  sizeof (track_info_t));
-	  disk_info.track_info [i].log_head = (i & 1);
-	}
+      fprintf (stderr, "can't merge when reading several drives\n");
+      usage ();
     }
-  else
+
+  if (disk_info.cylinder_count > MAX_CYLINDERS)
     {
-      printf ("Attempting automatic disk characteristics discovery.\n");
-      fflush (stdout);
-      if (! try_disk (& disk_info, auto_flags))
-	{
-	  fprintf (stderr, "auto detect failed\n");
-	  exit (2);
-	}
-      if (!(auto_flags & AUTO_TRY_SS) && (disk_info.cylinder_count == 1))
-	{
-	  fprintf (stderr, "auto detected single side only\n");
-	  exit (2);
-	}
+      fprintf (stderr, "at most %d cylinders\n", MAX_CYLINDERS);
+      exit (1);
     }
+  /* same for every drive, so rejected before any are started */
+  if (sector_length)
+    sector_length_to_size_code (sector_length);
 
-  if (manual)
+  disk_info.concurrent = (drive_count > 1);
+  for (i = 0; i < drive_count; i++)
     {
-      if ((auto_flags & AUTO_TRY_SD) && ! (auto_flags & AUTO_TRY_DD))
-	density = DENSITY_FM;
-      else if ((auto_flags & AUTO_TRY_DD) && ! (auto_flags & AUTO_TRY_SD))
-	density = DENSITY_MFM;
-      else
+      c = calloc (1, sizeof (capture_t));
+      if (! c)
 	{
-	  fprintf (stderr, "density not specified?\n");
+	  fprintf (stderr, "out of memory\n");
 	  exit (2);
 	}
-      for (i = 0; i < (disk_info.track_info_cylinders * MAX_HEADS); i++)
-	{
-	  disk_info.track_info [i].density = density;
-	}
-    }
-  else
-    {
-      density = DENSITY_FM;
-      for (i = 0; i < (disk_info.track_info_cylinders * MAX_HEADS); i++)
+      c->disk_info = disk_info;
+      c->disk_info.image_fn = image_fn [i];
+      c->disk_info.tag = "";
+      if (disk_info.concurrent)
 	{
-	  /* don't check density of head 1 if it isn't used */
-	  if ((i & 1) && (disk_info.head_count != 2))
-	    continue;
-	  if (disk_info.track_info [i].density != DENSITY_FM)
-	    density = DENSITY_MFM;
+	  c->disk_info.tag = tag_name (image_fn [i]);
+	  if (! c->disk_info.tag)
+	    {
+	      fprintf (stderr, "out of memory\n");
+	      exit (2);
+	    }
 	}
+      c->drive_fn = drive_fn [i];
+      c->manual = manual;
+      c->sector_length = sector_length;
+      c->auto_flags = auto_flags;
+      c->auto_all_cylinders = auto_all_cylinders;
+      c->resume = resume;
+      captures [i] = c;
     }
 
-  /* following is only for debugging the command parsing */
-  print_disk_info (stdout, & disk_info);
-
-  switch (disk_info.image_type)
+  start = stage_time ();
+  if (drive_count == 1)
+    capture_thread (captures [0]);
+  else
     {
-    case DMK_IMAGE:
-      disk_info.dmk_h = dmk_create_image (image_fn,
-					  disk_info.head_count == 2,
-					  disk_info.cylinder_count,
-					  density == DENSITY_MFM, /* dd */
-					  360, /* RPM */
-					  (density == DENSITY_MFM) ? 500 : 250); /* rate */
-      if (! disk_info.dmk_h)
-	{
-	  fprintf (stderr, "error opening output file\n");
-	  exit (2);
-	}
-      break;
-    case RAW_IMAGE:
-      disk_info.image_f = fopen (image_fn, "wb");
-      if (! disk_info.image_f)
-	{
-	  fprintf (stderr, "error opening output file\n");
-	  exit (2);
-	}
-      break;
+      for (i = 0; i < drive_count; i++)
+	if (pthread_create (& captures [i]->thread, NULL, capture_thread,
+			    captures [i]))
+	  {
+	    fprintf (stderr, "can't start capture\n");
+	    exit (2);
+	  }
+      if (verbose == 1)
+	report_progress (captures, drive_count);
+      for (i = 0; i < drive_count; i++)
+	pthread_join (captures [i]->thread, NULL);
     }
 
-  read_disk (& disk_info);
+  for (i = 0; i < disk_info.merge_count; i++)
+    dmk_close_image (disk_info.merge_h [i]);
 
-  close (disk_info.floppy_dev);
-
-  switch (disk_info.image_type)
+  status = 0;
+  tracks = 0;
+  for (i = 0; i < drive_count; i++)
     {
-    case DMK_IMAGE:
-      dmk_close_image (disk_info.dmk_h);
-      break;
-    case RAW_IMAGE:
-      fclose (disk_info.image_f);
-      break;
+      c = captures [i];
+      if (c->bad)
+	fprintf (stderr, "%s%d sectors not read, use -resume to retry them\n",
+		 c->disk_info.tag, c->bad);
+      if (c->status > status)
+	status = c->status;
+      tracks += c->disk_info.progress.tracks;
     }
+  if (verbose && (drive_count > 1))
+    printf ("%d drives: %d tracks in %.2f s\n", drive_count, tracks,
+	    stage_time () - start);
 
-  exit (0);
+  exit (status);
 }